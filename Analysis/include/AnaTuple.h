@@ -0,0 +1,148 @@
+/*! Definition of AnaTuple, the analysis-ready tuple with the per-event results of the analyzer selection.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <limits>
+
+#include "AnalysisTools/Core/include/SmartTree.h"
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "EventSelectionCache.h"
+
+#define ANA_EVENT_DATA() \
+    VAR(UInt_t, run) /* run number */ \
+    VAR(UInt_t, lumi) /* lumi section */ \
+    VAR(ULong64_t, evt) /* event number */ \
+    VAR(Int_t, eventEnergyScale) /* event energy scale */ \
+    VAR(ULong64_t, regions) /* event region for each category, see EventSelectionRecord */ \
+    VAR(UInt_t, categories) /* bit mask of the event categories */ \
+    VAR(UInt_t, subCategories) /* bit mask of the event sub-categories */ \
+    VAR(UInt_t, bjet_first) /* index of the first selected jet */ \
+    VAR(UInt_t, bjet_second) /* index of the second selected jet */ \
+    VAR(Bool_t, has_bjet_pair) /* both b-jet candidates are selected */ \
+    VAR(Double_t, weight) /* MC correction weight without the cross-section scale factor; 1 for data */ \
+    VAR(Int_t, npv) /* number of primary vertices */ \
+    VAR(Int_t, n_jets) /* number of jets */ \
+    VAR(Double_t, pt_1) /* pt of the first leg */ \
+    VAR(Double_t, eta_1) /* eta of the first leg */ \
+    VAR(Double_t, iso_1) /* isolation of the first leg */ \
+    VAR(Double_t, mt_1) /* transverse mass of the first leg with PF MET */ \
+    VAR(Double_t, pt_2) /* pt of the second leg */ \
+    VAR(Double_t, eta_2) /* eta of the second leg */ \
+    VAR(Double_t, mt_2) /* transverse mass of the second leg with PF MET */ \
+    VAR(Double_t, MET_pt) /* MET pt */ \
+    VAR(Double_t, MET_phi) /* MET phi */ \
+    VAR(Double_t, m_vis) /* visible mass of the tau pair */ \
+    VAR(Double_t, m_sv) /* SVfit mass of the tau pair */ \
+    VAR(Double_t, m_bb) /* mass of the b-jet pair */ \
+    VAR(Double_t, m_ttbb) /* mass of the tau pair (SVfit) and the b-jet pair */ \
+    VAR(Double_t, pt_b1) /* pt of the first b-jet */ \
+    VAR(Double_t, eta_b1) /* eta of the first b-jet */ \
+    VAR(Double_t, csv_b1) /* CSV of the first b-jet */ \
+    VAR(Double_t, pt_b2) /* pt of the second b-jet */ \
+    VAR(Double_t, eta_b2) /* eta of the second b-jet */ \
+    VAR(Double_t, csv_b2) /* CSV of the second b-jet */ \
+    VAR(Bool_t, kinfit_has_valid_mass) /* kinematic fit converged with a valid mass */ \
+    VAR(Int_t, kinfit_convergence) /* kinematic fit convergence */ \
+    VAR(Double_t, kinfit_mass) /* kinematic fit mass */ \
+    VAR(Double_t, kinfit_chi2) /* kinematic fit chi2 */ \
+    VAR(Double_t, kinfit_probability) /* kinematic fit probability */ \
+    /**/
+
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(ntuple, AnaEvent, AnaTuple, ANA_EVENT_DATA, "ana")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(ntuple, AnaTuple, ANA_EVENT_DATA)
+#undef VAR
+// ANA_EVENT_DATA stays defined: the columnar event cache uses it to declare one column per variable.
+
+namespace analysis {
+
+// The analysis-ready tuple of a channel is stored next to the skimmed tuple of the channel.
+inline std::string AnaTupleName(const std::string& tree_name) { return tree_name + "_ana"; }
+
+// TNamed with the description of the MC correction weights stored in the analysis-ready tuple of a channel.
+inline std::string AnaTupleWeightsConfigName(const std::string& tree_name)
+{
+    return AnaTupleName(tree_name) + "_weights";
+}
+
+inline EventSelectionRecord ToSelectionRecord(const ntuple::AnaEvent& event)
+{
+    EventSelectionRecord selection = EventSelectionRecord();
+    selection.regions = event.regions;
+    selection.categories = event.categories;
+    selection.bjet_first = static_cast<uint16_t>(event.bjet_first);
+    selection.bjet_second = static_cast<uint16_t>(event.bjet_second);
+    selection.subCategories = static_cast<uint8_t>(event.subCategories);
+    selection.flags = EventSelectionRecord::HasSubCategoriesFlag;
+    return selection;
+}
+
+template<typename FirstLeg>
+double FirstLegIsolation(const FirstLeg& leg) { return leg->iso(); }
+
+inline double FirstLegIsolation(const TauCandidate& leg) { return leg->byCombinedIsolationDeltaBetaCorrRaw3Hits(); }
+
+// Fills everything the histograms of EventAnalyzerData are filled with, in the same precision. Observables of
+// the b-jet pair are NaN if the event has no b-jet pair.
+template<typename FirstLeg>
+void FillAnaEvent(ntuple::AnaEvent& ana, EventInfo<FirstLeg>& event, const EventSelectionRecord& selection,
+                  const kin_fit::FitResults& kinfit, double weight)
+{
+    static constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+
+    ana.run = event->run;
+    ana.lumi = event->lumi;
+    ana.evt = event->evt;
+    ana.eventEnergyScale = event->eventEnergyScale;
+    ana.regions = selection.regions;
+    ana.categories = selection.categories;
+    ana.subCategories = selection.subCategories;
+    ana.bjet_first = selection.bjet_first;
+    ana.bjet_second = selection.bjet_second;
+    ana.has_bjet_pair = event.HasBjetPair();
+    ana.weight = weight;
+
+    ana.npv = event->npv;
+    ana.n_jets = static_cast<Int_t>(event.GetNJets());
+    ana.pt_1 = event.GetLeg(1).GetMomentum().pt();
+    ana.eta_1 = event.GetLeg(1).GetMomentum().eta();
+    ana.iso_1 = FirstLegIsolation(event.GetFirstLeg());
+    ana.mt_1 = event.GetFirstLeg()->mt(MetType::PF);
+    ana.pt_2 = event.GetLeg(2).GetMomentum().pt();
+    ana.eta_2 = event.GetLeg(2).GetMomentum().eta();
+    ana.mt_2 = event->pfmt_2;
+    ana.MET_pt = event.GetMET().GetMomentum().Pt();
+    ana.MET_phi = event.GetMET().GetMomentum().Phi();
+    ana.m_vis = event.GetHiggsTTMomentum(false).M();
+    ana.m_sv = event.GetHiggsTTMomentum(true).M();
+
+    ana.m_bb = ana.m_ttbb = nan;
+    ana.pt_b1 = ana.eta_b1 = ana.csv_b1 = ana.pt_b2 = ana.eta_b2 = ana.csv_b2 = nan;
+    ana.kinfit_has_valid_mass = false;
+    ana.kinfit_convergence = 0;
+    ana.kinfit_mass = ana.kinfit_chi2 = ana.kinfit_probability = nan;
+    if(!event.HasBjetPair()) return;
+
+    const auto& Hbb = event.GetHiggsBB();
+    const auto& b1 = Hbb.GetFirstDaughter();
+    const auto& b2 = Hbb.GetSecondDaughter();
+    ana.m_bb = Hbb.GetMomentum().M();
+    ana.m_ttbb = event.GetResonanceMomentum(true, false).M();
+    ana.pt_b1 = b1.GetMomentum().pt();
+    ana.eta_b1 = b1.GetMomentum().Eta();
+    ana.csv_b1 = b1->csv();
+    ana.pt_b2 = b2.GetMomentum().Pt();
+    ana.eta_b2 = b2.GetMomentum().Eta();
+    ana.csv_b2 = b2->csv();
+    ana.kinfit_has_valid_mass = kinfit.HasValidMass();
+    ana.kinfit_convergence = kinfit.convergence;
+    ana.kinfit_mass = kinfit.mass;
+    ana.kinfit_chi2 = kinfit.chi2;
+    ana.kinfit_probability = kinfit.probability;
+}
+
+} // namespace analysis
@@ -0,0 +1,109 @@
+/*! Definition of AnaTupleProducer class, which computes the analysis-ready tuple entries at skim time.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <memory>
+
+#include "AnaTuple.h"
+#include "EventSelectionRules.h"
+#include "McCorrectionsConfig.h"
+
+namespace analysis {
+
+// Runs the per-event part of BaseEventAnalyzer once: b-jet pair selection, event categories, regions and
+// sub-categories, observables, kinematic fit and MC correction weight. The MC corrections are configured as in
+// BaseEventAnalyzer (Run2015, medium tau ID, b-tag weight with CSVM). A producer is not thread safe, each thread
+// should use its own copy.
+class BaseAnaTupleProducer {
+public:
+    static constexpr Period WeightsPeriod() { return Period::Run2015; }
+    static constexpr DiscriminatorWP WeightsTauIdWP() { return DiscriminatorWP::Medium; }
+    static constexpr bool ApplyBTagWeight() { return true; }
+
+    virtual ~BaseAnaTupleProducer() {}
+
+    // Returns false if the event does not belong to any event category, so it is never filled by the analyzer.
+    virtual bool Produce(const ntuple::Event& event, const TauIds& tauIds, ntuple::AnaEvent& anaEvent) = 0;
+    virtual std::shared_ptr<BaseAnaTupleProducer> Clone() const = 0;
+
+    static std::shared_ptr<BaseAnaTupleProducer> Create(const std::string& tree_name, bool is_data,
+                                                        std::shared_ptr<BTagWeightService> bTagWeight);
+
+    // Description of the weights computed by the producer, which is stored with the analysis-ready tuple (see
+    // AnaTupleWeightsConfigName): is_data and, for MC, the McCorrectionsConfig string. The b-tag files should be
+    // empty if the b-tag weight service is not used.
+    static std::string WeightsConfig(bool is_data, const std::string& btag_eff_file, const std::string& btag_sf_file,
+                                     double btag_sf_tolerance)
+    {
+        std::ostringstream ss;
+        ss << "is_data=" << is_data;
+        if(!is_data) {
+            McCorrectionsConfig config;
+            config.period = WeightsPeriod();
+            config.tauIdWP = WeightsTauIdWP();
+            config.applyBTagWeight = ApplyBTagWeight();
+            config.btag_eff_file = btag_eff_file;
+            config.btag_sf_file = btag_sf_file;
+            config.btag_sf_tolerance = btag_eff_file.size() ? btag_sf_tolerance : 0;
+            ss << ";" << config.ToString();
+        }
+        return ss.str();
+    }
+};
+
+template<typename FirstLeg>
+class AnaTupleProducer : public BaseAnaTupleProducer {
+public:
+    using EventInfo = analysis::EventInfo<FirstLeg>;
+
+    AnaTupleProducer(bool _is_data, std::shared_ptr<BTagWeightService> _bTagWeight)
+        : is_data(_is_data), bTagWeight(_bTagWeight), eventWeights(WeightsPeriod(), WeightsTauIdWP()) {}
+
+    virtual bool Produce(const ntuple::Event& eventData, const TauIds& tauIds, ntuple::AnaEvent& anaEvent) override
+    {
+        static constexpr bool order_bjet_by_csv = true;
+
+        EventSelectionRecord selection = EventSelectionRecord();
+        selection.SetBjetPair(SelectBjetPair(eventData, order_bjet_by_csv));
+        EventInfo event(eventData, selection.GetBjetPair());
+        const EventCategoryVector eventCategories = DetermineEventCategories(event->jets_csv, selection.GetBjetPair(),
+                                                                             0, cuts::Htautau_2015::btag::CSVL,
+                                                                             cuts::Htautau_2015::btag::CSVM, false);
+        for(auto eventCategory : eventCategories)
+            selection.AddCategory(eventCategory, EventRegionRule<FirstLeg>::Determine(event, tauIds));
+        if(!selection.categories) return false;
+
+        const kin_fit::FitResults kinfit = event.HasBjetPair() ? event.GetKinFitResults() : kin_fit::FitResults();
+        selection.SetSubCategories(DetermineEventSubCategories(event, true, &kinfit));
+        const double weight = is_data ? 1 : ComputeCorrectionWeight(eventData, eventWeights, bTagWeight.get(),
+                                                                    ApplyBTagWeight());
+        FillAnaEvent(anaEvent, event, selection, kinfit, weight);
+        return true;
+    }
+
+    virtual std::shared_ptr<BaseAnaTupleProducer> Clone() const override
+    {
+        std::shared_ptr<BTagWeightService> bTagWeightCopy;
+        if(bTagWeight)
+            bTagWeightCopy.reset(new BTagWeightService(*bTagWeight));
+        return std::shared_ptr<BaseAnaTupleProducer>(new AnaTupleProducer(is_data, bTagWeightCopy));
+    }
+
+private:
+    bool is_data;
+    std::shared_ptr<BTagWeightService> bTagWeight;
+    mc_corrections::EventWeights eventWeights;
+};
+
+inline std::shared_ptr<BaseAnaTupleProducer> BaseAnaTupleProducer::Create(const std::string& tree_name,
+        bool is_data, std::shared_ptr<BTagWeightService> bTagWeight)
+{
+    if(tree_name == "muTau")
+        return std::shared_ptr<BaseAnaTupleProducer>(new AnaTupleProducer<MuonCandidate>(is_data, bTagWeight));
+    if(tree_name == "eTau")
+        return std::shared_ptr<BaseAnaTupleProducer>(new AnaTupleProducer<ElectronCandidate>(is_data, bTagWeight));
+    throw exception("Analysis-ready tuple is not supported for the tree '%1%'.") % tree_name;
+}
+
+} // namespace analysis
@@ -0,0 +1,71 @@
+/*! Compile-time definition of the event categories, sub-categories and regions processed by an event analyzer.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <cstdint>
+
+#include "AnalysisCategories.h"
+
+namespace analysis {
+
+template<typename Enum>
+constexpr uint64_t EnumMask() { return 0; }
+
+template<typename Enum, typename ...Rest>
+constexpr uint64_t EnumMask(Enum value, Rest... rest)
+{
+    return (uint64_t(1) << static_cast<unsigned>(value)) | EnumMask<Enum>(rest...);
+}
+
+// Processed values are stored as bit masks indexed by the enum value, so the filtering on the event loop
+// is reduced to constant bit tests.
+template<uint64_t _categories, uint64_t _subCategories, uint64_t _regions>
+struct AnalyzerSelection {
+    static constexpr uint64_t categories = _categories;
+    static constexpr uint64_t subCategories = _subCategories;
+    static constexpr uint64_t regions = _regions;
+
+    static constexpr bool IsProcessed(EventCategory category)
+    {
+        return (_categories >> static_cast<unsigned>(category)) & 1;
+    }
+
+    static constexpr bool IsProcessed(EventSubCategory subCategory)
+    {
+        return (_subCategories >> static_cast<unsigned>(subCategory)) & 1;
+    }
+
+    static constexpr bool IsProcessed(EventRegion region)
+    {
+        return (_regions >> static_cast<unsigned>(region)) & 1;
+    }
+
+    static constexpr bool HasKinFitSubCategories()
+    {
+        return IsProcessed(EventSubCategory::KinematicFitConverged)
+                || IsProcessed(EventSubCategory::KinematicFitConvergedWithMassWindow)
+                || IsProcessed(EventSubCategory::KinematicFitConvergedOutsideMassWindow);
+    }
+
+    template<typename Enum>
+    static std::set<Enum> ToSet(const std::set<Enum>& all_values)
+    {
+        std::set<Enum> result;
+        for(Enum value : all_values) {
+            if(IsProcessed(value))
+                result.insert(value);
+        }
+        return result;
+    }
+};
+
+using DefaultAnalyzerSelection = AnalyzerSelection<
+    EnumMask(EventCategory::TwoJets_Inclusive, EventCategory::TwoJets_ZeroBtag, EventCategory::TwoJets_OneBtag,
+             EventCategory::TwoJets_OneLooseBtag, EventCategory::TwoJets_TwoBtag,
+             EventCategory::TwoJets_TwoLooseBtag),
+    EnumMask(EventSubCategory::NoCuts, EventSubCategory::MassWindow, EventSubCategory::KinematicFitConverged,
+             EventSubCategory::KinematicFitConvergedWithMassWindow),
+    EnumMask(EventRegion::OS_Isolated, EventRegion::SS_Isolated, EventRegion::SS_AntiIsolated)>;
+
+} // namespace analysis
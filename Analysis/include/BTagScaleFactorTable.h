@@ -0,0 +1,148 @@
+/*! Definition of BTagScaleFactorTable class, a tabulated b-tag scale factor.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// The scale factor is tabulated on a uniform (eta, pt) grid and bilinearly interpolated inside each cell.
+// At construction each cell is validated: the function is compared to the interpolation on a dense sub-grid of the
+// cell, which has n_samples points inside the cell along each axis and also points on the cell edges and just
+// inside them, so a calibration bin boundary which coincides with a cell edge is caught. The cell is marked for
+// exact evaluation if the difference exceeds the tolerance. Such cells are the ones crossed by a boundary of the
+// calibration bins (including the start of the pt overflow region of the calibration) or with a large curvature.
+// Points outside of the grid are always evaluated exactly; this is also checked at construction.
+class BTagScaleFactorTable {
+public:
+    using Function = std::function<double(double eta, double pt)>;
+
+    struct Grid {
+        double eta_min, eta_max, pt_min, pt_max;
+        size_t n_eta, n_pt;
+    };
+
+    BTagScaleFactorTable(const Function& _function, const Grid& _grid, double _tolerance, size_t n_samples = 8)
+        : function(_function), grid(_grid), tolerance(_tolerance), max_error(0), n_exact_cells(0)
+    {
+        if(!grid.n_eta || !grid.n_pt || !(grid.eta_max > grid.eta_min) || !(grid.pt_max > grid.pt_min))
+            throw exception("Invalid b-tag scale factor grid.");
+        eta_scale = grid.n_eta / (grid.eta_max - grid.eta_min);
+        pt_scale = grid.n_pt / (grid.pt_max - grid.pt_min);
+
+        nodes.resize((grid.n_eta + 1) * (grid.n_pt + 1));
+        for(size_t i = 0; i <= grid.n_eta; ++i) {
+            for(size_t j = 0; j <= grid.n_pt; ++j)
+                nodes.at(NodeIndex(i, j)) = function(EtaNode(i), PtNode(j));
+        }
+
+        static constexpr double edge_offset = 1e-6;
+        std::vector<double> offsets = { 0, edge_offset, 1 - edge_offset };
+        for(size_t k = 0; k < n_samples; ++k)
+            offsets.push_back((k + 0.5) / n_samples);
+
+        exact_cells.resize(grid.n_eta * grid.n_pt, 0);
+        for(size_t i = 0; i < grid.n_eta; ++i) {
+            for(size_t j = 0; j < grid.n_pt; ++j) {
+                double cell_error = 0;
+                for(double u : offsets) {
+                    for(double v : offsets) {
+                        const double eta = EtaNode(i) + u / eta_scale, pt = PtNode(j) + v / pt_scale;
+                        cell_error = std::max(cell_error, std::abs(function(eta, pt) - Interpolate(i, j, u, v)));
+                    }
+                }
+                if(cell_error > tolerance || std::isnan(cell_error)) {
+                    exact_cells.at(i * grid.n_pt + j) = 1;
+                    ++n_exact_cells;
+                } else
+                    max_error = std::max(max_error, cell_error);
+            }
+        }
+
+        for(double u : offsets) {
+            const double eta = grid.eta_min + u * (grid.eta_max - grid.eta_min);
+            for(double pt : { grid.pt_max, 2 * grid.pt_max, 10 * grid.pt_max }) {
+                const double error = std::abs(function(eta, pt) - Eval(eta, pt));
+                if(error > tolerance)
+                    throw exception("b-tag scale factor table error %1% at eta = %2%, pt = %3% outside of the grid"
+                                    " exceeds the tolerance.") % error % eta % pt;
+            }
+        }
+    }
+
+    double Eval(double eta, double pt) const
+    {
+        size_t i, j;
+        double u, v;
+        if(!FindCell(eta, pt, i, j, u, v) || exact_cells[i * grid.n_pt + j])
+            return function(eta, pt);
+        return Interpolate(i, j, u, v);
+    }
+
+    // Evaluates a whole jet collection. The interpolation loop has no calls: points which require the exact
+    // evaluation are marked with NaN and evaluated afterwards. The table is not modified, so it can be shared
+    // between threads.
+    void Eval(const double* eta, const double* pt, double* sf, size_t n) const
+    {
+        static const double exact_mark = std::numeric_limits<double>::quiet_NaN();
+        for(size_t k = 0; k < n; ++k) {
+            size_t i, j;
+            double u, v;
+            if(!FindCell(eta[k], pt[k], i, j, u, v) || exact_cells[i * grid.n_pt + j])
+                sf[k] = exact_mark;
+            else
+                sf[k] = Interpolate(i, j, u, v);
+        }
+        for(size_t k = 0; k < n; ++k) {
+            if(std::isnan(sf[k]))
+                sf[k] = function(eta[k], pt[k]);
+        }
+    }
+
+    double GetTolerance() const { return tolerance; }
+    double GetMaxValidatedError() const { return max_error; }
+    size_t GetNumberOfCells() const { return exact_cells.size(); }
+    size_t GetNumberOfExactCells() const { return n_exact_cells; }
+
+private:
+    size_t NodeIndex(size_t i, size_t j) const { return i * (grid.n_pt + 1) + j; }
+    double EtaNode(size_t i) const { return grid.eta_min + i / eta_scale; }
+    double PtNode(size_t j) const { return grid.pt_min + j / pt_scale; }
+
+    bool FindCell(double eta, double pt, size_t& i, size_t& j, double& u, double& v) const
+    {
+        if(!(eta >= grid.eta_min && eta < grid.eta_max && pt >= grid.pt_min && pt < grid.pt_max))
+            return false;
+        const double x = (eta - grid.eta_min) * eta_scale, y = (pt - grid.pt_min) * pt_scale;
+        i = std::min(static_cast<size_t>(x), grid.n_eta - 1);
+        j = std::min(static_cast<size_t>(y), grid.n_pt - 1);
+        u = x - i;
+        v = y - j;
+        return true;
+    }
+
+    double Interpolate(size_t i, size_t j, double u, double v) const
+    {
+        const double f00 = nodes[NodeIndex(i, j)], f01 = nodes[NodeIndex(i, j + 1)];
+        const double f10 = nodes[NodeIndex(i + 1, j)], f11 = nodes[NodeIndex(i + 1, j + 1)];
+        return (1 - u) * ((1 - v) * f00 + v * f01) + u * ((1 - v) * f10 + v * f11);
+    }
+
+private:
+    Function function;
+    Grid grid;
+    double tolerance, eta_scale, pt_scale, max_error;
+    size_t n_exact_cells;
+    std::vector<double> nodes;
+    std::vector<uint8_t> exact_cells;
+};
+
+} // namespace analysis
@@ -0,0 +1,283 @@
+/*! Definition of BTagWeightService class, which computes the b-tag event weight together with its variations.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <mutex>
+
+#include <TFile.h>
+#include <TH2.h>
+
+#include "AnalysisTools/Core/include/Tools.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/exception.h"
+#include "h-tautau/Analysis/include/EventTuple.h"
+#include "h-tautau/Analysis/include/Htautau_2015.h"
+#include "h-tautau/McCorrections/include/BTagCalibrationStandalone.h"
+#include "BTagScaleFactorTable.h"
+
+namespace analysis {
+
+enum class BTagVariation { Central = 0, BC_Up = 1, BC_Down = 2, Light_Up = 3, Light_Down = 4 };
+ENUM_NAMES(BTagVariation) = {
+    { BTagVariation::Central, "Central" }, { BTagVariation::BC_Up, "BC_Up" }, { BTagVariation::BC_Down, "BC_Down" },
+    { BTagVariation::Light_Up, "Light_Up" }, { BTagVariation::Light_Down, "Light_Down" }
+};
+
+// Efficiency histogram (x = pt, y = |eta|) copied into flat arrays. The lookup gives the same bin content as
+// TH2::FindFixBin followed by TH2::GetBinContent, including underflow and overflow bins.
+class BTagEfficiencyMap {
+public:
+    explicit BTagEfficiencyMap(const TH2& hist)
+    {
+        FillEdges(*hist.GetXaxis(), pt_edges);
+        FillEdges(*hist.GetYaxis(), eta_edges);
+        n_pt_cells = pt_edges.size() + 1;
+        contents.resize(n_pt_cells * (eta_edges.size() + 1));
+        for(size_t eta_bin = 0; eta_bin <= eta_edges.size(); ++eta_bin) {
+            for(size_t pt_bin = 0; pt_bin < n_pt_cells; ++pt_bin)
+                contents.at(eta_bin * n_pt_cells + pt_bin) = hist.GetBinContent(static_cast<Int_t>(pt_bin),
+                                                                                static_cast<Int_t>(eta_bin));
+        }
+    }
+
+    double Get(double pt, double abs_eta) const
+    {
+        return contents[FindBin(eta_edges, abs_eta) * n_pt_cells + FindBin(pt_edges, pt)];
+    }
+
+private:
+    static void FillEdges(const TAxis& axis, std::vector<double>& edges)
+    {
+        for(Int_t bin = 1; bin <= axis.GetNbins() + 1; ++bin)
+            edges.push_back(axis.GetBinLowEdge(bin));
+    }
+
+    static size_t FindBin(const std::vector<double>& edges, double x)
+    {
+        if(x < edges.front()) return 0;
+        if(!(x < edges.back())) return edges.size();
+        return static_cast<size_t>(std::upper_bound(edges.begin(), edges.end(), x) - edges.begin());
+    }
+
+private:
+    std::vector<double> pt_edges, eta_edges, contents;
+    size_t n_pt_cells;
+};
+
+// Event b-tag weight w = P(Data) / P(MC), where P = prod_{tagged} eff * SF * prod_{not tagged} (1 - eff * SF)
+// and SF = 1 for P(MC). The central weight and all scale factor variations are accumulated in a single loop over
+// the jets: efficiencies are looked up once and the central, up and down scale factors of each jet are evaluated
+// together. Scale factors are evaluated through BTagScaleFactorTable if sf_tolerance > 0.
+// The tables and the calibration readers are shared between copies, while the evaluation buffers are not: each
+// thread should use its own copy. BTagCalibrationReader::eval evaluates TF1 formulas, which is not thread safe, so
+// the calls of the shared readers (the exact scale factors and the exact cells of the tables) are serialized by a
+// mutex shared between the copies. The interpolated scale factors are evaluated without the lock.
+class BTagWeightService {
+public:
+    static constexpr size_t NumberOfVariations = 5;
+    using WeightArray = std::array<double, NumberOfVariations>;
+
+    struct Jet {
+        double pt, eta;
+        int hadronFlavour;
+        bool tagged;
+    };
+    using JetVector = std::vector<Jet>;
+
+    BTagWeightService(const std::string& eff_file_name, const std::string& sf_file_name,
+                      btag_calibration::BTagEntry::OperatingPoint _wp, double _csv_cut, double sf_tolerance = 0)
+        : wp(_wp), csv_cut(_csv_cut), calib(new btag_calibration::BTagCalibration("CSVv2", sf_file_name)),
+          reader_mutex(std::make_shared<std::mutex>())
+    {
+        static const std::vector<std::string> eff_names = { "eff_b", "eff_c", "eff_l" };
+        auto eff_file = root_ext::OpenRootFile(eff_file_name);
+        for(size_t flavour = 0; flavour < NumberOfFlavours; ++flavour) {
+            auto hist = dynamic_cast<TH2*>(eff_file->Get(eff_names.at(flavour).c_str()));
+            if(!hist)
+                throw exception("B-tag efficiency histogram '%1%' not found in '%2%'.") % eff_names.at(flavour)
+                    % eff_file_name;
+            efficiencies.at(flavour) = std::make_shared<BTagEfficiencyMap>(*hist);
+        }
+
+        static const std::vector<std::string> sys_types = { "central", "up", "down" };
+        static const BTagScaleFactorTable::Grid grid{ -2.5, 2.5, 20, 1000, 100, 490 };
+        for(size_t flavour = 0; flavour < NumberOfFlavours; ++flavour) {
+            const std::string meas_type = flavour == Light ? "incl" : "mujets";
+            for(size_t sys = 0; sys < NumberOfSysTypes; ++sys) {
+                SFSource& source = sf_sources.at(flavour).at(sys);
+                source.flavour = JetFlavors().at(flavour);
+                source.reader = std::make_shared<btag_calibration::BTagCalibrationReader>(
+                            calib.get(), wp, meas_type, sys_types.at(sys));
+                if(sf_tolerance > 0) {
+                    const auto reader = source.reader;
+                    const auto jet_flavour = source.flavour;
+                    const auto mutex = reader_mutex;
+                    const auto function = [=](double eta, double pt) {
+                        std::lock_guard<std::mutex> lock(*mutex);
+                        return reader->eval(jet_flavour, static_cast<float>(eta), static_cast<float>(pt));
+                    };
+                    source.table = std::make_shared<BTagScaleFactorTable>(function, grid, sf_tolerance);
+                }
+            }
+        }
+    }
+
+    double GetCsvCut() const { return csv_cut; }
+
+    // Returns the list of the scale factor tables with the number of exactly evaluated cells, or an empty string if
+    // the scale factors are not tabulated.
+    std::string GetTablesReport() const
+    {
+        static const std::vector<std::string> flavour_names = { "b", "c", "udsg" };
+        static const std::vector<std::string> sys_names = { "central", "up", "down" };
+        std::ostringstream ss;
+        for(size_t flavour = 0; flavour < NumberOfFlavours; ++flavour) {
+            for(size_t sys = 0; sys < NumberOfSysTypes; ++sys) {
+                const auto& table = sf_sources.at(flavour).at(sys).table;
+                if(!table) continue;
+                ss << "SF table " << flavour_names.at(flavour) << " " << sys_names.at(sys) << ": "
+                   << table->GetNumberOfExactCells() << " of " << table->GetNumberOfCells()
+                   << " cells evaluated exactly, max validated error = " << table->GetMaxValidatedError() << ".\n";
+            }
+        }
+        return ss.str();
+    }
+
+    const WeightArray& Compute(const JetVector& jets)
+    {
+        for(size_t flavour = 0; flavour < NumberOfFlavours; ++flavour)
+            EvaluateScaleFactors(jets, flavour);
+
+        double mc = 1;
+        WeightArray data;
+        data.fill(1);
+        for(size_t n = 0; n < jets.size(); ++n) {
+            const Jet& jet = jets[n];
+            const size_t flavour = FlavourIndex(jet.hadronFlavour);
+            const double eff = efficiencies[flavour]->Get(jet.pt, std::abs(jet.eta));
+            const double sf_central = jet_sf[Central][n];
+            const double sf_bc_up = flavour == Light ? sf_central : jet_sf[Up][n];
+            const double sf_bc_down = flavour == Light ? sf_central : jet_sf[Down][n];
+            const double sf_light_up = flavour == Light ? jet_sf[Up][n] : sf_central;
+            const double sf_light_down = flavour == Light ? jet_sf[Down][n] : sf_central;
+            mc *= jet.tagged ? eff : 1 - eff;
+            data[static_cast<size_t>(BTagVariation::Central)] *= Probability(jet.tagged, eff, sf_central);
+            data[static_cast<size_t>(BTagVariation::BC_Up)] *= Probability(jet.tagged, eff, sf_bc_up);
+            data[static_cast<size_t>(BTagVariation::BC_Down)] *= Probability(jet.tagged, eff, sf_bc_down);
+            data[static_cast<size_t>(BTagVariation::Light_Up)] *= Probability(jet.tagged, eff, sf_light_up);
+            data[static_cast<size_t>(BTagVariation::Light_Down)] *= Probability(jet.tagged, eff, sf_light_down);
+        }
+        for(size_t v = 0; v < NumberOfVariations; ++v)
+            weights[v] = mc ? data[v] / mc : 0;
+        return weights;
+    }
+
+    // Jets are selected in the same way as in the b-tag weight of EventWeights: only jets in the b-tag acceptance
+    // contribute. The flavour of each jet is its hadron flavour and it is tagged if its CSV is above the cut.
+    const WeightArray& Compute(const ntuple::Event& event)
+    {
+        event_jets.clear();
+        for(size_t n = 0; n < event.jets_p4.size(); ++n) {
+            const auto& p4 = event.jets_p4.at(n);
+            if(!IsInAcceptance(p4.pt(), p4.eta())) continue;
+            event_jets.push_back(Jet{ p4.pt(), p4.eta(), event.jets_hadronFlavour.at(n),
+                                      event.jets_csv.at(n) > csv_cut });
+        }
+        return Compute(event_jets);
+    }
+
+    static bool IsInAcceptance(double pt, double eta)
+    {
+        return pt > cuts::Htautau_2015::btag::pt && std::abs(eta) < cuts::Htautau_2015::btag::eta;
+    }
+
+    double GetWeight(const ntuple::Event& event, BTagVariation variation = BTagVariation::Central)
+    {
+        return Compute(event).at(static_cast<size_t>(variation));
+    }
+
+private:
+    static constexpr size_t B = 0, C = 1, Light = 2, NumberOfFlavours = 3;
+    static constexpr size_t Central = 0, Up = 1, Down = 2, NumberOfSysTypes = 3;
+
+    struct SFSource {
+        btag_calibration::BTagEntry::JetFlavor flavour;
+        std::shared_ptr<const btag_calibration::BTagCalibrationReader> reader;
+        std::shared_ptr<const BTagScaleFactorTable> table;
+    };
+
+    static const std::vector<btag_calibration::BTagEntry::JetFlavor>& JetFlavors()
+    {
+        static const std::vector<btag_calibration::BTagEntry::JetFlavor> flavours = {
+            btag_calibration::BTagEntry::FLAV_B, btag_calibration::BTagEntry::FLAV_C,
+            btag_calibration::BTagEntry::FLAV_UDSG
+        };
+        return flavours;
+    }
+
+    static size_t FlavourIndex(int hadronFlavour)
+    {
+        if(std::abs(hadronFlavour) == 5) return B;
+        if(std::abs(hadronFlavour) == 4) return C;
+        return Light;
+    }
+
+    static double Probability(bool tagged, double eff, double sf)
+    {
+        return tagged ? eff * sf : 1 - eff * sf;
+    }
+
+    // Scale factors of all jets of the given flavour are evaluated with one call per systematic type.
+    void EvaluateScaleFactors(const JetVector& jets, size_t flavour)
+    {
+        jet_indices.clear();
+        jet_eta.clear();
+        jet_pt.clear();
+        for(size_t n = 0; n < jets.size(); ++n) {
+            if(FlavourIndex(jets[n].hadronFlavour) != flavour) continue;
+            jet_indices.push_back(n);
+            jet_eta.push_back(jets[n].eta);
+            jet_pt.push_back(jets[n].pt);
+        }
+        for(size_t sys = 0; sys < NumberOfSysTypes; ++sys) {
+            jet_sf[sys].resize(jets.size());
+            if(jet_indices.empty()) continue;
+            const SFSource& source = sf_sources[flavour][sys];
+            group_sf.resize(jet_indices.size());
+            if(source.table)
+                source.table->Eval(jet_eta.data(), jet_pt.data(), group_sf.data(), jet_indices.size());
+            else {
+                std::lock_guard<std::mutex> lock(*reader_mutex);
+                for(size_t k = 0; k < jet_indices.size(); ++k)
+                    group_sf[k] = source.reader->eval(source.flavour, static_cast<float>(jet_eta[k]),
+                                                      static_cast<float>(jet_pt[k]));
+            }
+            for(size_t k = 0; k < jet_indices.size(); ++k)
+                jet_sf[sys][jet_indices[k]] = group_sf[k];
+        }
+    }
+
+private:
+    btag_calibration::BTagEntry::OperatingPoint wp;
+    double csv_cut;
+    std::shared_ptr<btag_calibration::BTagCalibration> calib;
+    std::array<std::shared_ptr<const BTagEfficiencyMap>, NumberOfFlavours> efficiencies;
+    std::array<std::array<SFSource, NumberOfSysTypes>, NumberOfFlavours> sf_sources;
+    std::shared_ptr<std::mutex> reader_mutex;
+
+    WeightArray weights;
+    JetVector event_jets;
+    std::vector<size_t> jet_indices;
+    std::vector<double> jet_eta, jet_pt, group_sf;
+    std::array<std::vector<double>, NumberOfSysTypes> jet_sf;
+};
+
+} // namespace analysis
@@ -6,11 +6,22 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include <iostream>
 #include <cmath>
 #include <set>
+#include <map>
 #include <list>
 #include <locale>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
+#include <exception>
+#include <iomanip>
+#include <limits>
+#include <functional>
 
 #include <TColor.h>
 #include <TLorentzVector.h>
+#include <TNamed.h>
 
 #include "AnalysisTools/Run/include/program_main.h"
 #include "h-tautau/Analysis/include/EventInfo.h"
@@ -22,6 +33,19 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include "AnalysisCategories.h"
 #include "EventAnalyzerDataCollection.h"
+#include "SourceScheduler.h"
+#include "BranchSelection.h"
+#include "EventTupleReader.h"
+#include "EventSelectionCache.h"
+#include "EventWeightCache.h"
+#include "AnalyzerSelection.h"
+#include "BTagWeightService.h"
+#include "KinFitResultStore.h"
+#include "EventSelectionRules.h"
+#include "ColumnarEventCache.h"
+#include "FillResultCache.h"
+#include "McCorrectionsConfig.h"
+#include "Digest.h"
 
 #include "h-tautau/Analysis/include/Htautau_2015.h"
 #include "h-tautau/Analysis/include/EventTuple.h"
@@ -29,49 +53,99 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 namespace analysis {
 
+// Part of the analysis run by the analyzer: the event loop, which fills the histograms, the estimation, which produces
+// the background estimates, tables, datacards and plots from the filled histograms, or both.
+enum class AnalyzerStage { All, Fill, Estimation };
+ENUM_NAMES(AnalyzerStage) = {
+    { AnalyzerStage::All, "all" },
+    { AnalyzerStage::Fill, "fill" },
+    { AnalyzerStage::Estimation, "estimation" }
+};
+
+inline AnalyzerStage ParseAnalyzerStage(const std::string& name)
+{
+    for(AnalyzerStage stage : { AnalyzerStage::All, AnalyzerStage::Fill, AnalyzerStage::Estimation }) {
+        if(__AnalyzerStage_names<>::names.EnumToString(stage) == name)
+            return stage;
+    }
+    throw exception("Unknown analyzer stage '%1%'.") % name;
+}
+
 struct AnalyzerArguments {
     REQ_ARG(std::string, source_cfg);
     REQ_ARG(std::string, inputPath);
     REQ_ARG(std::string, outputFileName);
     REQ_ARG(std::string, signal_list);
     OPT_ARG(bool, saveFullOutput, false);
+    OPT_ARG(unsigned, n_threads, 1);
+    OPT_ARG(Long64_t, max_unit_entries, -1);
+    OPT_ARG(bool, prune_branches, true);
+    OPT_ARG(Long64_t, branch_check_entries, 100);
+    OPT_ARG(unsigned, prefetch_events, 1000);
+    OPT_ARG(unsigned, tree_cache_mb, 50);
+    OPT_ARG(std::string, selection_cache_dir, "");
+    OPT_ARG(std::string, weight_cache_dir, "");
+    OPT_ARG(unsigned, fill_buffer_size, 1024);
+    OPT_ARG(std::string, btag_eff_file, "");
+    OPT_ARG(std::string, btag_sf_file, "");
+    OPT_ARG(double, btag_sf_tolerance, 0);
+    OPT_ARG(std::string, kinfit_store, "");
+    OPT_ARG(bool, use_ana_tuple, false);
+    OPT_ARG(std::string, columnar_cache_dir, "");
+    OPT_ARG(std::string, result_cache_dir, "");
+    OPT_ARG(std::string, stage, "all");
+    OPT_ARG(std::string, fill_state_file, "");
+    OPT_ARG(unsigned, n_partitions, 1);
+    OPT_ARG(unsigned, partition_index, 0);
 };
 
-template<typename _FirstLeg>
+template<typename _FirstLeg, typename _Selection = DefaultAnalyzerSelection>
 class BaseEventAnalyzer {
 public:
     using FirstLeg = _FirstLeg;
+    using Selection = _Selection;
+    static_assert(EventSelectionRecord::CanStore<Selection>(),
+                  "Processed event categories, sub-categories or regions don't fit in the event selection record.");
     using EventInfo = analysis::EventInfo<FirstLeg>;
     using SecondLeg = typename EventInfo::SecondLeg;
     using EventAnalyzerData = analysis::EventAnalyzerData<FirstLeg>;
     using PhysicalValueMap = std::map<EventRegion, PhysicalValue>;
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+    using EntryRangeVector = std::vector<EntryRange>;
 
     static constexpr Channel ChannelId() { return ChannelInfo::IdentifyChannel<FirstLeg>(); }
+    static constexpr Period WeightsPeriod() { return Period::Run2015; }
+    static constexpr DiscriminatorWP WeightsTauIdWP() { return DiscriminatorWP::Medium; }
 
-    virtual const EventCategorySet& EventCategoriesToProcess() const
+    // Tuple branches (or branch patterns) which are read by the event selection, EventInfo, ComputeWeight and
+    // the histogram filling of the base analyzer.
+    static BranchSelection::NameSet DefaultRequiredBranches()
     {
-        static const EventCategorySet categories = {
-            EventCategory::TwoJets_Inclusive, EventCategory::TwoJets_ZeroBtag,
-            EventCategory::TwoJets_OneBtag, EventCategory::TwoJets_OneLooseBtag,
-            EventCategory::TwoJets_TwoBtag, EventCategory::TwoJets_TwoLooseBtag
+        BranchSelection::NameSet branches = {
+            "run", "lumi", "evt", "eventEnergyScale", "npv", "npu", "genEventWeight", "*_1", "*_2", "jets_*",
+            "pfMET_*", "SVfit_*", "kinFit_*"
         };
+        const auto& anaDataBranches = EventAnalyzerData::RequiredBranches();
+        branches.insert(anaDataBranches.begin(), anaDataBranches.end());
+        return branches;
+    }
+
+    // Processed categories, sub-categories and regions are defined at compile time by the Selection parameter.
+    const EventCategorySet& EventCategoriesToProcess() const
+    {
+        static const EventCategorySet categories = Selection::ToSet(AllEventCategories);
         return categories;
     }
 
-    virtual const EventSubCategorySet& EventSubCategoriesToProcess() const
+    const EventSubCategorySet& EventSubCategoriesToProcess() const
     {
-        static const EventSubCategorySet sub_categories = {
-            EventSubCategory::NoCuts, EventSubCategory::MassWindow, EventSubCategory::KinematicFitConverged,
-            EventSubCategory::KinematicFitConvergedWithMassWindow
-        };
+        static const EventSubCategorySet sub_categories = Selection::ToSet(AllEventSubCategories);
         return sub_categories;
     }
 
-    virtual const EventRegionSet& EventRegionsToProcess() const
+    const EventRegionSet& EventRegionsToProcess() const
     {
-        static const EventRegionSet regions = {
-            EventRegion::OS_Isolated, EventRegion::SS_Isolated, EventRegion::SS_AntiIsolated
-        };
+        static const EventRegionSet regions = Selection::ToSet(AllEventRegions);
         return regions;
     }
 
@@ -87,25 +161,61 @@ public:
     BaseEventAnalyzer(const AnalyzerArguments& _args)
         : args(_args), dataCategoryCollection(args.source_cfg(), args.signal_list(), ChannelId()),
           anaDataCollection(args.outputFileName() + "_full.root", args.saveFullOutput()),
-          weights(Period::Run2015, DiscriminatorWP::Medium)
+          weights(WeightsPeriod(), WeightsTauIdWP())
     {
+        anaDataCollection.SetFillBufferSize(args.fill_buffer_size());
+        if(args.btag_eff_file().size() && !args.use_ana_tuple()) {
+            bTagWeight.reset(new BTagWeightService(args.btag_eff_file(), args.btag_sf_file(),
+                                                   btag_calibration::BTagEntry::OP_MEDIUM,
+                                                   cuts::Htautau_2015::btag::CSVM, args.btag_sf_tolerance()));
+            std::cout << bTagWeight->GetTablesReport();
+        }
     }
 
+    // With stage=fill, the histograms filled by the event loop are stored in the fill state file and the estimation
+    // is not run. With stage=estimation, the event loop is not run and the histograms are loaded from the fill state
+    // file instead, so the estimation, tables, datacards and plots can be reproduced without reading the inputs.
+    // With n_partitions > 1, only the source units of partition_index are processed (see SelectPartition) and the
+    // fill state is partial. Partial fill states are combined by AnalyzerDataMerger into the fill state, which is
+    // used by the estimation stage.
     void Run()
     {
-        static const std::set<std::string> disabled_branches = { "lhe_particle_pdg", "lhe_particle_p4" };
+        const AnalyzerStage stage = ParseAnalyzerStage(args.stage());
+        if(args.n_partitions() == 0 || args.partition_index() >= args.n_partitions())
+            throw exception("Invalid partition %1% of %2%.") % args.partition_index() % args.n_partitions();
+        if(args.n_partitions() > 1 && stage != AnalyzerStage::Fill)
+            throw exception("A partitioned run produces a partial fill state, so it should be run with stage=fill.");
+        if(args.use_ana_tuple() && UseColumnarCache())
+            throw exception("--use_ana_tuple and --columnar_cache_dir can't be used together: the columnar cache is"
+                            " produced from the event tuple by ColumnarCacheExporter.");
+        if(args.use_ana_tuple())
+            CheckAnaTupleOptions();
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        if(args.n_threads() > 1 || args.prefetch_events() > 0)
+            ROOT::EnableThreadSafety();
+#endif
+
+        std::string units_digest;
+        if(stage == AnalyzerStage::Estimation) {
+            std::cout << "Loading fill state from '" << FillStateFileName() << "'... " << std::endl;
+            LoadFillState();
+        } else {
+            const auto requiredBranches = args.prune_branches() ? RequiredBranches()
+                                                                : BranchSelection::NameSet{ "*" };
+            branchSelection.reset(new BranchSelection(requiredBranches, DisabledBranches()));
+
+            std::cout << "Processing data categories... " << std::endl;
+            const SourceUnitVector units = CollectSourceUnits();
+            units_digest = SourceUnitsDigest(units);
+            ProcessSourceUnits(SelectPartition(units));
+            if(args.prune_branches() && !UsePrecomputedInput())
+                branchSelection->PrintReport(std::cout);
+        }
 
-        std::cout << "Processing data categories... " << std::endl;
-        for(const DataCategory* dataCategory : dataCategoryCollection.GetAllCategories()) {
-            if(!dataCategory->sources_sf.size()) continue;
-            std::cout << *dataCategory << "   isData: "<<dataCategory->IsData()<<std::endl;
-            for(const auto& source_entry : dataCategory->sources_sf) {
-                const std::string fullFileName = args.inputPath() + "/" + source_entry.first;
-                auto file = root_ext::OpenRootFile(fullFileName);
-                std::shared_ptr<ntuple::EventTuple> tree(new ntuple::EventTuple(TreeName(), file.get(), true,
-                                                                            disabled_branches));
-                ProcessDataSource(*dataCategory, tree, source_entry.second);
-            }
+        if(stage == AnalyzerStage::Fill) {
+            std::cout << "Saving fill state to '" << FillStateFileName() << "'... " << std::endl;
+            SaveFillState(units_digest);
+            return;
         }
 
         std::set<std::string> histograms_to_report = { EventAnalyzerData::m_ttbb_kinfit_Name() };
@@ -149,35 +259,268 @@ public:
     }
 
 protected:
+    struct SourceUnit {
+        const DataCategory* dataCategory;
+        std::string fileName;
+        double scale_factor;
+        EntryRange entryRange;
+        bool isPartial;
+        BranchSelection::NameSet disabledBranches;
+        std::string sourceId;
+
+        Long64_t GetNumberOfEntries() const { return entryRange.second - entryRange.first; }
+
+        std::string GetName() const
+        {
+            std::ostringstream ss;
+            ss << dataCategory->name << "/" << fileName;
+            if(isPartial)
+                ss << "[" << entryRange.first << ", " << entryRange.second << ")";
+            return ss.str();
+        }
+    };
+
+    using SourceUnitVector = std::vector<SourceUnit>;
+
+    // Sidecar caches of a source unit. Records are indexed by the entry index inside the unit entry range.
+    struct UnitCache {
+        std::vector<EventSelectionRecord> selections;
+        std::vector<EventWeightRecord> weights;
+        std::shared_ptr<EventSelectionCache> selectionCache;
+        std::shared_ptr<EventWeightCache> weightCache;
+        bool selections_loaded, selections_updated, weights_loaded, weights_updated;
+
+        explicit UnitCache(size_t n_entries)
+            : selections(n_entries), selections_loaded(false), selections_updated(false), weights_loaded(false),
+              weights_updated(false) {}
+
+        void Save() const
+        {
+            if(selectionCache && (!selections_loaded || selections_updated))
+                selectionCache->Save(selections);
+            if(weightCache && (!weights_loaded || weights_updated))
+                weightCache->Save(weights);
+        }
+
+        std::string GetStatus() const
+        {
+            std::ostringstream ss;
+            if(selectionCache)
+                ss << " Selection cache " << Status(selections_loaded, selections_updated) << ".";
+            if(weightCache)
+                ss << " Weight cache " << Status(weights_loaded, weights_updated) << ".";
+            return ss.str();
+        }
+
+    private:
+        static std::string Status(bool loaded, bool updated)
+        {
+            if(!loaded) return "created";
+            return updated ? "loaded and updated" : "loaded";
+        }
+    };
 
     virtual std::string TreeName() const = 0;
-    virtual EventRegion DetermineEventRegion(EventInfo& event, EventCategory eventCategory) = 0;
 
-    static EventSubCategorySet DetermineEventSubCategories(EventInfo& event)
+    virtual const std::set<std::string>& DisabledBranches() const
     {
-        using namespace cuts::massWindow;
+        static const std::set<std::string> disabled_branches = { "lhe_particle_pdg", "lhe_particle_p4" };
+        return disabled_branches;
+    }
 
-        EventSubCategorySet sub_categories;
-        sub_categories.insert(EventSubCategory::NoCuts);
-        if(event.HasBjetPair()) {
-            const double mass_tautau = event.GetHiggsTTMomentum(true).M();
-            const double mass_bb = event.GetHiggsBB().GetMomentum().M();
+    // Branches read by the analyzer. All other branches are disabled when prune_branches is set.
+    virtual BranchSelection::NameSet RequiredBranches() const { return DefaultRequiredBranches(); }
+    // Tau IDs should be taken from tauIds: they are stored as columns in the compact tuples.
+    virtual EventRegion DetermineEventRegion(EventInfo& event, EventCategory eventCategory, const TauIds& tauIds) = 0;
 
-            if(event.GetKinFitResults().HasValidMass())
-                sub_categories.insert(EventSubCategory::KinematicFitConverged);
+    // Everything the cached event selection depends on. The version should be increased each time
+    // SelectBjetPair, DetermineEventCategories, DetermineEventRegion or DetermineEventSubCategories is changed.
+    virtual std::string SelectionCacheKey(const SourceUnit& unit) const
+    {
+        static constexpr unsigned selection_version = 3;
+        std::ostringstream ss;
+        ss << "selection_v" << selection_version << ";channel=" << ChannelName() << ";tree=" << TreeName()
+           << ";categories=" << Selection::categories << ";subCategories=" << Selection::subCategories
+           << ";source=" << unit.sourceId << ";range=" << unit.entryRange.first << "-" << unit.entryRange.second
+           << ";CSVL=" << cuts::Htautau_2015::btag::CSVL << ";CSVM=" << cuts::Htautau_2015::btag::CSVM;
+        return ss.str();
+    }
 
-            if(mass_tautau > m_tautau_low && mass_tautau < m_tautau_high
-                    && mass_bb > m_bb_low && mass_bb < m_bb_high) {
-                sub_categories.insert(EventSubCategory::MassWindow);
-                if(event.GetKinFitResults().HasValidMass())
-                    sub_categories.insert(EventSubCategory::KinematicFitConvergedWithMassWindow);
-            } else {
-                sub_categories.insert(EventSubCategory::OutsideMassWindow);
-                if(event.GetKinFitResults().HasValidMass())
-                    sub_categories.insert(EventSubCategory::KinematicFitConvergedOutsideMassWindow);
+    // Configuration of the MC corrections used by ComputeCorrectionWeight (see McCorrectionsConfig). The input files
+    // are digested once, when the configuration is requested for the first time.
+    McCorrectionsConfig GetMcCorrectionsConfig() const
+    {
+        McCorrectionsConfig config;
+        config.period = WeightsPeriod();
+        config.tauIdWP = WeightsTauIdWP();
+        config.applyBTagWeight = ApplyBTagWeight();
+        if(args.btag_eff_file().size()) {
+            config.btag_eff_file = args.btag_eff_file();
+            config.btag_sf_file = args.btag_sf_file();
+        }
+        config.btag_sf_tolerance = args.btag_eff_file().size() ? args.btag_sf_tolerance() : 0;
+        return config;
+    }
+
+    virtual std::string WeightsConfig() const
+    {
+        std::call_once(weights_config_flag, [this]() { weights_config = GetMcCorrectionsConfig().ToString(); });
+        return weights_config;
+    }
+
+    std::string WeightCacheKey(const SourceUnit& unit) const
+    {
+        std::ostringstream ss;
+        ss << WeightsConfig() << ";tree=" << TreeName() << ";source=" << unit.sourceId << ";range="
+           << unit.entryRange.first << "-" << unit.entryRange.second;
+        return ss.str();
+    }
+
+    // Everything the histograms filled from a unit depend on, except the scale factor of the source. The version
+    // should be increased each time the histogram filling is changed.
+    virtual std::string FillResultKey(const SourceUnit& unit, const std::string& histogram_config) const
+    {
+        static constexpr unsigned fill_result_version = 2;
+        const std::string input = UseColumnarCache() ? "columnar" : args.use_ana_tuple() ? "anaTuple" : "eventTuple";
+        std::ostringstream ss;
+        ss << "fill_result_v" << fill_result_version << ";" << SelectionCacheKey(unit) << ";regions="
+           << Selection::regions << ";" << WeightsConfig() << ";input=" << input << ";dataCategory="
+           << unit.dataCategory->name << ";isData=" << unit.dataCategory->IsData() << ";histograms="
+           << TextDigest(histogram_config);
+        return ss.str();
+    }
+
+    // Everything the histograms stored in the fill state depend on, except the content of the input files: the
+    // selection, the histograms, the data categories with their sources and scale factors and the MC corrections.
+    // The fill state is accepted by the estimation only if it was produced with the same key.
+    virtual std::string FillStateKey() const
+    {
+        static constexpr unsigned fill_state_version = 2;
+        std::ostringstream ss;
+        ss << "fill_state_v" << fill_state_version << ";channel=" << ChannelName() << ";tree=" << TreeName()
+           << ";categories=" << Selection::categories << ";subCategories=" << Selection::subCategories
+           << ";regions=" << Selection::regions << ";histograms=" << TextDigest(HistogramConfig())
+           << ";sources=" << TextDigest(SourcesConfig()) << ";weights=" << TextDigest(WeightsConfig());
+        return ss.str();
+    }
+
+    // Data categories as parsed from source_cfg: types, sub-categories, sources with their scale factors (which
+    // include the cross sections) and the exclusive scale factors, in the order of the configuration.
+    std::string SourcesConfig() const
+    {
+        std::ostringstream ss;
+        ss << std::setprecision(std::numeric_limits<double>::max_digits10);
+        for(const DataCategory* category : dataCategoryCollection.GetAllCategories()) {
+            ss << "category=" << category->name << ";types=";
+            for(DataCategoryType type : category->types)
+                ss << type << ",";
+            ss << ";subCategories=";
+            for(const auto& sub_category : category->sub_categories)
+                ss << sub_category << ",";
+            ss << ";sources=";
+            for(const auto& source : category->sources_sf)
+                ss << source.first << ":" << source.second << ",";
+            ss << ";exclusive_sf=";
+            for(const auto& sf : category->exclusive_sf)
+                ss << sf.first << ":" << sf.second << ",";
+            ss << "\n";
+        }
+        return ss.str();
+    }
+
+    std::string FillStateFileName() const
+    {
+        return args.fill_state_file().size() ? args.fill_state_file() : args.outputFileName() + "_fill_state.root";
+    }
+
+    // Ordered list of the source units, which is split into the partitions: the data categories, the identities of
+    // the sources and the entry ranges, which depend on max_unit_entries. The paths of the sources are not used, so
+    // the jobs of a run can read the inputs from different locations.
+    std::string SourceUnitsDigest(const SourceUnitVector& units) const
+    {
+        std::ostringstream ss;
+        ss << "max_unit_entries=" << args.max_unit_entries() << ";sources=" << TextDigest(SourcesConfig());
+        for(const SourceUnit& unit : units)
+            ss << "\n" << unit.dataCategory->name << ";" << unit.sourceId << ";" << unit.entryRange.first << "-"
+               << unit.entryRange.second;
+        return TextDigest(ss.str());
+    }
+
+    // The fill state is stored in the same format as the fill result cache. The key of a partial fill state contains
+    // the partition and the digest of the list of source units.
+    void SaveFillState(const std::string& units_digest)
+    {
+        std::string key = FillStateKey();
+        if(args.n_partitions() > 1)
+            key = FillResultCache::PartitionKey(key, args.partition_index(), args.n_partitions(), units_digest);
+        const FillResultCache state(FillStateFileName(), key);
+        state.Save<FirstLeg>(anaDataCollection);
+    }
+
+    void LoadFillState()
+    {
+        const FillResultCache state(FillStateFileName(), FillStateKey());
+        if(!state.Load<FirstLeg>(anaDataCollection))
+            throw exception("Fill state '%1%' is missing or was produced with another analyzer configuration.")
+                % state.GetFileName();
+    }
+
+    // Names and binning of the histograms of each analyzer data type.
+    static std::string HistogramConfig()
+    {
+        EventAnalyzerDataCollection collection("", false);
+        std::ostringstream ss;
+        ss << std::setprecision(10);
+        for(EventCategory eventCategory : AllEventCategories) {
+            const EventAnalyzerDataId id(eventCategory, EventSubCategory::NoCuts, EventRegion::OS_Isolated,
+                                         EventEnergyScale::Central, "");
+            EventAnalyzerData& anaData = collection.Get<FirstLeg>(id);
+            anaData.CreateAll();
+            ss << eventCategory << ":";
+            AddHistogramConfig<TH1D>(anaData, ss);
+            AddHistogramConfig<TH2D>(anaData, ss);
+        }
+        return ss.str();
+    }
+
+    template<typename Histogram>
+    static void AddHistogramConfig(EventAnalyzerData& anaData, std::ostream& ss)
+    {
+        for(const auto& name : EventAnalyzerData::template GetOriginalHistogramNames<Histogram>()) {
+            const auto hist = anaData.template GetPtr<Histogram>(name);
+            if(!hist) continue;
+            ss << name;
+            for(const TAxis* axis : { hist->GetXaxis(), hist->GetYaxis() }) {
+                ss << "[" << axis->GetNbins();
+                for(Int_t bin = 1; bin <= axis->GetNbins() + 1; ++bin)
+                    ss << "," << axis->GetBinLowEdge(bin);
+                ss << "]";
             }
+            ss << ";";
         }
-        return sub_categories;
+    }
+
+    // Kinematic fit results of the selected b-jet pair from the kinfit store, or nullptr if the store is not used.
+    // On a miss the fit is run by EventInfo and the result is added to the store.
+    const kin_fit::FitResults* GetStoredKinFitResults(EventInfo& event, const EventInfoBase::BjetPair& bjet_pair,
+                                                      kin_fit::FitResults& result) const
+    {
+        if(!kinfitStore || !event.HasBjetPair()) return nullptr;
+        const auto& Hbb = event.GetHiggsBB();
+        const uint64_t inputs_digest = KinFitResultStore::InputsDigest(event->p4_1, event->p4_2,
+                Hbb.GetFirstDaughter().GetMomentum(), Hbb.GetSecondDaughter().GetMomentum(),
+                event.GetMET().GetMomentum());
+        result = kinfitStore->Get(event.GetEventId(), bjet_pair, event.GetEnergyScale(), inputs_digest,
+                                  [&]() { return event.GetKinFitResults(); });
+        return &result;
+    }
+
+    // The kinematic fit is evaluated only if at least one of the kinfit sub-categories is processed.
+    // If kinfit is not null, it is used instead of the kinematic fit results of the event.
+    static EventSubCategorySet DetermineEventSubCategories(EventInfo& event,
+                                                           const kin_fit::FitResults* kinfit = nullptr)
+    {
+        return analysis::DetermineEventSubCategories(event, Selection::HasKinFitSubCategories(), kinfit);
     }
 
     virtual PhysicalValue CalculateQCDYield(const EventAnalyzerDataMetaId_noRegion_noName& anaDataMetaId,
@@ -360,79 +703,564 @@ protected:
 
     static EventInfoBase::BjetPair SelectBjetPair(const ntuple::Event& event, bool order_bjet_by_csv)
     {
-        if(!order_bjet_by_csv)
-            return EventInfoBase::BjetPair(0, 1);
-
-        std::vector<std::pair<size_t,double>> csvPosition;
-        //std::vector<size_t> selected_jet_ids;
-        for(size_t n = 0; n < event.jets_csv.size(); ++n) {
-            const auto& p4 = event.jets_p4.at(n);
-            if(p4.pt() < 30 || std::abs(p4.eta()) > 2.4) continue;
-            std::pair<size_t,double> csvIndex(n, event.jets_csv.at(n));
-            csvPosition.push_back(csvIndex);
-        }
+        return analysis::SelectBjetPair(event, order_bjet_by_csv);
+    }
 
-        auto pairCompare = [&](const std::pair<size_t,double> firstElem, const std::pair<size_t,double> secondElem) -> bool
-        {  return firstElem.second > secondElem.second; } ;
+    static constexpr bool ApplyBTagWeight() { return true; }
 
-        std::sort(csvPosition.begin(),csvPosition.end(),pairCompare);
+    // If the b-tag weight service is provided, it replaces the b-tag weight of EventWeights.
+    double ComputeCorrectionWeight(const ntuple::Event& event, mc_corrections::EventWeights& eventWeights,
+                                   BTagWeightService* eventBTagWeight)
+    {
+        return analysis::ComputeCorrectionWeight(event, eventWeights, eventBTagWeight, ApplyBTagWeight());
+    }
 
-        EventInfoBase::BjetPair selected_pair(event.jets_csv.size(), event.jets_csv.size() + 1);
-        if(csvPosition.size() > 0)
-            selected_pair.first = csvPosition.at(0).first;
-        if(csvPosition.size() > 1)
-            selected_pair.second = csvPosition.at(1).first;
-        return selected_pair;
+    double ComputeWeight(const DataCategory& dataCategory, const ntuple::Event& event, double scale_factor,
+                         mc_corrections::EventWeights& eventWeights, BTagWeightService* eventBTagWeight)
+    {
+        if(dataCategory.IsData()) return 1;
+        return scale_factor * ComputeCorrectionWeight(event, eventWeights, eventBTagWeight);
     }
 
-    double ComputeWeight(const DataCategory& dataCategory, const ntuple::Event& event, double scale_factor)
+    // The correction weight is taken from the unit weight cache if it was computed for the same event.
+    double ComputeWeight(const DataCategory& dataCategory, const ntuple::Event& event, double scale_factor,
+                         mc_corrections::EventWeights& eventWeights, BTagWeightService* eventBTagWeight,
+                         UnitCache& cache, size_t index)
     {
-        static constexpr bool applybTagWeight = true;
         if(dataCategory.IsData()) return 1;
-//        std::cout << event.p4_1.Pt() << " " << event.p4_2.Pt() << std::endl;
-        return scale_factor * weights.GetTotalWeight(event, applybTagWeight, cuts::Htautau_2015::btag::CSVM);
+        if(!cache.weightCache)
+            return ComputeWeight(dataCategory, event, scale_factor, eventWeights, eventBTagWeight);
+        EventWeightRecord& record = cache.weights.at(index);
+        if(!record.Matches(event.run, event.lumi, event.evt)) {
+            record.Set(event.run, event.lumi, event.evt, ComputeCorrectionWeight(event, eventWeights, eventBTagWeight));
+            cache.weights_updated = true;
+        }
+        return scale_factor * record.weight;
     }
 
-    void ProcessDataSource(const DataCategory& dataCategory, std::shared_ptr<ntuple::EventTuple> tree,
-                           double scale_factor)
+    static EntryRangeVector SplitEntryRange(Long64_t n_entries, size_t n_parts)
+    {
+        EntryRangeVector ranges;
+        if(!n_parts)
+            throw exception("Number of entry ranges should be positive.");
+        for(size_t n = 0; n < n_parts; ++n) {
+            const Long64_t first = n_entries * static_cast<Long64_t>(n) / static_cast<Long64_t>(n_parts);
+            const Long64_t last = n_entries * static_cast<Long64_t>(n + 1) / static_cast<Long64_t>(n_parts);
+            if(last > first)
+                ranges.emplace_back(first, last);
+        }
+        return ranges;
+    }
+
+    static bool IsSelectedForProcessing(const EventSelectionRecord& selection)
+    {
+        const uint64_t categories = selection.categories & Selection::categories;
+        for(unsigned n = 0; n < EventSelectionRecord::MaxCategories; ++n) {
+            if(((categories >> n) & 1) && Selection::IsProcessed(selection.GetRegion(static_cast<EventCategory>(n))))
+                return true;
+        }
+        return false;
+    }
+
+    // Fills the selection records of the processed entries if they are not loaded from the cache.
+    void ProcessDataSource(const DataCategory& dataCategory, EventTupleReader& reader, double scale_factor,
+                           EventAnalyzerDataCollection& targetCollection, mc_corrections::EventWeights& eventWeights,
+                           BTagWeightService* eventBTagWeight, UnitCache& cache, Long64_t first_entry)
     {
         static constexpr bool order_bjet_by_csv = true;
 
 //        const DataCategory& DYJets_incl = dataCategoryCollection.GetUniqueCategory(DataCategoryType::DYJets_incl);
 
-        for(Long64_t current_entry = 0; current_entry < tree->GetEntries(); ++current_entry) {
-            tree->GetEntry(current_entry);
-
-            const EventInfoBase::BjetPair selected_bjet_pair = SelectBjetPair(tree->data(), order_bjet_by_csv);
-            EventInfo event(tree->data(), selected_bjet_pair);
+        const size_t dataCategoryIndex = targetCollection.GetDataCategoryIndex(dataCategory.name);
+        const bool selections_loaded = cache.selections_loaded;
+        while(const ntuple::Event* eventData = reader.Next()) {
+            const size_t index = static_cast<size_t>(reader.GetCurrentEntry() - first_entry);
+            EventSelectionRecord& selection = cache.selections.at(index);
+            if(!selections_loaded) {
+                selection = EventSelectionRecord();
+                selection.SetBjetPair(SelectBjetPair(*eventData, order_bjet_by_csv));
+            }
+            EventInfo event(*eventData, selection.GetBjetPair());
 
             // TODO
 //            const int HTBin = 0;
 //            if (dataCategory.name == DYJets_incl.name && HTBin != 0) continue;
 
-            const EventCategoryVector eventCategories = DetermineEventCategories(event->jets_csv,
-                                                                                 selected_bjet_pair,
-                                                                                 0,
-                                                                                 cuts::Htautau_2015::btag::CSVL,
-                                                                                 cuts::Htautau_2015::btag::CSVM,
-                                                                                 false);
-            double weight = std::numeric_limits<double>::quiet_NaN();
-            for(auto eventCategory : eventCategories) {
-                if (!EventCategoriesToProcess().count(eventCategory)) continue;
-                const EventRegion eventRegion = DetermineEventRegion(event, eventCategory);
-                if(!EventRegionsToProcess().count(eventRegion)) continue;
+            if(!selections_loaded) {
+                const TauIds tauIds = reader.GetTauIds();
+                const EventCategoryVector eventCategories = DetermineEventCategories(event->jets_csv,
+                                                                                     selection.GetBjetPair(),
+                                                                                     0,
+                                                                                     cuts::Htautau_2015::btag::CSVL,
+                                                                                     cuts::Htautau_2015::btag::CSVM,
+                                                                                     false);
+                for(auto eventCategory : eventCategories) {
+                    if(Selection::IsProcessed(eventCategory))
+                        selection.AddCategory(eventCategory, DetermineEventRegion(event, eventCategory, tauIds));
+                }
+            }
 
-                const EventSubCategorySet subCategories = DetermineEventSubCategories(event);
+            double weight = std::numeric_limits<double>::quiet_NaN();
+            EventSubCategorySet subCategories;
+            kin_fit::FitResults kinfitResults;
+            const kin_fit::FitResults* kinfit = nullptr;
+            bool kinfit_requested = false;
+            const auto getKinFit = [&]() {
+                if(!kinfit_requested) {
+                    kinfit = GetStoredKinFitResults(event, selection.GetBjetPair(), kinfitResults);
+                    kinfit_requested = true;
+                }
+                return kinfit;
+            };
+            const uint64_t categories = selection.categories & Selection::categories;
+            for(unsigned category_index = 0; category_index < EventSelectionRecord::MaxCategories; ++category_index) {
+                if(!((categories >> category_index) & 1)) continue;
+                const EventCategory eventCategory = static_cast<EventCategory>(category_index);
+                const EventRegion eventRegion = selection.GetRegion(eventCategory);
+                if(!Selection::IsProcessed(eventRegion)) continue;
+
+                if(!selection.HasSubCategories()) {
+                    selection.SetSubCategories(DetermineEventSubCategories(event,
+                            Selection::HasKinFitSubCategories() ? getKinFit() : nullptr));
+                    cache.selections_updated = cache.selections_updated || selections_loaded;
+                }
+                if(subCategories.empty())
+                    subCategories = selection.GetSubCategories();
                 for(auto subCategory : subCategories) {
-                    if(!EventSubCategoriesToProcess().count(subCategory)) continue;
-                    const EventAnalyzerDataId data_id(eventCategory, subCategory, eventRegion,
-                                                     event.GetEnergyScale(), dataCategory.name);
+                    if(!Selection::IsProcessed(subCategory)) continue;
                     if(std::isnan(weight))
-                        weight = ComputeWeight(dataCategory, *event, scale_factor);
-                    anaDataCollection.Fill(data_id, event, weight);
+                        weight = ComputeWeight(dataCategory, *event, scale_factor, eventWeights, eventBTagWeight,
+                                               cache, index);
+                    targetCollection.Fill(eventCategory, subCategory, eventRegion, event.GetEnergyScale(),
+                                          dataCategoryIndex, event, weight, getKinFit());
                 }
             }
         }
+        targetCollection.FlushFillBuffers();
+    }
+
+    // Fills an event of the analysis-ready tuple, the selection of which is already checked by IsSelectedForProcessing.
+    void FillFromAnaEvent(const DataCategory& dataCategory, size_t dataCategoryIndex, double scale_factor,
+                          const EventSelectionRecord& selection, const ntuple::AnaEvent& event,
+                          EventAnalyzerDataCollection& targetCollection)
+    {
+        const double weight = dataCategory.IsData() ? 1 : scale_factor * event.weight;
+        const EventEnergyScale energyScale = static_cast<EventEnergyScale>(event.eventEnergyScale);
+        const EventSubCategorySet subCategories = selection.GetSubCategories();
+        const uint64_t categories = selection.categories & Selection::categories;
+        for(unsigned category_index = 0; category_index < EventSelectionRecord::MaxCategories; ++category_index) {
+            if(!((categories >> category_index) & 1)) continue;
+            const EventCategory eventCategory = static_cast<EventCategory>(category_index);
+            const EventRegion eventRegion = selection.GetRegion(eventCategory);
+            if(!Selection::IsProcessed(eventRegion)) continue;
+            for(auto subCategory : subCategories) {
+                if(!Selection::IsProcessed(subCategory)) continue;
+                targetCollection.FillFromAnaTuple<FirstLeg>(eventCategory, subCategory, eventRegion, energyScale,
+                                                            dataCategoryIndex, event, weight);
+            }
+        }
+    }
+
+    // Histograms are filled from the analysis-ready tuple produced by TupleSkimmer, which stores the selection,
+    // the observables and the correction weight of each event. Only the cross-section scale factor is applied here.
+    void ProcessAnaTuple(const SourceUnit& unit, double scale_factor, EventAnalyzerDataCollection& targetCollection)
+    {
+        auto file = root_ext::OpenRootFile(unit.fileName);
+        CheckAnaTupleWeights(*file, unit);
+        ntuple::AnaTuple tuple(AnaTupleName(TreeName()), file.get(), true);
+        const DataCategory& dataCategory = *unit.dataCategory;
+        const size_t dataCategoryIndex = targetCollection.GetDataCategoryIndex(dataCategory.name);
+        for(Long64_t entry = unit.entryRange.first; entry < unit.entryRange.second; ++entry) {
+            tuple.GetEntry(entry);
+            const ntuple::AnaEvent& event = tuple.data();
+            const EventSelectionRecord selection = ToSelectionRecord(event);
+            if(!IsSelectedForProcessing(selection)) continue;
+            FillFromAnaEvent(dataCategory, dataCategoryIndex, scale_factor, selection, event, targetCollection);
+        }
+        targetCollection.FlushFillBuffers();
+    }
+
+    // Same as ProcessAnaTuple, reading the columnar event cache of the source (see ColumnarEventCache.h). Only the
+    // selection columns are read for the events which are not filled.
+    void ProcessColumnarCache(const SourceUnit& unit, double scale_factor,
+                              EventAnalyzerDataCollection& targetCollection)
+    {
+        const ColumnarCacheReader reader(ColumnarCacheFileName(unit.fileName, unit.sourceId));
+        const AnaEventColumnReader columns(reader);
+        const DataCategory& dataCategory = *unit.dataCategory;
+        const size_t dataCategoryIndex = targetCollection.GetDataCategoryIndex(dataCategory.name);
+        ntuple::AnaEvent event;
+        for(Long64_t entry = unit.entryRange.first; entry < unit.entryRange.second; ++entry) {
+            const size_t row = static_cast<size_t>(entry);
+            const EventSelectionRecord selection = columns.GetSelection(row);
+            if(!IsSelectedForProcessing(selection)) continue;
+            columns.Get(row, event);
+            FillFromAnaEvent(dataCategory, dataCategoryIndex, scale_factor, selection, event, targetCollection);
+        }
+        targetCollection.FlushFillBuffers();
+    }
+
+    // The weights and the kinematic fit of the analysis-ready tuple are computed by the skimmer, so the options which
+    // configure them here would have no effect. The b-tag weight files are accepted: they describe the b-tag weight
+    // which the tuple is expected to have (see CheckAnaTupleWeights), and the b-tag weight service is not created.
+    void CheckAnaTupleOptions() const
+    {
+        const std::vector<std::pair<std::string, bool>> options = {
+            { "selection_cache_dir", !args.selection_cache_dir().empty() },
+            { "weight_cache_dir", !args.weight_cache_dir().empty() }, { "kinfit_store", !args.kinfit_store().empty() }
+        };
+        for(const auto& option : options) {
+            if(option.second)
+                throw exception("--%1% can't be used with --use_ana_tuple: the analysis-ready tuple is produced with"
+                                " the options of TupleSkimmer.") % option.first;
+        }
+    }
+
+    // Checks that the weights of the analysis-ready tuple were computed for the data category of the unit and with
+    // the same MC corrections as the ones of the analyzer, including the source of the b-tag weight. The fields are
+    // compared both ways, so a field which is set only in the tuple or only in the analyzer is a mismatch as well.
+    void CheckAnaTupleWeights(TFile& file, const SourceUnit& unit) const
+    {
+        const std::string config_name = AnaTupleWeightsConfigName(TreeName());
+        std::unique_ptr<TNamed> stored(root_ext::TryReadObject<TNamed>(file, config_name));
+        if(!stored)
+            throw exception("'%1%' has no weights configuration '%2%'. It should be skimmed again with --ana_tuple.")
+                    % unit.fileName % config_name;
+        const auto fields = McCorrectionsConfig::ParseFields(stored->GetTitle());
+        const bool is_data = unit.dataCategory->IsData();
+        const auto is_data_iter = fields.find("is_data");
+        if(is_data_iter == fields.end() || is_data_iter->second != (is_data ? "1" : "0"))
+            throw exception("The analysis-ready tuple of '%1%' was not produced with is_data = %2%, as required by"
+                            " the data category '%3%'.") % unit.fileName % is_data % unit.dataCategory->name;
+        if(is_data) return;
+        auto expected = McCorrectionsConfig::ParseFields(WeightsConfig());
+        expected["is_data"] = is_data_iter->second;
+        std::set<std::string> names;
+        for(const auto& field : fields)
+            names.insert(field.first);
+        for(const auto& field : expected)
+            names.insert(field.first);
+        for(const auto& name : names) {
+            const auto iter = fields.find(name), expected_iter = expected.find(name);
+            if(iter == fields.end() || expected_iter == expected.end() || iter->second != expected_iter->second)
+                throw exception("The weights of the analysis-ready tuple of '%1%' were computed with %2% = '%3%',"
+                                " while the analyzer uses '%4%'.") % unit.fileName % name
+                        % (iter == fields.end() ? std::string("<not set>") : iter->second)
+                        % (expected_iter == expected.end() ? std::string("<not set>") : expected_iter->second);
+        }
+    }
+
+    bool UseColumnarCache() const { return !args.columnar_cache_dir().empty(); }
+    bool UsePrecomputedInput() const { return args.use_ana_tuple() || UseColumnarCache(); }
+
+    std::string ColumnarCacheFileName(const std::string& source_file_name, const std::string& source_id) const
+    {
+        return ColumnarCacheFormat::MakeFileName(args.columnar_cache_dir(), source_file_name, TreeName(), source_id);
+    }
+
+    UnitCache LoadUnitCache(const SourceUnit& unit) const
+    {
+        UnitCache cache(static_cast<size_t>(unit.GetNumberOfEntries()));
+        if(args.selection_cache_dir().size()) {
+            const std::string cache_file = EventSelectionCache::MakeFileName(args.selection_cache_dir(),
+                    unit.fileName, unit.sourceId, TreeName(), unit.entryRange, "selection");
+            cache.selectionCache.reset(new EventSelectionCache(cache_file, SelectionCacheKey(unit)));
+            cache.selections_loaded = cache.selectionCache->Load(cache.selections, cache.selections.size());
+        }
+        if(args.weight_cache_dir().size() && !unit.dataCategory->IsData()) {
+            const std::string cache_file = EventWeightCache::MakeFileName(args.weight_cache_dir(), unit.fileName,
+                    unit.sourceId, TreeName(), unit.entryRange, "weights");
+            cache.weightCache.reset(new EventWeightCache(cache_file, WeightCacheKey(unit)));
+            cache.weights_loaded = cache.weightCache->Load(cache.weights, cache.selections.size());
+            if(!cache.weights_loaded)
+                cache.weights.assign(cache.selections.size(), EventWeightRecord());
+        }
+        return cache;
+    }
+
+    // Maximal number of entries of a source unit: max_unit_entries if it is set (0 means that the sources are not
+    // split). By default, with more than one thread the sources are split into units of about
+    // total_entries / (4 * n_threads) entries, so a run dominated by a single large source is processed in parallel
+    // as well, and with one thread they are not split. The units, and therefore the rounding of the histogram sums,
+    // then depend on n_threads: max_unit_entries should be set explicitly to get the same result for any n_threads
+    // or to combine partitions processed with different n_threads.
+    Long64_t MaxUnitEntries(Long64_t total_entries) const
+    {
+        if(args.max_unit_entries() >= 0) return args.max_unit_entries();
+        if(args.n_threads() <= 1 || total_entries <= 0) return 0;
+        const Long64_t n_units = 4 * static_cast<Long64_t>(args.n_threads());
+        return std::max<Long64_t>((total_entries + n_units - 1) / n_units, 1);
+    }
+
+    SourceUnitVector CollectSourceUnits() const
+    {
+        SourceUnitVector sources;
+        Long64_t total_entries = 0;
+        for(const DataCategory* dataCategory : dataCategoryCollection.GetAllCategories()) {
+            if(!dataCategory->sources_sf.size()) continue;
+            std::cout << *dataCategory << "   isData: "<<dataCategory->IsData()<<std::endl;
+            for(const auto& source_entry : dataCategory->sources_sf) {
+                const std::string fullFileName = args.inputPath() + "/" + source_entry.first;
+                auto file = root_ext::OpenRootFile(fullFileName);
+                const std::string treeName = args.use_ana_tuple() ? AnaTupleName(TreeName()) : TreeName();
+                TTree* tree = root_ext::ReadObject<TTree>(*file, treeName);
+                Long64_t n_entries = tree->GetEntries();
+                const auto disabledBranches = UsePrecomputedInput() ? BranchSelection::NameSet()
+                                                                    : branchSelection->GetDisabledBranches(*tree);
+                const std::string sourceId = EventSelectionCache::SourceIdentity(*file, *tree);
+                if(UseColumnarCache()) {
+                    const ColumnarCacheReader cache(ColumnarCacheFileName(fullFileName, sourceId));
+                    if(cache.GetKey() != sourceId)
+                        throw exception("Columnar cache '%1%' was produced for another version of '%2%'.")
+                                % cache.GetFileName() % fullFileName;
+                    n_entries = static_cast<Long64_t>(cache.GetNumberOfRows());
+                }
+                sources.push_back(SourceUnit{ dataCategory, fullFileName, source_entry.second,
+                                              EntryRange(0, n_entries), false, disabledBranches, sourceId });
+                total_entries += n_entries;
+            }
+        }
+
+        const Long64_t max_unit_entries = MaxUnitEntries(total_entries);
+        SourceUnitVector units;
+        for(const SourceUnit& source : sources) {
+            const Long64_t n_entries = source.GetNumberOfEntries();
+            size_t n_parts = 1;
+            if(max_unit_entries > 0)
+                n_parts = static_cast<size_t>((n_entries + max_unit_entries - 1) / max_unit_entries);
+            for(const auto& range : SplitEntryRange(n_entries, std::max<size_t>(n_parts, 1))) {
+                SourceUnit unit = source;
+                unit.entryRange = range;
+                unit.isPartial = n_parts > 1;
+                units.push_back(unit);
+            }
+        }
+        return units;
+    }
+
+    // Branches disabled by the branch selection are not read, so an accessor which uses a branch missing in
+    // RequiredBranches silently gets a default value. To catch it, the first branch_check_entries entries of each
+    // source are processed with and without branch pruning and the run fails if the filled histograms differ.
+    void CheckBranchSelection(const SourceUnit& unit, mc_corrections::EventWeights& eventWeights,
+                              BTagWeightService* eventBTagWeight)
+    {
+        const EntryRange range(unit.entryRange.first,
+                               std::min(unit.entryRange.second, unit.entryRange.first + args.branch_check_entries()));
+        EventAnalyzerDataCollection pruned("", false), full("", false);
+        for(bool prune : { true, false }) {
+            EventTupleReader reader(unit.fileName, TreeName(), prune ? unit.disabledBranches : DisabledBranches(),
+                                    range, 0, 0);
+            UnitCache cache(static_cast<size_t>(range.second - range.first));
+            ProcessDataSource(*unit.dataCategory, reader, 1, prune ? pruned : full, eventWeights, eventBTagWeight,
+                              cache, range.first);
+        }
+        const auto differences = pruned.FindDifferences<FirstLeg>(full);
+        if(differences.empty()) return;
+        std::ostringstream ss;
+        for(const auto& name : differences)
+            ss << "\n    " << name;
+        throw exception("Histograms filled from '%1%' depend on branches which are disabled by the branch selection."
+                        " Add the missing branches to RequiredBranches. Histograms which differ:%2%")
+                % unit.fileName % ss.str();
+    }
+
+    // Units are assigned to the partitions one by one, the largest first, each to the partition with the smallest
+    // number of entries so far. The assignment depends only on the list of units, so the jobs of a partitioned run
+    // process disjoint subsets of the units, which together cover all of them.
+    SourceUnitVector SelectPartition(const SourceUnitVector& units) const
+    {
+        const size_t n_partitions = args.n_partitions();
+        if(n_partitions <= 1) return units;
+        std::vector<size_t> order(units.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return units.at(a).GetNumberOfEntries() > units.at(b).GetNumberOfEntries();
+        });
+        std::vector<Long64_t> loads(n_partitions, 0);
+        std::vector<size_t> unit_partitions(units.size());
+        for(size_t unit_id : order) {
+            const size_t partition = static_cast<size_t>(std::min_element(loads.begin(), loads.end())
+                                                         - loads.begin());
+            unit_partitions.at(unit_id) = partition;
+            loads.at(partition) += units.at(unit_id).GetNumberOfEntries();
+        }
+        SourceUnitVector selected;
+        for(size_t unit_id = 0; unit_id < units.size(); ++unit_id) {
+            if(unit_partitions.at(unit_id) == args.partition_index())
+                selected.push_back(units.at(unit_id));
+        }
+        std::cout << "Partition " << args.partition_index() << " of " << n_partitions << ": " << selected.size()
+                  << " of " << units.size() << " source units, " << loads.at(args.partition_index())
+                  << " entries." << std::endl;
+        return selected;
+    }
+
+    // Units are processed by the work-stealing scheduler, the most expensive ones first. Each unit fills its own
+    // collection, which is created when the unit starts. Within a data category the unit collections are merged in
+    // the dispatch order of the scheduler (see SourceScheduler::DispatchOrder), which doesn't depend on the number of
+    // workers: a finished unit waits only for the units of its category which precede it in that order, and is merged
+    // together with them as soon as they are finished. For a given list of units (see MaxUnitEntries) the sums are
+    // therefore the same for any n_threads, and since the workers take the units in about the dispatch order, only a
+    // few unit collections wait at a time.
+    // Histograms of different data categories are independent, so the category collections are merged into the main
+    // collection in the configuration order at the end.
+    // If selection_cache_dir is set, the event selection of each unit is stored in a sidecar file. When a valid
+    // cache is found, the selection is not recomputed and entries which are not filled are not read.
+    // If weight_cache_dir is set, the MC correction weights are cached in the same way.
+    // If kinfit_store is set, kinematic fit results are kept in that store, which is shared by all units and by the
+    // kinematic fit studies (see KinFitResultStore), and the fit runs only for new events.
+    // With use_ana_tuple, the analysis-ready tuples are read instead (see ProcessAnaTuple) and the caches are not used.
+    // With columnar_cache_dir, the columnar event caches produced by ColumnarCacheExporter are read in the same way
+    // (see ProcessColumnarCache); the unit entry ranges are then rows of the cache.
+    // If result_cache_dir is set, the histograms filled from each unit are stored on disk (see FillResultCache) and
+    // units with a valid stored result are not processed again. Units are then filled without the scale factor of
+    // the source, which is applied to the unit result before the merge, so changing a scale factor in the source
+    // configuration doesn't invalidate the stored results.
+    void ProcessSourceUnits(const SourceUnitVector& units)
+    {
+        using clock = std::chrono::steady_clock;
+
+        const size_t n_workers = std::max<size_t>(args.n_threads(), 1);
+        const bool use_result_cache = !args.result_cache_dir().empty();
+        std::string histogram_config;
+        if(use_result_cache) {
+            gSystem->mkdir(args.result_cache_dir().c_str(), kTRUE);
+            histogram_config = HistogramConfig();
+        }
+        if(args.kinfit_store().size() && !UsePrecomputedInput())
+            kinfitStore.reset(new KinFitResultStore(args.kinfit_store(), KinFitConfig::Default().ToString()));
+        std::vector<double> costs;
+        for(const auto& unit : units)
+            costs.push_back(static_cast<double>(unit.GetNumberOfEntries()));
+
+        // finished: unit collections which wait for the merge, by the position of the unit in the merge order of
+        // the category; next: position of the next unit to merge.
+        struct CategoryResult {
+            EventAnalyzerDataCollection collection;
+            std::vector<std::shared_ptr<EventAnalyzerDataCollection>> finished;
+            size_t next;
+            std::mutex mutex;
+            CategoryResult() : collection("", false), next(0) {}
+        };
+        std::vector<const DataCategory*> categories;
+        std::map<const DataCategory*, std::shared_ptr<CategoryResult>> categoryResults;
+        std::vector<size_t> merge_positions(units.size());
+        for(size_t unit_id : SourceScheduler::DispatchOrder(costs)) {
+            const DataCategory* dataCategory = units.at(unit_id).dataCategory;
+            auto& categoryResult = categoryResults[dataCategory];
+            if(!categoryResult)
+                categoryResult.reset(new CategoryResult());
+            merge_positions.at(unit_id) = categoryResult->finished.size();
+            categoryResult->finished.emplace_back();
+        }
+        for(const auto& unit : units) {
+            if(std::find(categories.begin(), categories.end(), unit.dataCategory) == categories.end())
+                categories.push_back(unit.dataCategory);
+        }
+        std::vector<std::shared_ptr<mc_corrections::EventWeights>> workerWeights(n_workers);
+        std::vector<std::shared_ptr<BTagWeightService>> workerBTagWeights(n_workers);
+        std::vector<double> wall_times(units.size(), 0);
+        std::mutex report_mutex;
+
+        const auto start = clock::now();
+        SourceScheduler scheduler(costs, n_workers);
+        scheduler.Run([&](size_t unit_id, size_t worker_id) {
+            const SourceUnit& unit = units.at(unit_id);
+            const auto unit_start = clock::now();
+            std::shared_ptr<EventAnalyzerDataCollection> result(new EventAnalyzerDataCollection("", false));
+            result->SetFillBufferSize(args.fill_buffer_size());
+            std::shared_ptr<FillResultCache> resultCache;
+            bool result_loaded = false;
+            if(use_result_cache) {
+                const std::string cache_file = FillResultCache::MakeFileName(args.result_cache_dir(), unit.fileName,
+                        unit.sourceId, TreeName(), unit.entryRange, unit.dataCategory->name);
+                resultCache.reset(new FillResultCache(cache_file, FillResultKey(unit, histogram_config)));
+                result_loaded = resultCache->Load<FirstLeg>(*result);
+            }
+            const double fill_scale_factor = use_result_cache ? 1 : unit.scale_factor;
+            UnitCache cache = (UsePrecomputedInput() || result_loaded) ? UnitCache(0) : LoadUnitCache(unit);
+            EventTupleReader::EntryFilter entryFilter;
+            if(cache.selections_loaded) {
+                entryFilter = [&](Long64_t entry) {
+                    return IsSelectedForProcessing(cache.selections.at(
+                                                       static_cast<size_t>(entry - unit.entryRange.first)));
+                };
+            }
+
+            if(result_loaded) {
+                // The unit result is taken from the fill result cache.
+            } else if(UseColumnarCache()) {
+                ProcessColumnarCache(unit, fill_scale_factor, *result);
+            } else if(args.use_ana_tuple()) {
+                ProcessAnaTuple(unit, fill_scale_factor, *result);
+            } else {
+                EventTupleReader reader(unit.fileName, TreeName(), unit.disabledBranches, unit.entryRange,
+                                        args.prefetch_events(),
+                                        static_cast<Long64_t>(args.tree_cache_mb()) * 1024 * 1024, entryFilter);
+                mc_corrections::EventWeights* unitWeights = &weights;
+                BTagWeightService* unitBTagWeight = bTagWeight.get();
+                if(n_workers > 1) {
+                    auto& workerWeight = workerWeights.at(worker_id);
+                    if(!workerWeight)
+                        workerWeight.reset(new mc_corrections::EventWeights(WeightsPeriod(), WeightsTauIdWP()));
+                    unitWeights = workerWeight.get();
+                    auto& workerBTagWeight = workerBTagWeights.at(worker_id);
+                    if(bTagWeight && !workerBTagWeight)
+                        workerBTagWeight.reset(new BTagWeightService(*bTagWeight));
+                    unitBTagWeight = workerBTagWeight.get();
+                }
+                if(args.prune_branches() && args.branch_check_entries() > 0 && unit.entryRange.first == 0)
+                    CheckBranchSelection(unit, *unitWeights, unitBTagWeight);
+                ProcessDataSource(*unit.dataCategory, reader, fill_scale_factor, *result, *unitWeights,
+                                  unitBTagWeight, cache, unit.entryRange.first);
+            }
+            cache.Save();
+            if(resultCache) {
+                if(!result_loaded)
+                    resultCache->Save<FirstLeg>(*result);
+                if(!unit.dataCategory->IsData())
+                    result->Scale<FirstLeg>(unit.scale_factor);
+            }
+            result->FlushFillBuffers();
+            {
+                CategoryResult& categoryResult = *categoryResults.at(unit.dataCategory);
+                std::lock_guard<std::mutex> lock(categoryResult.mutex);
+                categoryResult.finished.at(merge_positions.at(unit_id)) = result;
+                result.reset();
+                auto& finished = categoryResult.finished;
+                for(; categoryResult.next < finished.size() && finished.at(categoryResult.next);
+                    ++categoryResult.next) {
+                    categoryResult.collection.Merge<FirstLeg>(*finished.at(categoryResult.next));
+                    finished.at(categoryResult.next).reset();
+                }
+            }
+            const double wall_time = std::chrono::duration<double>(clock::now() - unit_start).count();
+
+            std::lock_guard<std::mutex> lock(report_mutex);
+            wall_times.at(unit_id) = wall_time;
+            std::cout << "Worker " << worker_id << ": " << unit.GetName() << " - " << unit.GetNumberOfEntries()
+                      << " entries processed in " << wall_time << " s." << cache.GetStatus();
+            if(resultCache)
+                std::cout << " Fill result cache " << (result_loaded ? "loaded" : "created") << ".";
+            std::cout << std::endl;
+        });
+        for(const DataCategory* dataCategory : categories) {
+            EventAnalyzerDataCollection& collection = categoryResults.at(dataCategory)->collection;
+            collection.FlushFillBuffers();
+            anaDataCollection.Merge<FirstLeg>(collection);
+            categoryResults.at(dataCategory).reset();
+        }
+
+        const double total_time = std::chrono::duration<double>(clock::now() - start).count();
+        const double units_time = std::accumulate(wall_times.begin(), wall_times.end(), 0.);
+        std::cout << units.size() << " source units processed by " << n_workers << " workers in " << total_time
+                  << " s. Sum of the unit wall times: " << units_time << " s." << std::endl;
+        if(kinfitStore) {
+            kinfitStore->Save();
+            std::cout << "Kinfit store '" << kinfitStore->GetFileName() << "': " << kinfitStore->GetNumberOfHits()
+                      << " hits, " << kinfitStore->GetNumberOfMisses() << " fits, "
+                      << kinfitStore->GetNumberOfResults() << " results stored." << std::endl;
+        }
     }
 
     void PrintStackedPlots(EventRegion eventRegion, bool isBlind, bool drawRatio)
@@ -838,6 +1666,11 @@ protected:
     DataCategoryCollection dataCategoryCollection;
     EventAnalyzerDataCollection anaDataCollection;
     mc_corrections::EventWeights weights;
+    mutable std::once_flag weights_config_flag;
+    mutable std::string weights_config;
+    std::shared_ptr<BTagWeightService> bTagWeight;
+    std::shared_ptr<BranchSelection> branchSelection;
+    std::shared_ptr<KinFitResultStore> kinfitStore;
 };
 
 } // namespace analysis
@@ -0,0 +1,82 @@
+/*! Definition of BinLookup class, a constant time bin search for axes with variable bin widths.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <TAxis.h>
+#include <TMath.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// The axis range is covered by a uniform grid with cells not wider than half of the narrowest bin. Each cell stores
+// the bin of its lower boundary. The cell found for x is only a starting point: the bin is then adjusted by the
+// comparisons with the bin edges, so the result is always the same as TAxis::FindFixBin. Because the cells are
+// narrower than the bins, at most one adjustment step is needed.
+class BinLookup {
+public:
+    static constexpr size_t MaxCells = 1 << 16;
+
+    explicit BinLookup(const TAxis& axis)
+        : n_bins(axis.GetNbins()), x_min(axis.GetXmin()), x_max(axis.GetXmax())
+    {
+        const TArrayD& axis_edges = *axis.GetXbins();
+        if(axis_edges.fN != n_bins + 1)
+            throw exception("Bin lookup is defined only for axes with variable bin widths.");
+        edges.assign(axis_edges.fArray, axis_edges.fArray + axis_edges.fN);
+
+        double min_width = x_max - x_min;
+        for(size_t n = 1; n < edges.size(); ++n)
+            min_width = std::min(min_width, edges.at(n) - edges.at(n - 1));
+        if(!(min_width > 0))
+            throw exception("Bin lookup requires bins with positive widths.");
+
+        const double n_cells_exact = std::ceil(2 * (x_max - x_min) / min_width);
+        const double max_cells = MaxCells;
+        const size_t n_cells = static_cast<size_t>(std::min(std::max(n_cells_exact, 1.), max_cells));
+        scale = n_cells / (x_max - x_min);
+        cell_bins.resize(n_cells);
+        for(size_t n = 0; n < n_cells; ++n) {
+            const double cell_low = x_min + n / scale;
+            cell_bins.at(n) = std::min(SearchBin(cell_low), n_bins);
+        }
+    }
+
+    Int_t FindBin(double x) const
+    {
+        if(x < x_min) return 0;
+        if(!(x < x_max)) return n_bins + 1;
+        const size_t cell = std::min(static_cast<size_t>((x - x_min) * scale), cell_bins.size() - 1);
+        Int_t bin = cell_bins[cell];
+        while(bin > 1 && x < edges[bin - 1]) --bin;
+        while(bin < n_bins && !(x < edges[bin])) ++bin;
+        return bin;
+    }
+
+    void FindBins(const double* x, Int_t* bins, size_t n) const
+    {
+        for(size_t i = 0; i < n; ++i)
+            bins[i] = FindBin(x[i]);
+    }
+
+private:
+    Int_t SearchBin(double x) const
+    {
+        if(x < x_min) return 0;
+        if(!(x < x_max)) return n_bins + 1;
+        return 1 + static_cast<Int_t>(TMath::BinarySearch(static_cast<Long64_t>(edges.size()), edges.data(), x));
+    }
+
+private:
+    Int_t n_bins;
+    double x_min, x_max, scale;
+    std::vector<double> edges;
+    std::vector<Int_t> cell_bins;
+};
+
+} // namespace analysis
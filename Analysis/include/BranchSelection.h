@@ -0,0 +1,108 @@
+/*! Definition of BranchSelection class, which decides which tuple branches should be read by an analyzer.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <map>
+#include <mutex>
+
+#include <TTree.h>
+#include <TBranch.h>
+
+namespace analysis {
+
+// Branches are declared by patterns: exact name, prefix ("jets_*") or suffix ("*_1").
+// A disabled branch is not read, so the analyzer checks the selection on the first entries of each source (see
+// BaseEventAnalyzer::CheckBranchSelection).
+class BranchSelection {
+public:
+    using NameSet = std::set<std::string>;
+
+    struct BranchSize {
+        Long64_t zip_bytes, tot_bytes;
+        BranchSize() : zip_bytes(0), tot_bytes(0) {}
+    };
+
+    using BranchSizeMap = std::map<std::string, BranchSize>;
+
+    BranchSelection(const NameSet& _required_patterns, const NameSet& _always_disabled)
+        : required_patterns(_required_patterns), always_disabled(_always_disabled) {}
+
+    bool IsRequired(const std::string& branch_name) const
+    {
+        if(always_disabled.count(branch_name)) return false;
+        for(const std::string& pattern : required_patterns) {
+            if(MatchPattern(pattern, branch_name)) return true;
+        }
+        return false;
+    }
+
+    NameSet GetDisabledBranches(TTree& tree)
+    {
+        NameSet disabled = always_disabled;
+        std::lock_guard<std::mutex> lock(mutex);
+        TIter next(tree.GetListOfBranches());
+        while(TBranch* branch = dynamic_cast<TBranch*>(next())) {
+            const std::string name = branch->GetName();
+            const bool required = IsRequired(name);
+            BranchSize& size = required ? read_sizes[name] : skipped_sizes[name];
+            size.zip_bytes += branch->GetZipBytes("*");
+            size.tot_bytes += branch->GetTotBytes("*");
+            if(!required)
+                disabled.insert(name);
+        }
+        return disabled;
+    }
+
+    void PrintReport(std::ostream& os) const
+    {
+        static const double MB = 1024. * 1024.;
+        std::lock_guard<std::mutex> lock(mutex);
+        const BranchSize read_total = Sum(read_sizes), skipped_total = Sum(skipped_sizes);
+        const Long64_t zip_total = read_total.zip_bytes + skipped_total.zip_bytes;
+        os << "Branch pruning: " << read_sizes.size() << " branches read, " << skipped_sizes.size()
+           << " branches skipped.\n" << std::fixed << std::setprecision(1)
+           << "Compressed bytes read: " << read_total.zip_bytes / MB << " MB, skipped: " << skipped_total.zip_bytes / MB
+           << " MB (" << (zip_total ? 100. * skipped_total.zip_bytes / zip_total : 0.) << "%).\n"
+           << "Uncompressed bytes read: " << read_total.tot_bytes / MB << " MB, skipped: "
+           << skipped_total.tot_bytes / MB << " MB.\n";
+        for(const auto& entry : skipped_sizes)
+            os << "    skipped " << entry.first << ": " << entry.second.zip_bytes / MB << " MB compressed, "
+               << entry.second.tot_bytes / MB << " MB uncompressed.\n";
+        os << std::defaultfloat << std::flush;
+    }
+
+private:
+    static bool MatchPattern(const std::string& pattern, const std::string& name)
+    {
+        if(pattern.size() && pattern.back() == '*') {
+            const size_t n = pattern.size() - 1;
+            return name.size() >= n && name.compare(0, n, pattern, 0, n) == 0;
+        }
+        if(pattern.size() && pattern.front() == '*') {
+            const size_t n = pattern.size() - 1;
+            return name.size() >= n && name.compare(name.size() - n, n, pattern, 1, n) == 0;
+        }
+        return pattern == name;
+    }
+
+    static BranchSize Sum(const BranchSizeMap& sizes)
+    {
+        BranchSize total;
+        for(const auto& entry : sizes) {
+            total.zip_bytes += entry.second.zip_bytes;
+            total.tot_bytes += entry.second.tot_bytes;
+        }
+        return total;
+    }
+
+private:
+    NameSet required_patterns, always_disabled;
+    BranchSizeMap read_sizes, skipped_sizes;
+    mutable std::mutex mutex;
+};
+
+} // namespace analysis
@@ -0,0 +1,390 @@
+/*! Definition of the columnar event cache, a flat binary column store of the analysis-ready events read via mmap.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <Rtypes.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+#include "AnaTuple.h"
+#include "Digest.h"
+
+namespace analysis {
+
+enum class ColumnType : uint32_t { Bool = 1, Int32 = 2, UInt32 = 3, Int64 = 4, UInt64 = 5, Float = 6, Double = 7 };
+
+template<typename T>
+struct ColumnTypeOf;
+
+#define COLUMN_TYPE(type, column_type) \
+    template<> struct ColumnTypeOf<type> { static constexpr ColumnType value = ColumnType::column_type; }
+COLUMN_TYPE(Bool_t, Bool);
+COLUMN_TYPE(Int_t, Int32);
+COLUMN_TYPE(UInt_t, UInt32);
+COLUMN_TYPE(Long64_t, Int64);
+COLUMN_TYPE(ULong64_t, UInt64);
+COLUMN_TYPE(Float_t, Float);
+COLUMN_TYPE(Double_t, Double);
+#undef COLUMN_TYPE
+
+// File layout: magic, format version, key length, key, number of rows, number of columns, column directory,
+// column data. Each directory entry is: name length, name, column type and offset of the values. Only fixed-width
+// columns are supported: a column stores one value per row. All sections are aligned to 64 bytes, so the columns
+// can be used in place from a memory mapped file.
+// The file name contains a digest of the source id, so sources with the same base name in different directories
+// don't share a cache file.
+struct ColumnarCacheFormat {
+    static constexpr uint32_t Magic() { return 0x43434848; }
+    static constexpr uint32_t FormatVersion() { return 2; }
+    static constexpr uint64_t Alignment() { return 64; }
+
+    static uint64_t Align(uint64_t offset) { return (offset + Alignment() - 1) / Alignment() * Alignment(); }
+
+    static size_t TypeSize(ColumnType type)
+    {
+        switch(type) {
+            case ColumnType::Bool: return sizeof(Bool_t);
+            case ColumnType::Int32: return sizeof(Int_t);
+            case ColumnType::UInt32: return sizeof(UInt_t);
+            case ColumnType::Int64: return sizeof(Long64_t);
+            case ColumnType::UInt64: return sizeof(ULong64_t);
+            case ColumnType::Float: return sizeof(Float_t);
+            case ColumnType::Double: return sizeof(Double_t);
+        }
+        throw exception("Unknown column type %1%.") % static_cast<uint32_t>(type);
+    }
+
+    static std::string MakeFileName(const std::string& cache_dir, const std::string& source_file_name,
+                                    const std::string& tree_name, const std::string& source_id)
+    {
+        const size_t pos = source_file_name.find_last_of('/');
+        const std::string base_name = pos == std::string::npos ? source_file_name : source_file_name.substr(pos + 1);
+        return cache_dir + "/" + base_name + "_" + tree_name + "_" + TextDigest(source_id).substr(0, 16) + ".columns";
+    }
+};
+
+// Columns are added first, then filled row by row: each column should get exactly one Fill per row.
+// The whole cache is kept in memory until Save.
+class ColumnarCacheWriter {
+public:
+    explicit ColumnarCacheWriter(const std::string& _key) : key(_key), n_rows(0) {}
+
+    template<typename T>
+    size_t AddColumn(const std::string& name)
+    {
+        if(n_rows)
+            throw exception("Column '%1%' should be added before the first row.") % name;
+        for(const auto& column : columns) {
+            if(column.name == name)
+                throw exception("Duplicated column '%1%'.") % name;
+        }
+        columns.push_back(Column{ name, ColumnTypeOf<T>::value, {} });
+        return columns.size() - 1;
+    }
+
+    template<typename T>
+    void Fill(size_t column_id, T value)
+    {
+        Column& column = GetColumn<T>(column_id);
+        Append(column.data, &value, 1);
+    }
+
+    void EndRow()
+    {
+        ++n_rows;
+        for(const auto& column : columns) {
+            const size_t n_filled = column.data.size() / ColumnarCacheFormat::TypeSize(column.type);
+            if(n_filled != n_rows)
+                throw exception("Column '%1%' is not filled for row %2%.") % column.name % (n_rows - 1);
+        }
+    }
+
+    size_t GetNumberOfRows() const { return n_rows; }
+
+    // Written to a temporary file first, so an interrupted job never leaves a truncated cache behind.
+    void Save(const std::string& file_name) const
+    {
+        uint64_t offset = sizeof(uint32_t) * 3 + key.size() + sizeof(uint64_t) + sizeof(uint32_t);
+        for(const auto& column : columns)
+            offset += sizeof(uint32_t) * 2 + column.name.size() + sizeof(uint64_t);
+        std::vector<uint64_t> data_offsets;
+        for(const auto& column : columns) {
+            offset = ColumnarCacheFormat::Align(offset);
+            data_offsets.push_back(offset);
+            offset += column.data.size();
+        }
+
+        const std::string tmp_name = file_name + ".tmp";
+        {
+            std::ofstream f(tmp_name, std::ios::binary | std::ios::trunc);
+            if(!f.is_open())
+                throw exception("Unable to create columnar cache file '%1%'.") % tmp_name;
+            f.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            Write(f, ColumnarCacheFormat::Magic());
+            Write(f, ColumnarCacheFormat::FormatVersion());
+            Write(f, static_cast<uint32_t>(key.size()));
+            f.write(key.data(), key.size());
+            Write(f, static_cast<uint64_t>(n_rows));
+            Write(f, static_cast<uint32_t>(columns.size()));
+            for(size_t n = 0; n < columns.size(); ++n) {
+                const Column& column = columns.at(n);
+                Write(f, static_cast<uint32_t>(column.name.size()));
+                f.write(column.name.data(), column.name.size());
+                Write(f, static_cast<uint32_t>(column.type));
+                Write(f, data_offsets.at(n));
+            }
+            for(size_t n = 0; n < columns.size(); ++n) {
+                const Column& column = columns.at(n);
+                Pad(f, data_offsets.at(n));
+                f.write(column.data.data(), column.data.size());
+            }
+        }
+        if(std::rename(tmp_name.c_str(), file_name.c_str()))
+            throw exception("Unable to move columnar cache file '%1%' to '%2%'.") % tmp_name % file_name;
+    }
+
+private:
+    struct Column {
+        std::string name;
+        ColumnType type;
+        std::vector<char> data;
+    };
+
+    template<typename T>
+    Column& GetColumn(size_t column_id)
+    {
+        Column& column = columns.at(column_id);
+        if(column.type != ColumnTypeOf<T>::value)
+            throw exception("Invalid type of the value for column '%1%'.") % column.name;
+        return column;
+    }
+
+    template<typename T>
+    static void Append(std::vector<char>& data, const T* values, size_t n)
+    {
+        const char* bytes = reinterpret_cast<const char*>(values);
+        data.insert(data.end(), bytes, bytes + n * sizeof(T));
+    }
+
+    template<typename T>
+    static void Write(std::ostream& s, const T& value)
+    {
+        s.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void Pad(std::ostream& s, uint64_t offset)
+    {
+        const uint64_t pos = static_cast<uint64_t>(s.tellp());
+        if(pos > offset)
+            throw exception("Inconsistent columnar cache layout.");
+        const std::vector<char> zeros(offset - pos, 0);
+        s.write(zeros.data(), zeros.size());
+    }
+
+private:
+    std::string key;
+    size_t n_rows;
+    std::vector<Column> columns;
+};
+
+// Maps the whole cache file read-only. Columns are returned as pointers into the mapping: nothing is copied or
+// decoded, pages are loaded by the kernel when the values are accessed. The pointers stay valid while the reader
+// exists.
+class ColumnarCacheReader {
+public:
+    explicit ColumnarCacheReader(const std::string& _file_name)
+        : file_name(_file_name), fd(-1), data(nullptr), size(0), n_rows(0)
+    {
+        fd = open(file_name.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw exception("Unable to open columnar cache file '%1%'.") % file_name;
+        struct stat file_stat;
+        if(fstat(fd, &file_stat)) {
+            close(fd);
+            throw exception("Unable to get the size of columnar cache file '%1%'.") % file_name;
+        }
+        size = static_cast<size_t>(file_stat.st_size);
+        void* mapped = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if(mapped == MAP_FAILED) {
+            close(fd);
+            throw exception("Unable to map columnar cache file '%1%'.") % file_name;
+        }
+        data = static_cast<const char*>(mapped);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        try {
+            ReadDirectory();
+        } catch(...) {
+            Unmap();
+            throw;
+        }
+    }
+
+    ColumnarCacheReader(const ColumnarCacheReader&) = delete;
+    ColumnarCacheReader& operator=(const ColumnarCacheReader&) = delete;
+    ~ColumnarCacheReader() { Unmap(); }
+
+    const std::string& GetFileName() const { return file_name; }
+    const std::string& GetKey() const { return key; }
+    size_t GetNumberOfRows() const { return n_rows; }
+    bool HasColumn(const std::string& name) const { return columns.count(name); }
+
+    template<typename T>
+    const T* GetColumn(const std::string& name) const
+    {
+        const ColumnInfo& column = FindColumn<T>(name);
+        return reinterpret_cast<const T*>(data + column.data_offset);
+    }
+
+private:
+    struct ColumnInfo {
+        ColumnType type;
+        uint64_t data_offset;
+    };
+
+    void ReadDirectory()
+    {
+        size_t pos = 0;
+        uint32_t magic, version, key_size, n_columns;
+        uint64_t rows;
+        if(!Read(pos, magic) || magic != ColumnarCacheFormat::Magic() || !Read(pos, version)
+                || version != ColumnarCacheFormat::FormatVersion())
+            throw exception("'%1%' is not a columnar cache file of a supported version.") % file_name;
+        if(!Read(pos, key_size) || !ReadString(pos, key_size, key) || !Read(pos, rows) || !Read(pos, n_columns))
+            throw exception("Columnar cache file '%1%' is truncated.") % file_name;
+        n_rows = static_cast<size_t>(rows);
+
+        for(uint32_t n = 0; n < n_columns; ++n) {
+            uint32_t name_size, type;
+            std::string name;
+            ColumnInfo column;
+            if(!Read(pos, name_size) || !ReadString(pos, name_size, name) || !Read(pos, type)
+                    || !Read(pos, column.data_offset))
+                throw exception("Columnar cache file '%1%' is truncated.") % file_name;
+            column.type = static_cast<ColumnType>(type);
+            const uint64_t data_end = column.data_offset + n_rows * ColumnarCacheFormat::TypeSize(column.type);
+            if(data_end > size || column.data_offset % ColumnarCacheFormat::Alignment())
+                throw exception("Invalid column '%1%' in columnar cache file '%2%'.") % name % file_name;
+            columns[name] = column;
+        }
+    }
+
+    template<typename T>
+    const ColumnInfo& FindColumn(const std::string& name) const
+    {
+        auto iter = columns.find(name);
+        if(iter == columns.end())
+            throw exception("Column '%1%' not found in columnar cache file '%2%'.") % name % file_name;
+        if(iter->second.type != ColumnTypeOf<T>::value)
+            throw exception("Column '%1%' in columnar cache file '%2%' has a different type.") % name % file_name;
+        return iter->second;
+    }
+
+    template<typename T>
+    bool Read(size_t& pos, T& value) const
+    {
+        if(pos + sizeof(T) > size) return false;
+        std::memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool ReadString(size_t& pos, size_t length, std::string& str) const
+    {
+        if(pos + length > size) return false;
+        str.assign(data + pos, length);
+        pos += length;
+        return true;
+    }
+
+    void Unmap()
+    {
+        if(data)
+            munmap(const_cast<char*>(data), size);
+        data = nullptr;
+        if(fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+
+private:
+    std::string file_name, key;
+    int fd;
+    const char* data;
+    size_t size, n_rows;
+    std::map<std::string, ColumnInfo> columns;
+};
+
+// Columns of the analysis-ready events: one fixed-width column per AnaEvent variable (see AnaTuple.h).
+class AnaEventColumnWriter {
+public:
+    explicit AnaEventColumnWriter(ColumnarCacheWriter& _writer) : writer(&_writer)
+    {
+#define VAR(type, name) name##_column = writer->AddColumn<type>(#name);
+        ANA_EVENT_DATA()
+#undef VAR
+    }
+
+    void Fill(const ntuple::AnaEvent& event)
+    {
+#define VAR(type, name) writer->Fill<type>(name##_column, event.name);
+        ANA_EVENT_DATA()
+#undef VAR
+        writer->EndRow();
+    }
+
+private:
+    ColumnarCacheWriter* writer;
+#define VAR(type, name) size_t name##_column;
+    ANA_EVENT_DATA()
+#undef VAR
+};
+
+// Column pointers into the mapped cache. Get copies only the scalar values of one row into an AnaEvent, so the
+// selection columns can be checked first and the rest of the row is touched only for the filled events.
+class AnaEventColumnReader {
+public:
+    explicit AnaEventColumnReader(const ColumnarCacheReader& reader)
+    {
+#define VAR(type, name) name = reader.GetColumn<type>(#name);
+        ANA_EVENT_DATA()
+#undef VAR
+    }
+
+    EventSelectionRecord GetSelection(size_t row) const
+    {
+        EventSelectionRecord selection = EventSelectionRecord();
+        selection.regions = regions[row];
+        selection.categories = categories[row];
+        selection.bjet_first = static_cast<uint16_t>(bjet_first[row]);
+        selection.bjet_second = static_cast<uint16_t>(bjet_second[row]);
+        selection.subCategories = static_cast<uint8_t>(subCategories[row]);
+        selection.flags = EventSelectionRecord::HasSubCategoriesFlag;
+        return selection;
+    }
+
+    void Get(size_t row, ntuple::AnaEvent& event) const
+    {
+#define VAR(type, name) event.name = name[row];
+        ANA_EVENT_DATA()
+#undef VAR
+    }
+
+public:
+#define VAR(type, name) const type* name;
+    ANA_EVENT_DATA()
+#undef VAR
+};
+
+} // namespace analysis
@@ -0,0 +1,66 @@
+/*! Stable digests of texts and files, used in the keys of the on-disk caches.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <TMD5.h>
+#include <TSystem.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// MD5 digest as a hex string. Unlike std::hash, it doesn't depend on the standard library or the build.
+inline std::string TextDigest(const std::string& text)
+{
+    TMD5 md5;
+    md5.Update(reinterpret_cast<const UChar_t*>(text.data()), static_cast<UInt_t>(text.size()));
+    md5.Final();
+    return md5.AsString();
+}
+
+// MD5 digest of the file content as a hex string.
+inline std::string FileDigest(const std::string& file_name)
+{
+    std::unique_ptr<TMD5> md5(TMD5::FileChecksum(file_name.c_str()));
+    if(!md5)
+        throw exception("Unable to compute the digest of '%1%'.") % file_name;
+    return md5->AsString();
+}
+
+// Digest of the names and contents of the regular files of a directory, in the name order. Hidden entries are
+// skipped. With recursive, the subdirectories are included as well.
+inline std::string DirectoryDigest(const std::string& dir_name, bool recursive = false)
+{
+    void* dir = dir_name.size() ? gSystem->OpenDirectory(dir_name.c_str()) : nullptr;
+    if(!dir)
+        throw exception("Directory '%1%' not found.") % dir_name;
+    std::vector<std::string> files, sub_dirs;
+    while(const char* entry = gSystem->GetDirEntry(dir)) {
+        const std::string name = entry;
+        FileStat_t stat;
+        if(name.empty() || name.at(0) == '.' || gSystem->GetPathInfo((dir_name + "/" + name).c_str(), stat))
+            continue;
+        if(R_ISREG(stat.fMode))
+            files.push_back(name);
+        else if(recursive && R_ISDIR(stat.fMode))
+            sub_dirs.push_back(name);
+    }
+    gSystem->FreeDirectory(dir);
+    std::sort(files.begin(), files.end());
+    std::sort(sub_dirs.begin(), sub_dirs.end());
+    std::ostringstream ss;
+    for(const auto& name : files)
+        ss << name << ":" << FileDigest(dir_name + "/" + name) << ";";
+    for(const auto& name : sub_dirs)
+        ss << name << "/:" << DirectoryDigest(dir_name + "/" + name, true) << ";";
+    return TextDigest(ss.str());
+}
+
+} // namespace analysis
@@ -3,9 +3,13 @@ This file is part of https://github.com/hh-italian-group/h-tautau. */
 
 #pragma once
 
+#include <unordered_map>
+
 #include "AnalysisTools/Core/include/AnalyzerData.h"
 #include "h-tautau/Analysis/include/EventInfo.h"
 #include "AnalysisCategories.h"
+#include "HistogramFillBuffer.h"
+#include "AnaTuple.h"
 
 namespace analysis {
 
@@ -58,12 +62,55 @@ public:
 
     virtual root_ext::SmartHistogram<TH1D>& m_sv_base() = 0;
 
-    explicit BaseEventAnalyzerData(bool _fill_all) : fill_all(_fill_all) {}
+    explicit BaseEventAnalyzerData(bool _fill_all)
+        : fill_all(_fill_all), fill_buffer_size(0), kinfitResults(nullptr) {}
 
     BaseEventAnalyzerData(std::shared_ptr<TFile> outputFile, const std::string& directoryName, bool _fill_all)
-        : AnalyzerData(outputFile, directoryName), fill_all(_fill_all) {}
+        : AnalyzerData(outputFile, directoryName), fill_all(_fill_all), fill_buffer_size(0), kinfitResults(nullptr) {}
+
+    virtual ~BaseEventAnalyzerData() { FlushFillBuffers(); }
+
+    // With a non-zero buffer size, histogram fills are buffered and binned in bulk every fill_buffer_size fills.
+    // Buffers should be flushed before the histograms are accessed.
+    void SetFillBufferSize(size_t _fill_buffer_size)
+    {
+        FlushFillBuffers();
+        fillBuffers.clear();
+        fill_buffer_size = _fill_buffer_size;
+    }
+
+    void FlushFillBuffers()
+    {
+        for(auto& buffer : fillBuffers)
+            buffer.second->Flush();
+    }
+
+    // Kinematic fit results used by FillBase instead of EventInfoBase::GetKinFitResults, if not null.
+    void SetKinFitResults(const kin_fit::FitResults* _kinfitResults) { kinfitResults = _kinfitResults; }
+
+    void FillHist(TH1D& hist, double value, double weight)
+    {
+        if(!fill_buffer_size) {
+            hist.Fill(value, weight);
+            return;
+        }
+        auto& buffer = fillBuffers[&hist];
+        if(!buffer)
+            buffer.reset(new HistogramFillBuffer(hist, fill_buffer_size));
+        buffer->Add(value, weight);
+    }
 
     using HistogramAccessor = root_ext::SmartHistogram<TH1D>& (BaseEventAnalyzerData::*)();
+    using BranchNameSet = std::set<std::string>;
+
+    // Tuple branches (or branch patterns) read by FillBase.
+    static const BranchNameSet& RequiredBranches()
+    {
+        static const BranchNameSet branches = {
+            "npv", "pfmt_2", "pfMET_*", "p4_1", "p4_2", "SVfit_*", "jets_p4", "jets_csv", "kinFit_*"
+        };
+        return branches;
+    }
 
     virtual const std::vector<double>& M_tt_Bins() const
     {
@@ -89,34 +136,64 @@ public:
     {
         if(event.HasBjetPair()){
             const double mX = event.GetResonanceMomentum(true, false).M();
-            m_ttbb().Fill(mX, weight);
-            m_ttbb_log().Fill(mX, weight);
-            const auto& kinfit = event.GetKinFitResults();
+            FillHist(m_ttbb(), mX, weight);
+            FillHist(m_ttbb_log(), mX, weight);
+            const auto& kinfit = kinfitResults ? *kinfitResults : event.GetKinFitResults();
             if(kinfit.HasValidMass())
-                m_ttbb_kinfit().Fill(kinfit.mass, weight);
+                FillHist(m_ttbb_kinfit(), kinfit.mass, weight);
         }
         if(!fill_all) return;
 
-        npv().Fill(event->npv,weight);
-        m_vis().Fill(event.GetHiggsTTMomentum(false).M(),weight);
-        mt_2().Fill(event->pfmt_2, weight);
-        MET().Fill(event.GetMET().GetMomentum().Pt(), weight);
-        MET_wide().Fill(event.GetMET().GetMomentum().Pt(), weight);
-        phiMET().Fill(event.GetMET().GetMomentum().Phi(),weight);
-        nJets_Pt30().Fill(event.GetNJets(),weight);
+        FillHist(npv(), event->npv, weight);
+        FillHist(m_vis(), event.GetHiggsTTMomentum(false).M(), weight);
+        FillHist(mt_2(), event->pfmt_2, weight);
+        FillHist(MET(), event.GetMET().GetMomentum().Pt(), weight);
+        FillHist(MET_wide(), event.GetMET().GetMomentum().Pt(), weight);
+        FillHist(phiMET(), event.GetMET().GetMomentum().Phi(), weight);
+        FillHist(nJets_Pt30(), event.GetNJets(), weight);
         if(!event.HasBjetPair()) return;
 
         const auto& Hbb = event.GetHiggsBB();
         const auto& b1 = Hbb.GetFirstDaughter();
         const auto& b2 = Hbb.GetSecondDaughter();
-        pt_b1().Fill(b1.GetMomentum().pt(), weight);
-        eta_b1().Fill(b1.GetMomentum().Eta(), weight);
-        csv_b1().Fill(b1->csv(), weight);
-        pt_b2().Fill(b2.GetMomentum().Pt(), weight);
-        eta_b2().Fill(b2.GetMomentum().Eta(), weight);
-        csv_b2().Fill(b2->csv(), weight);
+        FillHist(pt_b1(), b1.GetMomentum().pt(), weight);
+        FillHist(eta_b1(), b1.GetMomentum().Eta(), weight);
+        FillHist(csv_b1(), b1->csv(), weight);
+        FillHist(pt_b2(), b2.GetMomentum().Pt(), weight);
+        FillHist(eta_b2(), b2.GetMomentum().Eta(), weight);
+        FillHist(csv_b2(), b2->csv(), weight);
+    }
+
+    // Same as FillBase, using the observables precomputed in the analysis-ready tuple.
+    void FillBase(const ntuple::AnaEvent& event, double weight)
+    {
+        if(event.has_bjet_pair) {
+            FillHist(m_ttbb(), event.m_ttbb, weight);
+            FillHist(m_ttbb_log(), event.m_ttbb, weight);
+            if(event.kinfit_has_valid_mass)
+                FillHist(m_ttbb_kinfit(), event.kinfit_mass, weight);
+        }
+        if(!fill_all) return;
+
+        FillHist(npv(), event.npv, weight);
+        FillHist(m_vis(), event.m_vis, weight);
+        FillHist(mt_2(), event.mt_2, weight);
+        FillHist(MET(), event.MET_pt, weight);
+        FillHist(MET_wide(), event.MET_pt, weight);
+        FillHist(phiMET(), event.MET_phi, weight);
+        FillHist(nJets_Pt30(), event.n_jets, weight);
+        if(!event.has_bjet_pair) return;
+
+        FillHist(pt_b1(), event.pt_b1, weight);
+        FillHist(eta_b1(), event.eta_b1, weight);
+        FillHist(csv_b1(), event.csv_b1, weight);
+        FillHist(pt_b2(), event.pt_b2, weight);
+        FillHist(eta_b2(), event.eta_b2, weight);
+        FillHist(csv_b2(), event.csv_b2, weight);
     }
 
+    virtual void FillFromAnaTuple(const ntuple::AnaEvent& event, double weight) = 0;
+
     virtual void CreateAll()
     {
         m_vis(); m_ttbb(); m_ttbb_log(); m_ttbb_kinfit(); pt_b1(); eta_b1(); csv_b1(); pt_b2(); eta_b2();
@@ -128,6 +205,11 @@ public:
 
 protected:
     bool fill_all;
+
+private:
+    size_t fill_buffer_size;
+    std::unordered_map<const TH1*, std::unique_ptr<HistogramFillBuffer>> fillBuffers;
+    const kin_fit::FitResults* kinfitResults;
 };
 
 template<typename _FirstLeg>
@@ -151,26 +233,56 @@ public:
 
     using BaseEventAnalyzerData::BaseEventAnalyzerData;
 
+    static const BranchNameSet& RequiredBranches()
+    {
+        static const BranchNameSet branches = []() {
+            BranchNameSet result = BaseEventAnalyzerData::RequiredBranches();
+            result.insert("pfmt_1");
+            return result;
+        }();
+        return branches;
+    }
+
     virtual void Fill(EventInfo& event, double weight)
     {
         BaseEventAnalyzerData::FillBase(event, weight);
         const double m_SVfit = event.GetHiggsTTMomentum(true).M();
-        m_sv().Fill(m_SVfit, weight);
-        m_sv_bin().Fill(m_SVfit, weight);
+        FillHist(m_sv(), m_SVfit, weight);
+        FillHist(m_sv_bin(), m_SVfit, weight);
         if(!fill_all) return;
 
-        pt_1().Fill(event.GetLeg(1).GetMomentum().pt(), weight);
-        pt_1_log().Fill(event.GetLeg(1).GetMomentum().pt(), weight);
-        eta_1().Fill(event.GetLeg(1).GetMomentum().eta(), weight);
-        pt_2().Fill(event.GetLeg(2).GetMomentum().pt(), weight);
-        pt_2_log().Fill(event.GetLeg(2).GetMomentum().pt(), weight);
-        eta_2().Fill(event.GetLeg(2).GetMomentum().eta(), weight);
-        mt_1().Fill(event.GetFirstLeg()->mt(MetType::PF), weight);
+        FillHist(pt_1(), event.GetLeg(1).GetMomentum().pt(), weight);
+        FillHist(pt_1_log(), event.GetLeg(1).GetMomentum().pt(), weight);
+        FillHist(eta_1(), event.GetLeg(1).GetMomentum().eta(), weight);
+        FillHist(pt_2(), event.GetLeg(2).GetMomentum().pt(), weight);
+        FillHist(pt_2_log(), event.GetLeg(2).GetMomentum().pt(), weight);
+        FillHist(eta_2(), event.GetLeg(2).GetMomentum().eta(), weight);
+        FillHist(mt_1(), event.GetFirstLeg()->mt(MetType::PF), weight);
         if(!event.HasBjetPair()) return;
 
         const auto& Hbb = event.GetHiggsBB();
-        m_bb().Fill(Hbb.GetMomentum().M(), weight);
-        m_bb_bin().Fill(Hbb.GetMomentum().M(), weight);
+        FillHist(m_bb(), Hbb.GetMomentum().M(), weight);
+        FillHist(m_bb_bin(), Hbb.GetMomentum().M(), weight);
+    }
+
+    virtual void FillFromAnaTuple(const ntuple::AnaEvent& event, double weight) override
+    {
+        BaseEventAnalyzerData::FillBase(event, weight);
+        FillHist(m_sv(), event.m_sv, weight);
+        FillHist(m_sv_bin(), event.m_sv, weight);
+        if(!fill_all) return;
+
+        FillHist(pt_1(), event.pt_1, weight);
+        FillHist(pt_1_log(), event.pt_1, weight);
+        FillHist(eta_1(), event.eta_1, weight);
+        FillHist(pt_2(), event.pt_2, weight);
+        FillHist(pt_2_log(), event.pt_2, weight);
+        FillHist(eta_2(), event.eta_2, weight);
+        FillHist(mt_1(), event.mt_1, weight);
+        if(!event.has_bjet_pair) return;
+
+        FillHist(m_bb(), event.m_bb, weight);
+        FillHist(m_bb_bin(), event.m_bb, weight);
     }
 
     virtual root_ext::SmartHistogram<TH1D>& m_sv_base() override { return m_sv(); }
@@ -217,6 +329,16 @@ public:
 
     using BaseEventAnalyzerData::BaseEventAnalyzerData;
 
+    static const BranchNameSet& RequiredBranches()
+    {
+        static const BranchNameSet branches = []() {
+            BranchNameSet result = BaseEventAnalyzerData::RequiredBranches();
+            result.insert({ "pfmt_1", "tauIDs_1" });
+            return result;
+        }();
+        return branches;
+    }
+
     virtual void Fill(EventInfo& event, double weight)
     {
         BaseEventAnalyzerData::FillBase(event, weight);
@@ -224,13 +346,27 @@ public:
 
         const auto& tau1 = event.GetFirstLeg();
         const auto& tau2 = event.GetSecondLeg();
-        pt_1().Fill(tau1.GetMomentum().pt(), weight);
-        eta_1().Fill(tau1.GetMomentum().eta(), weight);
-        pt_2().Fill(tau2.GetMomentum().pt(), weight);
-        eta_2().Fill(tau2.GetMomentum().eta(), weight);
-        mt_1().Fill(tau1->mt(MetType::PF), weight);
-        iso_tau1().Fill(tau1->byCombinedIsolationDeltaBetaCorrRaw3Hits(), weight);
-        iso_tau2().Fill(tau1->byCombinedIsolationDeltaBetaCorrRaw3Hits(), weight);
+        FillHist(pt_1(), tau1.GetMomentum().pt(), weight);
+        FillHist(eta_1(), tau1.GetMomentum().eta(), weight);
+        FillHist(pt_2(), tau2.GetMomentum().pt(), weight);
+        FillHist(eta_2(), tau2.GetMomentum().eta(), weight);
+        FillHist(mt_1(), tau1->mt(MetType::PF), weight);
+        FillHist(iso_tau1(), tau1->byCombinedIsolationDeltaBetaCorrRaw3Hits(), weight);
+        FillHist(iso_tau2(), tau1->byCombinedIsolationDeltaBetaCorrRaw3Hits(), weight);
+    }
+
+    virtual void FillFromAnaTuple(const ntuple::AnaEvent& event, double weight) override
+    {
+        BaseEventAnalyzerData::FillBase(event, weight);
+        if(!fill_all) return;
+
+        FillHist(pt_1(), event.pt_1, weight);
+        FillHist(eta_1(), event.eta_1, weight);
+        FillHist(pt_2(), event.pt_2, weight);
+        FillHist(eta_2(), event.eta_2, weight);
+        FillHist(mt_1(), event.mt_1, weight);
+        FillHist(iso_tau1(), event.iso_1, weight);
+        FillHist(iso_tau2(), event.iso_1, weight);
     }
 
     virtual const std::vector<double>& M_ttbb_Bins() const override
@@ -257,9 +393,17 @@ public:
     {
         EventAnalyzerData::Fill(event, weight);
         const double m_SVfit = event.GetHiggsTTMomentum(true).M();
-        m_sv().Fill(m_SVfit, weight);
+        FillHist(m_sv(), m_SVfit, weight);
         if(!event.HasBjetPair()) return;
-        m_bb().Fill(event.GetHiggsBB().GetMomentum().M(), weight);
+        FillHist(m_bb(), event.GetHiggsBB().GetMomentum().M(), weight);
+    }
+
+    virtual void FillFromAnaTuple(const ntuple::AnaEvent& event, double weight) override
+    {
+        EventAnalyzerData::FillFromAnaTuple(event, weight);
+        FillHist(m_sv(), event.m_sv, weight);
+        if(!event.has_bjet_pair) return;
+        FillHist(m_bb(), event.m_bb, weight);
     }
 
     virtual root_ext::SmartHistogram<TH1D>& m_sv_base() override { return m_sv(); }
@@ -284,9 +428,17 @@ public:
     {
         EventAnalyzerData::Fill(event, weight);
         const double m_SVfit = event.GetHiggsTTMomentum(true).M();
-        m_sv().Fill(m_SVfit, weight);
+        FillHist(m_sv(), m_SVfit, weight);
         if(!event.HasBjetPair()) return;
-        m_bb().Fill(event.GetHiggsBB().GetMomentum().M(), weight);
+        FillHist(m_bb(), event.GetHiggsBB().GetMomentum().M(), weight);
+    }
+
+    virtual void FillFromAnaTuple(const ntuple::AnaEvent& event, double weight) override
+    {
+        EventAnalyzerData::FillFromAnaTuple(event, weight);
+        FillHist(m_sv(), event.m_sv, weight);
+        if(!event.has_bjet_pair) return;
+        FillHist(m_bb(), event.m_bb, weight);
     }
 
     virtual root_ext::SmartHistogram<TH1D>& m_sv_base() override { return m_sv(); }
@@ -3,6 +3,8 @@ This file is part of https://github.com/hh-italian-group/h-tautau. */
 
 #pragma once
 
+#include <TKey.h>
+
 #include "EventAnalyzerData.h"
 #include "h-tautau/Analysis/include/Htautau_2015.h"
 #include "custom_cuts.h"
@@ -252,9 +254,13 @@ std::ostream& operator<< (std::ostream& s, const EventAnalyzerDataMetaId<Types..
 using EventAnalyzerDataPtr = std::shared_ptr<BaseEventAnalyzerData>;
 using EventAnalyzerDataMap = std::map<EventAnalyzerDataId, EventAnalyzerDataPtr>;
 
+// The analyzer data are owned by the id map, which is used by the name-based API. On the fill path the data are
+// addressed through a dense slot table: (data category index, category, sub-category, region, energy scale) is
+// mapped to a position in a flat vector of pointers, where the data category index is obtained once per source
+// by GetDataCategoryIndex. A slot is bound to the map entry on the first fill.
 class EventAnalyzerDataCollection {
 public:
-    EventAnalyzerDataCollection(const std::string& outputFileName, bool store)
+    EventAnalyzerDataCollection(const std::string& outputFileName, bool store) : fill_buffer_size(0)
     {
         if(store)
             outputFile = root_ext::CreateRootFile(outputFileName);
@@ -280,7 +286,294 @@ public:
         anaData.Fill(event, weight);
     }
 
+    // Applied to the analyzer data created after the call.
+    void SetFillBufferSize(size_t _fill_buffer_size) { fill_buffer_size = _fill_buffer_size; }
+
+    void FlushFillBuffers()
+    {
+        for(const auto& entry : anaDataMap)
+            entry.second->FlushFillBuffers();
+    }
+
+    size_t GetDataCategoryIndex(const std::string& dataCategoryName)
+    {
+        const auto iter = dataCategoryIndices.find(dataCategoryName);
+        if(iter != dataCategoryIndices.end())
+            return iter->second;
+        const size_t index = dataCategoryNames.size();
+        dataCategoryNames.push_back(dataCategoryName);
+        dataCategoryIndices[dataCategoryName] = index;
+        slots.resize(slots.size() + GetSlotDimensions().block_size, nullptr);
+        return index;
+    }
+
+    // If kinfitResults is not null, it is used instead of the kinematic fit results of the event.
+    template<typename EventInfo>
+    void Fill(EventCategory eventCategory, EventSubCategory eventSubCategory, EventRegion eventRegion,
+              EventEnergyScale eventEnergyScale, size_t dataCategoryIndex, EventInfo& event, double weight,
+              const kin_fit::FitResults* kinfitResults = nullptr)
+    {
+        using AnaData = EventAnalyzerData<typename EventInfo::FirstLeg>;
+        const size_t slot_index = GetSlotDimensions().Index(eventCategory, eventSubCategory, eventRegion,
+                                                            eventEnergyScale, dataCategoryIndex);
+        BaseEventAnalyzerData*& anaData = slots.at(slot_index);
+        if(!anaData) {
+            const EventAnalyzerDataId id(eventCategory, eventSubCategory, eventRegion, eventEnergyScale,
+                                         dataCategoryNames.at(dataCategoryIndex));
+            anaData = &Get<typename EventInfo::FirstLeg>(id);
+        }
+        AnaData& slotData = *static_cast<AnaData*>(anaData);
+        slotData.SetKinFitResults(kinfitResults);
+        slotData.Fill(event, weight);
+        slotData.SetKinFitResults(nullptr);
+    }
+
+    // Fills the slot from the observables precomputed in the analysis-ready tuple.
+    template<typename FirstLeg>
+    void FillFromAnaTuple(EventCategory eventCategory, EventSubCategory eventSubCategory, EventRegion eventRegion,
+                          EventEnergyScale eventEnergyScale, size_t dataCategoryIndex, const ntuple::AnaEvent& event,
+                          double weight)
+    {
+        const size_t slot_index = GetSlotDimensions().Index(eventCategory, eventSubCategory, eventRegion,
+                                                            eventEnergyScale, dataCategoryIndex);
+        BaseEventAnalyzerData*& anaData = slots.at(slot_index);
+        if(!anaData) {
+            const EventAnalyzerDataId id(eventCategory, eventSubCategory, eventRegion, eventEnergyScale,
+                                         dataCategoryNames.at(dataCategoryIndex));
+            anaData = &Get<FirstLeg>(id);
+        }
+        anaData->FillFromAnaTuple(event, weight);
+    }
+
+    // Adds the content of the other collection to this one. Histograms are merged in the id order, so merging the
+    // same set of collections in the same order always produces the same result.
+    // Fill buffers of the other collection should be flushed before the merge.
+    template<typename FirstLeg>
+    void Merge(const EventAnalyzerDataCollection& other)
+    {
+        FlushFillBuffers();
+        for(const auto& entry : other.anaDataMap) {
+            auto& source = *dynamic_cast<EventAnalyzerData<FirstLeg>*>(entry.second.get());
+            auto& target = Get<FirstLeg>(entry.first);
+            MergeHistograms<TH1D>(source, target);
+            MergeHistograms<TH2D>(source, target);
+        }
+    }
+
+    template<typename FirstLeg>
+    void Scale(double scale_factor)
+    {
+        FlushFillBuffers();
+        for(const auto& entry : anaDataMap) {
+            auto& anaData = *dynamic_cast<EventAnalyzerData<FirstLeg>*>(entry.second.get());
+            ScaleHistograms<TH1D>(anaData, scale_factor);
+            ScaleHistograms<TH2D>(anaData, scale_factor);
+        }
+    }
+
+    // Names of the histograms with different bin contents or errors in the two collections. A histogram which
+    // exists only in one of the collections is compared with an empty one.
+    template<typename FirstLeg>
+    std::vector<std::string> FindDifferences(EventAnalyzerDataCollection& other)
+    {
+        FlushFillBuffers();
+        other.FlushFillBuffers();
+        std::set<EventAnalyzerDataId> ids;
+        for(const auto& entry : anaDataMap)
+            ids.insert(entry.first);
+        for(const auto& entry : other.anaDataMap)
+            ids.insert(entry.first);
+        std::vector<std::string> differences;
+        for(const auto& id : ids) {
+            auto& first = Get<FirstLeg>(id);
+            auto& second = other.Get<FirstLeg>(id);
+            CompareHistograms<TH1D>(id, first, second, differences);
+            CompareHistograms<TH2D>(id, first, second, differences);
+        }
+        return differences;
+    }
+
+    // Stores the histograms of each analyzer data in a subdirectory of dir named by EncodeId.
+    template<typename FirstLeg>
+    void Write(TDirectory& dir)
+    {
+        FlushFillBuffers();
+        for(const auto& entry : anaDataMap) {
+            auto& anaData = *dynamic_cast<EventAnalyzerData<FirstLeg>*>(entry.second.get());
+            TDirectory* subdir = dir.mkdir(EncodeId(entry.first).c_str());
+            if(!subdir)
+                throw exception("Unable to create directory for analyzer data '%1%'.") % entry.first;
+            WriteHistograms<TH1D>(anaData, *subdir);
+            WriteHistograms<TH2D>(anaData, *subdir);
+        }
+    }
+
+    // Adds the histograms stored by Write to this collection, in the same way as Merge does.
+    template<typename FirstLeg>
+    void Read(TDirectory& dir)
+    {
+        FlushFillBuffers();
+        EventAnalyzerDataCollection scratch("", false);
+        TIter next(dir.GetListOfKeys());
+        while(TKey* key = dynamic_cast<TKey*>(next())) {
+            if(std::string(key->GetClassName()) != "TDirectoryFile") continue;
+            const std::string dir_name = key->GetName();
+            const EventAnalyzerDataId id = DecodeId(dir_name);
+            auto& source = scratch.Get<FirstLeg>(id);
+            source.CreateAll();
+            auto& target = Get<FirstLeg>(id);
+            ReadHistograms<TH1D>(dir, dir_name, source, target);
+            ReadHistograms<TH2D>(dir, dir_name, source, target);
+        }
+    }
+
+    static std::string EncodeId(const EventAnalyzerDataId& id)
+    {
+        static const std::string separator = ";";
+        std::ostringstream ss;
+        ss << id.eventCategory << separator << id.eventSubCategory << separator << id.eventRegion << separator
+           << id.eventEnergyScale << separator << id.dataCategoryName;
+        return ss.str();
+    }
+
+    static EventAnalyzerDataId DecodeId(const std::string& name)
+    {
+        std::vector<std::string> fields;
+        size_t pos = 0;
+        for(size_t n = 0; n < 4; ++n) {
+            const size_t end = name.find(';', pos);
+            if(end == std::string::npos)
+                throw exception("Invalid analyzer data id '%1%'.") % name;
+            fields.push_back(name.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        return EventAnalyzerDataId(ParseIdField(AllEventCategories, fields.at(0)),
+                                   ParseIdField(AllEventSubCategories, fields.at(1)),
+                                   ParseIdField(AllEventRegions, fields.at(2)),
+                                   ParseIdField(AllEventEnergyScales, fields.at(3)), name.substr(pos));
+    }
+
 private:
+    struct SlotDimensions {
+        size_t n_categories, n_subCategories, n_regions, n_energyScales, block_size;
+
+        SlotDimensions()
+            : n_categories(Dimension(AllEventCategories)), n_subCategories(Dimension(AllEventSubCategories)),
+              n_regions(Dimension(AllEventRegions)), n_energyScales(Dimension(AllEventEnergyScales)),
+              block_size(n_categories * n_subCategories * n_regions * n_energyScales) {}
+
+        size_t Index(EventCategory eventCategory, EventSubCategory eventSubCategory, EventRegion eventRegion,
+                     EventEnergyScale eventEnergyScale, size_t dataCategoryIndex) const
+        {
+            return ((((dataCategoryIndex * n_categories + static_cast<size_t>(eventCategory)) * n_subCategories
+                    + static_cast<size_t>(eventSubCategory)) * n_regions + static_cast<size_t>(eventRegion))
+                    * n_energyScales + static_cast<size_t>(eventEnergyScale));
+        }
+
+        template<typename Enum>
+        static size_t Dimension(const std::set<Enum>& all_values)
+        {
+            if(all_values.empty() || static_cast<int>(*all_values.begin()) < 0)
+                throw exception("Unable to build the analyzer data slot table for a set of enum values which is empty"
+                                " or contains negative values.");
+            return static_cast<size_t>(*all_values.rbegin()) + 1;
+        }
+    };
+
+    static const SlotDimensions& GetSlotDimensions()
+    {
+        static const SlotDimensions dimensions;
+        return dimensions;
+    }
+
+    template<typename Histogram, typename AnaData>
+    static void MergeHistograms(AnaData& source, AnaData& target)
+    {
+        for(const auto& name : AnaData::template GetOriginalHistogramNames<Histogram>()) {
+            const auto source_hist = source.template GetPtr<Histogram>(name);
+            if(!source_hist) continue;
+            if(auto target_hist = target.template GetPtr<Histogram>(name))
+                target_hist->Add(source_hist);
+            else
+                target.Clone(*source_hist);
+        }
+    }
+
+    template<typename Histogram, typename AnaData>
+    static void CompareHistograms(const EventAnalyzerDataId& id, AnaData& first, AnaData& second,
+                                  std::vector<std::string>& differences)
+    {
+        for(const auto& name : AnaData::template GetOriginalHistogramNames<Histogram>()) {
+            const auto first_hist = first.template GetPtr<Histogram>(name);
+            const auto second_hist = second.template GetPtr<Histogram>(name);
+            if(!first_hist && !second_hist) continue;
+            const Int_t n_cells = first_hist ? first_hist->GetNcells() : second_hist->GetNcells();
+            for(Int_t bin = 0; bin < n_cells; ++bin) {
+                if(BinContent(first_hist, bin) != BinContent(second_hist, bin)
+                        || BinError(first_hist, bin) != BinError(second_hist, bin)) {
+                    std::ostringstream ss;
+                    ss << id << "/" << name;
+                    differences.push_back(ss.str());
+                    break;
+                }
+            }
+        }
+    }
+
+    template<typename HistogramPtr>
+    static double BinContent(const HistogramPtr& hist, Int_t bin) { return hist ? hist->GetBinContent(bin) : 0; }
+
+    template<typename HistogramPtr>
+    static double BinError(const HistogramPtr& hist, Int_t bin) { return hist ? hist->GetBinError(bin) : 0; }
+
+    template<typename Histogram, typename AnaData>
+    static void ScaleHistograms(AnaData& anaData, double scale_factor)
+    {
+        for(const auto& name : AnaData::template GetOriginalHistogramNames<Histogram>()) {
+            if(auto hist = anaData.template GetPtr<Histogram>(name))
+                hist->Scale(scale_factor);
+        }
+    }
+
+    template<typename Histogram, typename AnaData>
+    static void WriteHistograms(AnaData& anaData, TDirectory& dir)
+    {
+        for(const auto& name : AnaData::template GetOriginalHistogramNames<Histogram>()) {
+            if(auto hist = anaData.template GetPtr<Histogram>(name))
+                root_ext::WriteObject(static_cast<const Histogram&>(*hist), &dir, name);
+        }
+    }
+
+    // Stored histograms are copied into the histograms of the source, which are created with the same binning, and
+    // then merged into the target.
+    template<typename Histogram, typename AnaData>
+    static void ReadHistograms(TDirectory& dir, const std::string& dir_name, AnaData& source, AnaData& target)
+    {
+        for(const auto& name : AnaData::template GetOriginalHistogramNames<Histogram>()) {
+            std::unique_ptr<Histogram> stored(root_ext::TryReadObject<Histogram>(dir, dir_name + "/" + name));
+            if(!stored) continue;
+            auto source_hist = source.template GetPtr<Histogram>(name);
+            if(!source_hist)
+                throw exception("Unknown histogram '%1%' in '%2%'.") % name % dir_name;
+            source_hist->CopyContent(*stored);
+            if(auto target_hist = target.template GetPtr<Histogram>(name))
+                target_hist->Add(source_hist);
+            else
+                target.Clone(*source_hist);
+        }
+    }
+
+    template<typename Enum>
+    static Enum ParseIdField(const std::set<Enum>& all_values, const std::string& str)
+    {
+        for(Enum value : all_values) {
+            std::ostringstream ss;
+            ss << value;
+            if(ss.str() == str) return value;
+        }
+        throw exception("Unknown analyzer data id field '%1%'.") % str;
+    }
+
     template<typename FirstLeg>
     EventAnalyzerDataPtr MakeAnaData(const EventAnalyzerDataId& id) const
     {
@@ -306,16 +599,23 @@ private:
     EventAnalyzerDataPtr Make(const EventAnalyzerDataId& id) const
     {
         const bool fill_all = id.eventEnergyScale == EventEnergyScale::Central;
+        EventAnalyzerDataPtr anaData;
         if(outputFile) {
             const std::string dir_name = id.GetName();
-            return EventAnalyzerDataPtr(new AnaData(outputFile, dir_name, fill_all));
-        }
-        return EventAnalyzerDataPtr(new AnaData(fill_all));
+            anaData.reset(new AnaData(outputFile, dir_name, fill_all));
+        } else
+            anaData.reset(new AnaData(fill_all));
+        anaData->SetFillBufferSize(fill_buffer_size);
+        return anaData;
     }
 
 private:
     std::shared_ptr<TFile> outputFile;
+    size_t fill_buffer_size;
     EventAnalyzerDataMap anaDataMap;
+    std::map<std::string, size_t> dataCategoryIndices;
+    std::vector<std::string> dataCategoryNames;
+    std::vector<BaseEventAnalyzerData*> slots;
 };
 
 class EventAnalyzerDataCollectionReader {
@@ -0,0 +1,135 @@
+/*! Definition of EventIndex class, a persistent map from the event id to the tuple entry.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <tuple>
+#include <algorithm>
+
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "SidecarCache.h"
+#include "BranchSelection.h"
+#include "EventTupleReader.h"
+
+namespace analysis {
+
+struct EventIndexRecord {
+    uint64_t evt;
+    uint32_t run, lumi;
+    int32_t energy_scale;
+    uint32_t padding;
+    int64_t entry;
+
+    std::tuple<uint32_t, uint32_t, uint64_t, int32_t, int64_t> Tie() const
+    {
+        return std::make_tuple(run, lumi, evt, energy_scale, entry);
+    }
+};
+
+// Records (run, lumi, event, energy scale, entry) of the whole tree sorted by the event id, so an entry is found by
+// a binary search. The index is built once, reading only the event id branches, and stored in a sidecar file
+// next to the other caches. It is rebuilt if the input file changes.
+class EventIndex {
+public:
+    using Record = EventIndexRecord;
+    using Cache = SidecarCache<Record>;
+    using EntryRange = Cache::EntryRange;
+
+    static constexpr unsigned Version() { return 1; }
+
+    EventIndex(const std::string& file_name, const std::string& tree_name, const std::string& index_dir)
+        : loaded(false)
+    {
+        Long64_t n_entries;
+        std::string source_id;
+        {
+            auto file = root_ext::OpenRootFile(file_name);
+            TTree* tree = root_ext::ReadObject<TTree>(*file, tree_name);
+            n_entries = tree->GetEntries();
+            source_id = Cache::SourceIdentity(*file, *tree);
+            BranchSelection branchSelection({ "run", "lumi", "evt", "eventEnergyScale" }, {});
+            disabled_branches = branchSelection.GetDisabledBranches(*tree);
+        }
+
+        std::ostringstream key;
+        key << "event_index_v" << Version() << ";tree=" << tree_name << ";source=" << source_id;
+        Cache cache(Cache::MakeFileName(index_dir, file_name, source_id, tree_name, EntryRange(0, n_entries),
+                                        "evtidx"), key.str());
+        loaded = cache.Load(records, static_cast<size_t>(n_entries));
+        if(loaded) return;
+
+        Build(file_name, tree_name, n_entries);
+        cache.Save(records);
+    }
+
+    bool IsLoaded() const { return loaded; }
+    size_t GetNumberOfEntries() const { return records.size(); }
+
+    bool Find(const EventIdentifier& eventId, EventEnergyScale energyScale, Long64_t& entry) const
+    {
+        const auto range = EqualRange(eventId);
+        for(auto iter = range.first; iter != range.second; ++iter) {
+            if(iter->energy_scale != static_cast<int32_t>(energyScale)) continue;
+            entry = iter->entry;
+            return true;
+        }
+        return false;
+    }
+
+    // All entries of the event, for all energy scales.
+    std::vector<Long64_t> FindAll(const EventIdentifier& eventId) const
+    {
+        std::vector<Long64_t> entries;
+        const auto range = EqualRange(eventId);
+        for(auto iter = range.first; iter != range.second; ++iter)
+            entries.push_back(iter->entry);
+        return entries;
+    }
+
+private:
+    using Iterator = std::vector<Record>::const_iterator;
+
+    std::pair<Iterator, Iterator> EqualRange(const EventIdentifier& eventId) const
+    {
+        const auto id = std::make_tuple(static_cast<uint32_t>(eventId.runId), static_cast<uint32_t>(eventId.lumiBlock),
+                                        static_cast<uint64_t>(eventId.eventId));
+        const auto first = std::lower_bound(records.begin(), records.end(), id, [](const Record& r, const IdTuple& x) {
+            return std::make_tuple(r.run, r.lumi, r.evt) < x;
+        });
+        const auto last = std::upper_bound(first, records.cend(), id, [](const IdTuple& x, const Record& r) {
+            return x < std::make_tuple(r.run, r.lumi, r.evt);
+        });
+        return std::make_pair(first, last);
+    }
+
+    void Build(const std::string& file_name, const std::string& tree_name, Long64_t n_entries)
+    {
+        static constexpr size_t n_prefetch = 1000;
+        static constexpr Long64_t cache_size = 10 * 1024 * 1024;
+
+        records.clear();
+        records.reserve(static_cast<size_t>(n_entries));
+        EventTupleReader reader(file_name, tree_name, disabled_branches, EntryRange(0, n_entries), n_prefetch,
+                                cache_size);
+        while(const ntuple::Event* event = reader.Next()) {
+            Record record;
+            record.run = event->run;
+            record.lumi = event->lumi;
+            record.evt = event->evt;
+            record.energy_scale = static_cast<int32_t>(event->eventEnergyScale);
+            record.padding = 0;
+            record.entry = reader.GetCurrentEntry();
+            records.push_back(record);
+        }
+        std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.Tie() < b.Tie(); });
+    }
+
+private:
+    using IdTuple = std::tuple<uint32_t, uint32_t, uint64_t>;
+
+    std::vector<Record> records;
+    BranchSelection::NameSet disabled_branches;
+    bool loaded;
+};
+
+} // namespace analysis
@@ -0,0 +1,90 @@
+/*! Definition of EventSelectionRecord, the cached result of the analyzer event selection.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include "AnalysisCategories.h"
+#include "SidecarCache.h"
+
+namespace analysis {
+
+// Selected b-jet pair, event categories, event region for each category (4 bits per category) and
+// event sub-categories. Sub-categories require the kinematic fit, so they are evaluated only for the events which
+// are filled at least once; HasSubCategories tells if subCategories is already filled.
+struct EventSelectionRecord {
+    static constexpr size_t MaxCategories = 16;
+    static constexpr size_t RegionBits = 4;
+    static constexpr size_t MaxSubCategories = 8;
+    static constexpr uint8_t HasSubCategoriesFlag = 1;
+
+    uint64_t regions;
+    uint32_t categories;
+    uint16_t bjet_first, bjet_second;
+    uint8_t subCategories;
+    uint8_t flags;
+
+    static_assert(MaxCategories <= sizeof(categories) * 8 && MaxCategories * RegionBits <= sizeof(regions) * 8
+                  && MaxSubCategories <= sizeof(subCategories) * 8,
+                  "Event selection record fields are too small for the declared number of values.");
+    // The last value of each enum should be updated when a new value is added.
+    static_assert(static_cast<size_t>(EventCategory::TwoJets_AtLeastOneLooseBtag) < MaxCategories,
+                  "Event categories don't fit in the event selection record.");
+    static_assert(static_cast<size_t>(EventRegion::SS_AntiIso_HighMt) < (size_t(1) << RegionBits),
+                  "Event regions don't fit in the event selection record.");
+    static_assert(static_cast<size_t>(EventSubCategory::KinematicFitConvergedOutsideMassWindow) < MaxSubCategories,
+                  "Event sub-categories don't fit in the event selection record.");
+
+    template<typename Selection>
+    static constexpr bool CanStore()
+    {
+        return (Selection::categories >> MaxCategories) == 0 && (Selection::regions >> (size_t(1) << RegionBits)) == 0
+                && (Selection::subCategories >> MaxSubCategories) == 0;
+    }
+
+    EventInfoBase::BjetPair GetBjetPair() const { return EventInfoBase::BjetPair(bjet_first, bjet_second); }
+
+    void SetBjetPair(const EventInfoBase::BjetPair& pair)
+    {
+        bjet_first = static_cast<uint16_t>(pair.first);
+        bjet_second = static_cast<uint16_t>(pair.second);
+    }
+
+    bool HasCategory(EventCategory category) const { return (categories >> static_cast<unsigned>(category)) & 1; }
+
+    EventRegion GetRegion(EventCategory category) const
+    {
+        return static_cast<EventRegion>((regions >> (RegionBits * static_cast<unsigned>(category)))
+                                        & ((uint64_t(1) << RegionBits) - 1));
+    }
+
+    void AddCategory(EventCategory category, EventRegion region)
+    {
+        const unsigned index = static_cast<unsigned>(category);
+        categories |= uint32_t(1) << index;
+        regions |= static_cast<uint64_t>(region) << (RegionBits * index);
+    }
+
+    bool HasSubCategories() const { return flags & HasSubCategoriesFlag; }
+
+    EventSubCategorySet GetSubCategories() const
+    {
+        EventSubCategorySet sub_categories;
+        for(unsigned n = 0; n < MaxSubCategories; ++n) {
+            if((subCategories >> n) & 1)
+                sub_categories.insert(static_cast<EventSubCategory>(n));
+        }
+        return sub_categories;
+    }
+
+    void SetSubCategories(const EventSubCategorySet& sub_categories)
+    {
+        subCategories = 0;
+        for(EventSubCategory subCategory : sub_categories)
+            subCategories |= static_cast<uint8_t>(1 << static_cast<unsigned>(subCategory));
+        flags |= HasSubCategoriesFlag;
+    }
+};
+
+using EventSelectionCache = SidecarCache<EventSelectionRecord>;
+
+} // namespace analysis
@@ -0,0 +1,146 @@
+/*! Event selection rules shared by the event analyzers and the analysis-ready tuple producer.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "h-tautau/Analysis/include/Htautau_2015.h"
+#include "h-tautau/McCorrections/include/EventWeights.h"
+#include "AnalysisCategories.h"
+#include "custom_cuts.h"
+#include "TauIdColumns.h"
+#include "BTagWeightService.h"
+
+namespace analysis {
+
+// Two jets with pt > 30 GeV and |eta| < 2.4 with the highest CSV. Missing jets are given indices beyond the jet
+// collection. Without CSV ordering, the two leading jets are taken.
+inline EventInfoBase::BjetPair SelectBjetPair(const ntuple::Event& event, bool order_bjet_by_csv)
+{
+    if(!order_bjet_by_csv)
+        return EventInfoBase::BjetPair(0, 1);
+
+    std::vector<std::pair<size_t,double>> csvPosition;
+    for(size_t n = 0; n < event.jets_csv.size(); ++n) {
+        const auto& p4 = event.jets_p4.at(n);
+        if(p4.pt() < 30 || std::abs(p4.eta()) > 2.4) continue;
+        std::pair<size_t,double> csvIndex(n, event.jets_csv.at(n));
+        csvPosition.push_back(csvIndex);
+    }
+
+    auto pairCompare = [&](const std::pair<size_t,double> firstElem, const std::pair<size_t,double> secondElem) -> bool
+    {  return firstElem.second > secondElem.second; } ;
+
+    std::sort(csvPosition.begin(),csvPosition.end(),pairCompare);
+
+    EventInfoBase::BjetPair selected_pair(event.jets_csv.size(), event.jets_csv.size() + 1);
+    if(csvPosition.size() > 0)
+        selected_pair.first = csvPosition.at(0).first;
+    if(csvPosition.size() > 1)
+        selected_pair.second = csvPosition.at(1).first;
+    return selected_pair;
+}
+
+// The kinematic fit is evaluated only if use_kinfit is set. If kinfit is not null, it is used instead of
+// the kinematic fit results of the event.
+inline EventSubCategorySet DetermineEventSubCategories(EventInfoBase& event, bool use_kinfit,
+                                                       const kin_fit::FitResults* kinfit = nullptr)
+{
+    using namespace cuts::massWindow;
+
+    EventSubCategorySet sub_categories;
+    sub_categories.insert(EventSubCategory::NoCuts);
+    if(event.HasBjetPair()) {
+        const double mass_tautau = event.GetHiggsTTMomentum(true).M();
+        const double mass_bb = event.GetHiggsBB().GetMomentum().M();
+        const bool kinfit_converged = use_kinfit && (kinfit ? *kinfit : event.GetKinFitResults()).HasValidMass();
+
+        if(kinfit_converged)
+            sub_categories.insert(EventSubCategory::KinematicFitConverged);
+
+        if(mass_tautau > m_tautau_low && mass_tautau < m_tautau_high
+                && mass_bb > m_bb_low && mass_bb < m_bb_high) {
+            sub_categories.insert(EventSubCategory::MassWindow);
+            if(kinfit_converged)
+                sub_categories.insert(EventSubCategory::KinematicFitConvergedWithMassWindow);
+        } else {
+            sub_categories.insert(EventSubCategory::OutsideMassWindow);
+            if(kinfit_converged)
+                sub_categories.insert(EventSubCategory::KinematicFitConvergedOutsideMassWindow);
+        }
+    }
+    return sub_categories;
+}
+
+// MC correction weight of the event, without the cross-section scale factor of the source.
+// If the b-tag weight service is provided, it replaces the b-tag weight of EventWeights.
+inline double ComputeCorrectionWeight(const ntuple::Event& event, mc_corrections::EventWeights& eventWeights,
+                                      BTagWeightService* bTagWeight, bool apply_btag_weight)
+{
+    if(apply_btag_weight && bTagWeight)
+        return eventWeights.GetTotalWeight(event, false, cuts::Htautau_2015::btag::CSVM) * bTagWeight->GetWeight(event);
+    return eventWeights.GetTotalWeight(event, apply_btag_weight, cuts::Htautau_2015::btag::CSVM);
+}
+
+// Event region of the channel with the given first leg. Tau IDs are taken from tauIds.
+template<typename FirstLeg>
+struct EventRegionRule;
+
+template<>
+struct EventRegionRule<MuonCandidate> {
+    static EventRegion Determine(EventInfo<MuonCandidate>& event, const TauIds& tauIds)
+    {
+        using namespace cuts::Htautau_2015::MuTau;
+
+        const MuonCandidate& muon = event.GetFirstLeg();
+        const TauCandidate& tau = event.GetSecondLeg();
+
+        if(tauIds.Get(2, TauIdDiscriminator::againstMuonTight3) < tauID::againstMuonTight3
+                || tauIds.Get(2, TauIdDiscriminator::againstElectronVLooseMVA6) < tauID::againstElectronVLooseMVA6
+                || muon->iso() >= 0.15
+                || event->extraelec_veto || event->extramuon_veto)
+            return EventRegion::Unknown;
+
+        const bool os = muon.GetCharge() * tau.GetCharge() == -1;
+//        const bool iso = event.byTightIsolationMVArun2v1DBoldDMwLT_2 > 0.5;
+        const bool iso = tau->iso() > 0.2;
+        //        const bool low_mt = event.pfmt_1 < muonID::mt;
+        const bool low_mt = true;
+
+        if(iso && os) return low_mt ? EventRegion::OS_Isolated : EventRegion::OS_Iso_HighMt;
+        if(iso && !os) return low_mt ? EventRegion::SS_Isolated : EventRegion::SS_Iso_HighMt;
+        if(os) return low_mt ? EventRegion::OS_AntiIsolated : EventRegion::OS_AntiIso_HighMt;
+        return low_mt ? EventRegion::SS_AntiIsolated : EventRegion::SS_AntiIso_HighMt;
+    }
+};
+
+template<>
+struct EventRegionRule<ElectronCandidate> {
+    static EventRegion Determine(EventInfo<ElectronCandidate>& event, const TauIds& tauIds)
+    {
+        using namespace cuts::Htautau_2015::ETau;
+
+        const ElectronCandidate& electron = event.GetFirstLeg();
+        const TauCandidate& tau = event.GetSecondLeg();
+
+        if(tauIds.Get(2, TauIdDiscriminator::againstElectronTightMVA6) < 0.5
+                || tauIds.Get(2, TauIdDiscriminator::againstMuonLoose3) < 0.5
+                || electron->iso() >= 0.15
+                || event->extraelec_veto || event->extramuon_veto)
+            return EventRegion::Unknown;
+
+        const bool os = electron.GetCharge() * tau.GetCharge() == -1;
+        const bool iso = tau->iso() > 0.2;
+        const bool low_mt = true;
+
+        if(iso && os) return low_mt ? EventRegion::OS_Isolated : EventRegion::OS_Iso_HighMt;
+        if(iso && !os) return low_mt ? EventRegion::SS_Isolated : EventRegion::SS_Iso_HighMt;
+        if(os) return low_mt ? EventRegion::OS_AntiIsolated : EventRegion::OS_AntiIso_HighMt;
+        return low_mt ? EventRegion::SS_AntiIsolated : EventRegion::SS_AntiIso_HighMt;
+    }
+};
+
+} // namespace analysis
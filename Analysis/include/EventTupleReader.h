@@ -0,0 +1,161 @@
+/*! Definition of EventTupleReader class, the input stage of the event analyzers.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <set>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <exception>
+
+#include <TTree.h>
+#include <TBranch.h>
+
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Run/include/EntryQueue.h"
+#include "h-tautau/Analysis/include/EventTuple.h"
+#include "TauIdColumns.h"
+
+namespace analysis {
+
+// Reads an entry range of EventTuple. The tree cache is restricted to the active branches and the entry range.
+// With n_prefetch > 0, entries are read and decompressed by a background thread into a pool of n_prefetch events,
+// so the consumer works on already decoded events while the next baskets are being read.
+// An event returned by Next() stays valid until the next call of Next().
+// Entries rejected by the optional entry filter are not read at all.
+// Compact tau ID columns, if present in the file, are read together with the event and are accessed via GetTauIds().
+class EventTupleReader {
+public:
+    using Event = ntuple::Event;
+    struct EventEntry {
+        Long64_t entry;
+        Event event;
+        TauIdColumns::Values tauIds_1, tauIds_2;
+    };
+    using EventEntryPtr = std::shared_ptr<EventEntry>;
+    using EventQueue = run::EntryQueue<EventEntryPtr>;
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+    using NameSet = std::set<std::string>;
+    using EntryFilter = std::function<bool(Long64_t)>;
+
+    EventTupleReader(const std::string& file_name, const std::string& tree_name, const NameSet& disabled_branches,
+                     const EntryRange& _entryRange, size_t n_prefetch, Long64_t cache_size,
+                     const EntryFilter& _entryFilter = EntryFilter())
+        : file(root_ext::OpenRootFile(file_name)), entryRange(_entryRange), entryFilter(_entryFilter),
+          next_entry(entryRange.first), current_entry(-1),
+          readyQueue(std::max<size_t>(n_prefetch, 1)), freeQueue(std::max<size_t>(n_prefetch, 1))
+    {
+        tuple.reset(new ntuple::EventTuple(tree_name, file.get(), true, disabled_branches));
+        TTree* tree = root_ext::ReadObject<TTree>(*file, tree_name);
+        tauIdReader.reset(new TauIdColumnReader(*file, *tree, tree_name));
+        if(n_prefetch)
+            tree->SetParallelUnzip(kTRUE);
+        if(cache_size > 0) {
+            tree->SetCacheSize(cache_size);
+            tree->SetCacheEntryRange(entryRange.first, entryRange.second);
+            TIter next(tree->GetListOfBranches());
+            while(TBranch* branch = dynamic_cast<TBranch*>(next())) {
+                if(!disabled_branches.count(branch->GetName()))
+                    tree->AddBranchToCache(branch, kTRUE);
+            }
+            tree->StopCacheLearningPhase();
+        }
+
+        if(n_prefetch) {
+            for(size_t n = 0; n < n_prefetch; ++n)
+                freeQueue.Push(EventEntryPtr(new EventEntry()));
+            readThread = std::thread(&EventTupleReader::ReadThread, this);
+        }
+    }
+
+    EventTupleReader(const EventTupleReader&) = delete;
+    EventTupleReader& operator=(const EventTupleReader&) = delete;
+
+    ~EventTupleReader()
+    {
+        if(readThread.joinable()) {
+            freeQueue.SetAllDone();
+            EventEntryPtr eventEntry;
+            while(readyQueue.Pop(eventEntry)) {}
+            readThread.join();
+        }
+    }
+
+    const Event* Next()
+    {
+        if(!readThread.joinable()) {
+            if(!NextSelectedEntry(current_entry)) return nullptr;
+            tuple->GetEntry(current_entry);
+            return &tuple->data();
+        }
+
+        if(currentEvent)
+            freeQueue.Push(currentEvent);
+        currentEvent.reset();
+        if(!readyQueue.Pop(currentEvent)) {
+            if(readError)
+                std::rethrow_exception(readError);
+            return nullptr;
+        }
+        current_entry = currentEvent->entry;
+        return &currentEvent->event;
+    }
+
+    Long64_t GetCurrentEntry() const { return current_entry; }
+
+    // Tau IDs of the event returned by the last call of Next().
+    TauIds GetTauIds() const
+    {
+        if(currentEvent)
+            return TauIds(currentEvent->event, tauIdReader.get(), &currentEvent->tauIds_1, &currentEvent->tauIds_2);
+        return TauIds(tuple->data(), tauIdReader.get(), &tauIdReader->GetValues(1), &tauIdReader->GetValues(2));
+    }
+
+private:
+    void ReadThread()
+    {
+        try {
+            EventEntryPtr eventEntry;
+            Long64_t entry;
+            while(NextSelectedEntry(entry) && freeQueue.Pop(eventEntry)) {
+                tuple->GetEntry(entry);
+                eventEntry->entry = entry;
+                eventEntry->event = tuple->data();
+                if(tauIdReader->IsAvailable()) {
+                    eventEntry->tauIds_1 = tauIdReader->GetValues(1);
+                    eventEntry->tauIds_2 = tauIdReader->GetValues(2);
+                }
+                readyQueue.Push(eventEntry);
+            }
+        } catch(...) {
+            readError = std::current_exception();
+        }
+        readyQueue.SetAllDone();
+    }
+
+    bool NextSelectedEntry(Long64_t& entry)
+    {
+        for(; next_entry < entryRange.second; ++next_entry) {
+            if(!entryFilter || entryFilter(next_entry)) {
+                entry = next_entry++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::shared_ptr<TFile> file;
+    std::shared_ptr<ntuple::EventTuple> tuple;
+    std::shared_ptr<TauIdColumnReader> tauIdReader;
+    EntryRange entryRange;
+    EntryFilter entryFilter;
+    Long64_t next_entry, current_entry;
+    EventQueue readyQueue, freeQueue;
+    EventEntryPtr currentEvent;
+    std::thread readThread;
+    std::exception_ptr readError;
+};
+
+} // namespace analysis
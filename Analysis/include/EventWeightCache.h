@@ -0,0 +1,37 @@
+/*! Definition of EventWeightRecord, the cached MC correction weight of an event.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include "SidecarCache.h"
+
+namespace analysis {
+
+// Product of the MC corrections without the data category scale factor. The event id is stored together with
+// the weight, so a record is used only for the event it was computed for.
+struct EventWeightRecord {
+    uint64_t evt;
+    uint32_t run, lumi;
+    double weight;
+    uint32_t valid;
+    uint32_t padding;
+
+    bool Matches(uint32_t _run, uint32_t _lumi, uint64_t _evt) const
+    {
+        return valid && run == _run && lumi == _lumi && evt == _evt;
+    }
+
+    void Set(uint32_t _run, uint32_t _lumi, uint64_t _evt, double _weight)
+    {
+        run = _run;
+        lumi = _lumi;
+        evt = _evt;
+        weight = _weight;
+        valid = 1;
+        padding = 0;
+    }
+};
+
+using EventWeightCache = SidecarCache<EventWeightRecord>;
+
+} // namespace analysis
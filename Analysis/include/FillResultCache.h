@@ -0,0 +1,120 @@
+/*! Definition of FillResultCache class, the on-disk cache of the histograms filled from one source unit.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <cstdio>
+#include <cctype>
+
+#include <TNamed.h>
+#include <TSystem.h>
+
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "EventAnalyzerDataCollection.h"
+#include "Digest.h"
+#include "TemporaryFile.h"
+
+namespace analysis {
+
+// ROOT file with the key as a TNamed and the histograms of the collection stored by EventAnalyzerDataCollection::Write.
+// The key is a text description of everything the filled histograms depend on (source file identity, entry range,
+// data category, selection, weights and histogram definitions). A cache with a different key is ignored.
+// The analyzer fill state (see BaseEventAnalyzer::Run) is stored in the same format with its own key.
+class FillResultCache {
+public:
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+
+    static std::string KeyName() { return "fill_result_key"; }
+    static std::string DataDirectoryName() { return "data"; }
+    static std::string PartitionKeySeparator() { return ";partition="; }
+    static std::string UnitsKeySeparator() { return ";units="; }
+
+    // The name contains a digest of the source id, so sources with the same base name in different directories
+    // don't share a cache file.
+    static std::string MakeFileName(const std::string& cache_dir, const std::string& source_file_name,
+                                    const std::string& source_id, const std::string& tree_name,
+                                    const EntryRange& entryRange, const std::string& dataCategoryName)
+    {
+        const size_t pos = source_file_name.find_last_of('/');
+        const std::string base_name = pos == std::string::npos ? source_file_name : source_file_name.substr(pos + 1);
+        std::string category_name = dataCategoryName;
+        for(char& c : category_name) {
+            if(!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+                c = '_';
+        }
+        std::ostringstream ss;
+        ss << cache_dir << "/" << category_name << "_" << base_name << "_" << TextDigest(source_id).substr(0, 16)
+           << "_" << tree_name << "_" << entryRange.first << "_" << entryRange.second << ".root";
+        return ss.str();
+    }
+
+    // Key of the partial result of one partition of a run, which has the given key. units_digest describes the list
+    // of source units which was split into the partitions, so the partial results of the same run are produced for
+    // the same list.
+    static std::string PartitionKey(const std::string& key, size_t partition_index, size_t n_partitions,
+                                    const std::string& units_digest)
+    {
+        std::ostringstream ss;
+        ss << key << PartitionKeySeparator() << partition_index << "/" << n_partitions << UnitsKeySeparator()
+           << units_digest;
+        return ss.str();
+    }
+
+    // Returns false if the key doesn't belong to a partial result.
+    static bool ParsePartitionKey(const std::string& partition_key, std::string& key, size_t& partition_index,
+                                  size_t& n_partitions, std::string& units_digest)
+    {
+        const size_t pos = partition_key.rfind(PartitionKeySeparator());
+        if(pos == std::string::npos) return false;
+        const size_t first = pos + PartitionKeySeparator().size();
+        const size_t units_pos = partition_key.find(UnitsKeySeparator(), first);
+        if(units_pos == std::string::npos) return false;
+        std::istringstream ss(partition_key.substr(first, units_pos - first));
+        char slash;
+        if(!(ss >> partition_index >> slash >> n_partitions) || slash != '/' || !ss.eof()
+                || partition_index >= n_partitions)
+            return false;
+        units_digest = partition_key.substr(units_pos + UnitsKeySeparator().size());
+        if(units_digest.empty()) return false;
+        key = partition_key.substr(0, pos);
+        return true;
+    }
+
+    FillResultCache(const std::string& _file_name, const std::string& _key) : file_name(_file_name), key(_key) {}
+
+    const std::string& GetFileName() const { return file_name; }
+
+    // Histograms are added to the collection only if the cache is valid.
+    template<typename FirstLeg>
+    bool Load(EventAnalyzerDataCollection& collection) const
+    {
+        if(gSystem->AccessPathName(file_name.c_str())) return false;
+        auto file = root_ext::OpenRootFile(file_name);
+        std::unique_ptr<TNamed> file_key(root_ext::TryReadObject<TNamed>(*file, KeyName()));
+        TDirectory* data = file->GetDirectory(DataDirectoryName().c_str());
+        if(!file_key || file_key->GetTitle() != key || !data) return false;
+        collection.Read<FirstLeg>(*data);
+        return true;
+    }
+
+    // Written to a unique temporary file first, in the same way as SidecarCache::Save.
+    template<typename FirstLeg>
+    void Save(EventAnalyzerDataCollection& collection) const
+    {
+        const std::string tmp_name = TemporaryFileName(file_name);
+        {
+            auto file = root_ext::CreateRootFile(tmp_name);
+            TNamed file_key(KeyName().c_str(), key.c_str());
+            file->WriteTObject(&file_key, KeyName().c_str());
+            TDirectory* data = file->mkdir(DataDirectoryName().c_str());
+            collection.Write<FirstLeg>(*data);
+        }
+        if(std::rename(tmp_name.c_str(), file_name.c_str()))
+            throw exception("Unable to move fill result cache file '%1%' to '%2%'.") % tmp_name % file_name;
+    }
+
+private:
+    std::string file_name, key;
+};
+
+} // namespace analysis
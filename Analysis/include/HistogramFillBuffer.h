@@ -0,0 +1,118 @@
+/*! Definition of HistogramFillBuffer class, which fills a histogram in bulk.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <TH1.h>
+#include <TMath.h>
+
+#include "BinLookup.h"
+
+namespace analysis {
+
+// Buffers (value, weight) pairs of a 1D histogram in contiguous arrays. On flush, bin indices of all buffered values
+// are computed in one pass (using BinLookup for variable bin widths), then contents, errors and statistics are
+// accumulated in the original fill order.
+// The result is identical to calling TH1::Fill for each pair, as long as the axis can't be extended.
+class HistogramFillBuffer {
+public:
+    HistogramFillBuffer(TH1& _hist, size_t _capacity)
+        : hist(&_hist), capacity(std::max<size_t>(_capacity, 1))
+    {
+        if(hist->GetXaxis()->GetXbins()->fN)
+            binLookup.reset(new BinLookup(*hist->GetXaxis()));
+        values.reserve(capacity);
+        weights.reserve(capacity);
+        bins.reserve(capacity);
+    }
+
+    HistogramFillBuffer(const HistogramFillBuffer&) = delete;
+    HistogramFillBuffer& operator=(const HistogramFillBuffer&) = delete;
+
+    void Add(double value, double weight)
+    {
+        values.push_back(value);
+        weights.push_back(weight);
+        if(values.size() >= capacity)
+            Flush();
+    }
+
+    void Flush()
+    {
+        const size_t n = values.size();
+        if(!n) return;
+
+        bins.resize(n);
+        if(binLookup)
+            binLookup->FindBins(values.data(), bins.data(), n);
+        else
+            FindBins(*hist->GetXaxis(), values.data(), bins.data(), n);
+
+        double stats[TH1::kNstat] = {};
+        const double n_entries = hist->GetEntries();
+        if(n_entries != 0)
+            hist->GetStats(stats);
+
+        const Int_t n_bins = hist->GetXaxis()->GetNbins();
+        const bool stat_overflows = TH1::GetStatOverflows();
+        TArrayD& sumw2 = *hist->GetSumw2();
+        for(size_t i = 0; i < n; ++i) {
+            const Int_t bin = bins[i];
+            const double x = values[i], w = weights[i];
+            if(!sumw2.fN && w != 1.0 && !hist->TestBit(TH1::kIsNotW))
+                hist->Sumw2();
+            hist->AddBinContent(bin, w);
+            if(sumw2.fN)
+                sumw2.fArray[bin] += w * w;
+            if((bin == 0 || bin > n_bins) && !stat_overflows) continue;
+            stats[0] += w;
+            stats[1] += w * w;
+            stats[2] += w * x;
+            stats[3] += w * x * x;
+        }
+
+        hist->PutStats(stats);
+        hist->SetEntries(n_entries + n);
+        values.clear();
+        weights.clear();
+    }
+
+    // Same as TAxis::FindFixBin.
+    static void FindBins(const TAxis& axis, const double* x, Int_t* bins, size_t n)
+    {
+        const Int_t n_bins = axis.GetNbins();
+        const double x_min = axis.GetXmin(), x_max = axis.GetXmax();
+        const TArrayD& edges = *axis.GetXbins();
+        if(!edges.fN) {
+            const double width = x_max - x_min;
+            for(size_t i = 0; i < n; ++i) {
+                const bool underflow = x[i] < x_min, overflow = !(x[i] < x_max);
+                const double x_in = underflow || overflow ? x_min : x[i];
+                const Int_t bin = 1 + static_cast<Int_t>(n_bins * (x_in - x_min) / width);
+                bins[i] = underflow ? 0 : overflow ? n_bins + 1 : bin;
+            }
+        } else {
+            for(size_t i = 0; i < n; ++i) {
+                if(x[i] < x_min)
+                    bins[i] = 0;
+                else if(!(x[i] < x_max))
+                    bins[i] = n_bins + 1;
+                else
+                    bins[i] = 1 + static_cast<Int_t>(TMath::BinarySearch(edges.fN, edges.fArray, x[i]));
+            }
+        }
+    }
+
+private:
+    TH1* hist;
+    size_t capacity;
+    std::vector<double> values, weights;
+    std::vector<Int_t> bins;
+    std::unique_ptr<BinLookup> binLookup;
+};
+
+} // namespace analysis
@@ -0,0 +1,70 @@
+/*! Lists of input ROOT files given as a directory or as a text file.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include <TSystem.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+inline bool IsRootFile(const std::string& path)
+{
+    static const std::string extension = ".root";
+    return path.size() >= extension.size()
+            && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+inline bool IsDirectory(const std::string& path)
+{
+    FileStat_t stat;
+    return !gSystem->GetPathInfo(path.c_str(), stat) && R_ISDIR(stat.fMode);
+}
+
+inline std::string BaseName(const std::string& path)
+{
+    const size_t pos = path.find_last_of('/');
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// path is a directory, from which all ROOT files are taken, or a text file with one input file per line. Empty lines
+// and lines starting with '#' are skipped. The files are returned in the name order, so the result doesn't depend on
+// the order of the directory entries.
+inline std::vector<std::string> FindInputFiles(const std::string& path)
+{
+    std::vector<std::string> inputs;
+    if(IsDirectory(path)) {
+        void* dir = gSystem->OpenDirectory(path.c_str());
+        if(!dir)
+            throw exception("Unable to open input directory '%1%'.") % path;
+        while(const char* entry = gSystem->GetDirEntry(dir)) {
+            const std::string name = entry;
+            if(IsRootFile(name))
+                inputs.push_back(path + "/" + name);
+        }
+        gSystem->FreeDirectory(dir);
+    } else {
+        std::ifstream list(path);
+        if(!list.is_open())
+            throw exception("Unable to open input file list '%1%'.") % path;
+        std::string line;
+        while(std::getline(list, line)) {
+            const size_t first = line.find_first_not_of(" \t");
+            if(first == std::string::npos || line.at(first) == '#') continue;
+            const size_t last = line.find_last_not_of(" \t\r");
+            inputs.push_back(line.substr(first, last - first + 1));
+        }
+    }
+    if(inputs.empty())
+        throw exception("No input files found in '%1%'.") % path;
+    std::sort(inputs.begin(), inputs.end());
+    return inputs;
+}
+
+} // namespace analysis
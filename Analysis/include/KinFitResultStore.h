@@ -0,0 +1,314 @@
+/*! Definition of KinFitResultStore class, a persistent store of the kinematic fit results.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "SidecarCache.h"
+#include "Digest.h"
+
+namespace analysis {
+
+// Inputs of the HHKinFit2 fit which are not taken from the event: the H->tautau and H->bb mass hypotheses, the b-jet
+// energy resolutions and the convergence settings of the fitter. The resolutions and the convergence settings are
+// hard-coded in HHKinFit2 and in the fit interface of h-tautau (kin_fit::FitProducer), so they are described by the
+// digest of their sources. The mass hypotheses should match the ones of kin_fit::FitProducer.
+// The version should be increased each time the way the fit inputs are taken from the event is changed.
+struct KinFitConfig {
+    static constexpr unsigned Version() { return 1; }
+
+    double mh_tautau, mh_bb;
+    std::string hhkinfit2_dir, fit_interface_file;
+
+    // Configuration of the fit run by EventInfo, FlatEventInfo and kin_fit::FitProducer.
+    static KinFitConfig Default()
+    {
+        const char* cmssw_base = std::getenv("CMSSW_BASE");
+        if(!cmssw_base)
+            throw exception("CMSSW_BASE is not set: the HHKinFit2 sources are not found.");
+        const std::string src = std::string(cmssw_base) + "/src";
+        KinFitConfig config;
+        config.mh_tautau = 125;
+        config.mh_bb = 125;
+        config.hhkinfit2_dir = src + "/HHKinFit2";
+        config.fit_interface_file = src + "/h-tautau/Analysis/include/KinFitInterface.h";
+        return config;
+    }
+
+    std::string ToString() const
+    {
+        std::ostringstream ss;
+        ss << "kinfit_config_v" << Version() << ";mh_tautau=" << mh_tautau << ";mh_bb=" << mh_bb
+           << ";HHKinFit2=" << DirectoryDigest(hhkinfit2_dir, true)
+           << ";interface=" << FileDigest(fit_interface_file);
+        return ss.str();
+    }
+};
+
+struct KinFitRecord {
+    uint64_t evt;
+    uint32_t run, lumi;
+    uint32_t first_bjet, second_bjet;
+    int32_t energy_scale;
+    int32_t convergence;
+    uint64_t inputs_digest;
+    double mass, chi2, probability;
+};
+
+// Kinematic fit results keyed by event id, indices of the b-jet pair and energy scale. There is a single store for
+// all samples and for all consumers (the analyzer, KinFitStudy and BjetSelectionStudy): the fit configuration
+// (see KinFitConfig) is a part of the file key, so a store produced with another configuration is ignored.
+// MC samples can share event ids, so each result also keeps a digest of the fit inputs (four-momenta of the taus,
+// b jets and MET) and a result is used only if the inputs are the same. A fit is run only if the result is not found.
+// The store is thread safe; the fits themselves are run outside of the lock.
+// On Save, results added to the file by other jobs since it was loaded are kept: the file is reloaded, merged and
+// replaced under an exclusive lock of <store>.lock, so jobs which save the same store at once don't lose each
+// other's results.
+class KinFitResultStore {
+public:
+    using BjetPair = std::pair<size_t, size_t>;
+    using Cache = SidecarCache<KinFitRecord>;
+
+    static constexpr unsigned Version() { return 2; }
+
+    KinFitResultStore(const std::string& file_name, const std::string& fit_config)
+        : cache(file_name, MakeKey(fit_config)), n_hits(0), n_misses(0), loaded(false), updated(false)
+    {
+        Cache::RecordVector loaded_records;
+        loaded = cache.Load(loaded_records);
+        for(const KinFitRecord& record : loaded_records)
+            Insert(record);
+    }
+
+    // Digest of the fit inputs, which doesn't depend on the build. Vector types should provide Px, Py, Pz and E.
+    template<typename LVector1, typename LVector2, typename LVector3, typename LVector4, typename LVector5>
+    static uint64_t InputsDigest(const LVector1& tau1, const LVector2& tau2, const LVector3& b1, const LVector4& b2,
+                                 const LVector5& met)
+    {
+        uint64_t digest = 0xcbf29ce484222325ULL;
+        AddToDigest(digest, tau1);
+        AddToDigest(digest, tau2);
+        AddToDigest(digest, b1);
+        AddToDigest(digest, b2);
+        AddToDigest(digest, met);
+        return digest;
+    }
+
+    bool Find(const EventIdentifier& eventId, const BjetPair& bjet_pair, EventEnergyScale energyScale,
+              uint64_t inputs_digest, kin_fit::FitResults& result) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return FindRecord(Key(eventId, bjet_pair, energyScale), inputs_digest, result);
+    }
+
+    void Add(const EventIdentifier& eventId, const BjetPair& bjet_pair, EventEnergyScale energyScale,
+             uint64_t inputs_digest, const kin_fit::FitResults& result)
+    {
+        KinFitRecord record;
+        std::memset(&record, 0, sizeof(record));
+        record.evt = eventId.eventId;
+        record.run = eventId.runId;
+        record.lumi = eventId.lumiBlock;
+        record.first_bjet = static_cast<uint32_t>(bjet_pair.first);
+        record.second_bjet = static_cast<uint32_t>(bjet_pair.second);
+        record.energy_scale = static_cast<int32_t>(energyScale);
+        record.convergence = result.convergence;
+        record.inputs_digest = inputs_digest;
+        record.mass = result.mass;
+        record.chi2 = result.chi2;
+        record.probability = result.probability;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Insert(record);
+        updated = true;
+    }
+
+    // Fit is a callable which returns kin_fit::FitResults, it is called only on a miss.
+    template<typename Fit>
+    kin_fit::FitResults Get(const EventIdentifier& eventId, const BjetPair& bjet_pair, EventEnergyScale energyScale,
+                            uint64_t inputs_digest, Fit&& fit)
+    {
+        kin_fit::FitResults result;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(FindRecord(Key(eventId, bjet_pair, energyScale), inputs_digest, result)) {
+                ++n_hits;
+                return result;
+            }
+            ++n_misses;
+        }
+        result = fit();
+        Add(eventId, bjet_pair, energyScale, inputs_digest, result);
+        return result;
+    }
+
+    void Save()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(loaded && !updated) return;
+        const FileLock file_lock(cache.GetFileName() + ".lock");
+        Cache::RecordVector stored_records;
+        if(cache.Load(stored_records)) {
+            for(const KinFitRecord& record : stored_records) {
+                kin_fit::FitResults result;
+                if(!FindRecord(Key(record), record.inputs_digest, result))
+                    Insert(record);
+            }
+        }
+        cache.Save(records);
+        loaded = true;
+        updated = false;
+    }
+
+    const std::string& GetFileName() const { return cache.GetFileName(); }
+
+    size_t GetNumberOfResults() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return records.size();
+    }
+
+    size_t GetNumberOfHits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_hits;
+    }
+
+    size_t GetNumberOfMisses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_misses;
+    }
+
+private:
+    struct Key {
+        uint64_t evt;
+        uint32_t run, lumi, first_bjet, second_bjet;
+        int32_t energy_scale;
+
+        explicit Key(const KinFitRecord& r)
+            : evt(r.evt), run(r.run), lumi(r.lumi), first_bjet(r.first_bjet), second_bjet(r.second_bjet),
+              energy_scale(r.energy_scale) {}
+
+        Key(const EventIdentifier& eventId, const BjetPair& bjet_pair, EventEnergyScale energyScale)
+            : evt(eventId.eventId), run(eventId.runId), lumi(eventId.lumiBlock),
+              first_bjet(static_cast<uint32_t>(bjet_pair.first)), second_bjet(static_cast<uint32_t>(bjet_pair.second)),
+              energy_scale(static_cast<int32_t>(energyScale)) {}
+
+        bool operator==(const Key& other) const
+        {
+            return evt == other.evt && run == other.run && lumi == other.lumi && first_bjet == other.first_bjet
+                    && second_bjet == other.second_bjet && energy_scale == other.energy_scale;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const
+        {
+            size_t h = std::hash<uint64_t>()(key.evt);
+            const uint64_t other = (static_cast<uint64_t>(key.run) << 32) ^ key.lumi
+                    ^ (static_cast<uint64_t>(key.first_bjet) << 48) ^ (static_cast<uint64_t>(key.second_bjet) << 40)
+                    ^ (static_cast<uint64_t>(static_cast<uint32_t>(key.energy_scale)) << 56);
+            return h ^ (std::hash<uint64_t>()(other) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+        }
+    };
+
+    using Index = std::unordered_multimap<Key, size_t, KeyHash>;
+
+    // Exclusive flock of the lock file, which is held until destruction.
+    class FileLock {
+    public:
+        explicit FileLock(const std::string& file_name)
+        {
+            fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+            if(fd < 0)
+                throw exception("Unable to open lock file '%1%'.") % file_name;
+            while(flock(fd, LOCK_EX)) {
+                if(errno == EINTR) continue;
+                close(fd);
+                throw exception("Unable to lock '%1%'.") % file_name;
+            }
+        }
+
+        FileLock(const FileLock&) = delete;
+        FileLock& operator=(const FileLock&) = delete;
+
+        ~FileLock()
+        {
+            flock(fd, LOCK_UN);
+            close(fd);
+        }
+
+    private:
+        int fd;
+    };
+
+    static std::string MakeKey(const std::string& fit_config)
+    {
+        std::ostringstream ss;
+        ss << "kinfit_v" << Version() << ";" << fit_config;
+        return ss.str();
+    }
+
+    // FNV-1a over the components rounded to float, so the digest doesn't depend on the numerical noise of the
+    // double precision.
+    template<typename LVector>
+    static void AddToDigest(uint64_t& digest, const LVector& p4)
+    {
+        const float components[] = { static_cast<float>(p4.Px()), static_cast<float>(p4.Py()),
+                                     static_cast<float>(p4.Pz()), static_cast<float>(p4.E()) };
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(components);
+        for(size_t n = 0; n < sizeof(components); ++n) {
+            digest ^= bytes[n];
+            digest *= 0x100000001b3ULL;
+        }
+    }
+
+    bool FindRecord(const Key& key, uint64_t inputs_digest, kin_fit::FitResults& result) const
+    {
+        const auto range = index.equal_range(key);
+        for(auto iter = range.first; iter != range.second; ++iter) {
+            const KinFitRecord& record = records.at(iter->second);
+            if(record.inputs_digest != inputs_digest) continue;
+            result.mass = record.mass;
+            result.chi2 = record.chi2;
+            result.probability = record.probability;
+            result.convergence = record.convergence;
+            return true;
+        }
+        return false;
+    }
+
+    void Insert(const KinFitRecord& record)
+    {
+        const Key key(record);
+        const auto range = index.equal_range(key);
+        for(auto iter = range.first; iter != range.second; ++iter) {
+            if(records.at(iter->second).inputs_digest == record.inputs_digest) {
+                records.at(iter->second) = record;
+                return;
+            }
+        }
+        index.emplace(key, records.size());
+        records.push_back(record);
+    }
+
+private:
+    Cache cache;
+    Cache::RecordVector records;
+    Index index;
+    size_t n_hits, n_misses;
+    bool loaded, updated;
+    mutable std::mutex mutex;
+};
+
+} // namespace analysis
@@ -13,6 +13,7 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include <TColor.h>
 #include <TLorentzVector.h>
+#include <TROOT.h>
 
 #include "AnalysisTools/Core/include/AnalyzerData.h"
 #include "h-tautau/Analysis/include/FlatEventInfo.h"
@@ -22,6 +23,8 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "AnalysisTools/Print/include/RootPrintToPdf.h"
 
 #include "FlatAnalyzerDataCollection.h"
+#include "KinFitResultStore.h"
+#include "ThreadPool.h"
 
 namespace analysis {
 
@@ -31,13 +34,22 @@ public:
     typedef FlatAnalyzerDataMetaId_noName MetaId;
     typedef std::set<MetaId> MetaIdSet;
     typedef std::map<SyncEventInfo::BjetPair, SyncEventInfoPtr> FlatEventInfoMap;
-
-    LightBaseFlatTreeAnalyzer(const std::string& inputFileName, const std::string& outputFileName)
-        : inputFile(root_ext::OpenRootFile(inputFileName)),
+    typedef std::map<SyncEventInfo::BjetPair, kin_fit::FitResults> KinFitResultsMap;
+
+    // With n_threads > 1, event infos requested through PrepareFlatEventInfos are built on a thread pool.
+    // If kinfitStoreFileName is set, the HHKinFit2 results are taken from that store, which is shared with the
+    // analyzer and KinFitStudy (see KinFitResultStore), and the fit is run only for new pairs.
+    LightBaseFlatTreeAnalyzer(const std::string& inputFileName, const std::string& outputFileName,
+                              size_t _n_threads = 1, const std::string& kinfitStoreFileName = "")
+        : n_threads(EnableThreadSafety(_n_threads)), inputFile(root_ext::OpenRootFile(inputFileName)),
           outputFile(root_ext::CreateRootFile(outputFileName)),
           flatTree(new ntuple::SyncTree("sync", inputFile.get(), true)), recalc_kinfit(false), do_retag(true)
     {
         TH1::SetDefaultSumw2();
+        if(n_threads > 1)
+            threadPool.reset(new ThreadPool(n_threads));
+        if(kinfitStoreFileName.size())
+            kinfitStore.reset(new KinFitResultStore(kinfitStoreFileName, KinFitConfig::Default().ToString()));
     }
 
     virtual ~LightBaseFlatTreeAnalyzer() {}
@@ -46,6 +58,7 @@ public:
     {
         for(Long64_t current_entry = 0; current_entry < flatTree->GetEntries(); ++current_entry) {
             eventInfoMap.clear();
+            kinfitResultsMap.clear();
             flatTree->GetEntry(current_entry);
             const ntuple::Sync& event = flatTree->data();
             const auto& pairSelectionMap = SelectBjetPairs(event);
@@ -59,6 +72,11 @@ public:
                 }
             }
         }
+        if(kinfitStore) {
+            kinfitStore->Save();
+            std::cout << "Kinfit store '" << kinfitStore->GetFileName() << "': " << kinfitStore->GetNumberOfHits()
+                      << " hits, " << kinfitStore->GetNumberOfMisses() << " fits." << std::endl;
+        }
         EndOfRun();
     }
 
@@ -221,10 +239,81 @@ protected:
         return *eventInfoMap.at(bjet_pair);
     }
 
+    // HHKinFit2 results of the pair, taken from the kinfit store if it is used.
+    const kin_fit::FitResults& GetKinFitResults(const ntuple::Sync& event, const SyncEventInfo::BjetPair& bjet_pair)
+    {
+        if(!kinfitResultsMap.count(bjet_pair))
+            kinfitResultsMap[bjet_pair] = FitPair(event, GetFlatEventInfo(event, bjet_pair));
+        return kinfitResultsMap.at(bjet_pair);
+    }
+
+    // Builds the event infos and the HHKinFit2 results of all given pairs which are not built yet. The pairs are
+    // independent of each other, so they are built concurrently if the thread pool is available.
+    void PrepareFlatEventInfos(const ntuple::Sync& event, const std::vector<SyncEventInfo::BjetPair>& bjet_pairs)
+    {
+        std::vector<SyncEventInfo::BjetPair> missing_pairs;
+        for(const auto& bjet_pair : bjet_pairs) {
+            if(!eventInfoMap.count(bjet_pair) || !kinfitResultsMap.count(bjet_pair))
+                missing_pairs.push_back(bjet_pair);
+        }
+        std::vector<SyncEventInfoPtr> infos(missing_pairs.size());
+        std::vector<kin_fit::FitResults> fits(missing_pairs.size());
+        const auto build = [&](size_t n) {
+            const auto iter = eventInfoMap.find(missing_pairs.at(n));
+            infos.at(n) = iter != eventInfoMap.end() ? iter->second
+                                                     : SyncEventInfoPtr(new SyncEventInfo(event, missing_pairs.at(n)));
+            fits.at(n) = FitPair(event, *infos.at(n));
+        };
+        if(threadPool)
+            threadPool->ForEach(missing_pairs.size(), build);
+        else {
+            for(size_t n = 0; n < missing_pairs.size(); ++n)
+                build(n);
+        }
+        for(size_t n = 0; n < missing_pairs.size(); ++n) {
+            eventInfoMap[missing_pairs.at(n)] = infos.at(n);
+            kinfitResultsMap[missing_pairs.at(n)] = fits.at(n);
+        }
+    }
+
+private:
+    // ROOT thread safety should be enabled before any ROOT object is created, so it is done while the first member
+    // is initialized.
+    static size_t EnableThreadSafety(size_t n_threads)
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        if(n_threads > 1)
+            ROOT::EnableThreadSafety();
+#endif
+        return n_threads;
+    }
+
+    // The same fit as the one of EventInfo: taus, selected b jets and MET with its covariance. Thread safe.
+    kin_fit::FitResults FitPair(const ntuple::Sync& event, const SyncEventInfo& eventInfo) const
+    {
+        const TLorentzVector& tau1 = eventInfo.lepton_momentums.at(0);
+        const TLorentzVector& tau2 = eventInfo.lepton_momentums.at(1);
+        const TLorentzVector& b1 = eventInfo.bjet_momentums.at(eventInfo.selected_bjets.first);
+        const TLorentzVector& b2 = eventInfo.bjet_momentums.at(eventInfo.selected_bjets.second);
+        const auto fit = [&]() {
+            kin_fit::FitProducer kinfitProducer;
+            return kinfitProducer.Fit(tau1, tau2, b1, b2, eventInfo.MET, eventInfo.MET_covariance);
+        };
+        if(!kinfitStore)
+            return fit();
+        const EventIdentifier eventId(event.run, event.lumi, event.evt);
+        const uint64_t inputs_digest = KinFitResultStore::InputsDigest(tau1, tau2, b1, b2, eventInfo.MET);
+        return kinfitStore->Get(eventId, eventInfo.selected_bjets, EventEnergyScale::Central, inputs_digest, fit);
+    }
+
 private:
+    size_t n_threads;
     std::shared_ptr<TFile> inputFile, outputFile;
     std::shared_ptr<ntuple::SyncTree> flatTree;
     FlatEventInfoMap eventInfoMap;
+    KinFitResultsMap kinfitResultsMap;
+    std::shared_ptr<ThreadPool> threadPool;
+    std::shared_ptr<KinFitResultStore> kinfitStore;
 
 protected:
     bool recalc_kinfit;
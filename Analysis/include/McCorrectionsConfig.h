@@ -0,0 +1,86 @@
+/*! Definition of McCorrectionsConfig, the description of the MC corrections used in the keys of the on-disk caches.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <cstdlib>
+#include <sstream>
+#include <map>
+
+#include <TSystem.h>
+
+#include "h-tautau/Analysis/include/AnalysisTypes.h"
+#include "h-tautau/Analysis/include/Htautau_2015.h"
+#include "Digest.h"
+
+namespace analysis {
+
+// Everything the weight computed by ComputeCorrectionWeight depends on. The scale factor files are described by
+// the digest of their content, so a cache produced with another version of a file is not used. The source of the
+// b-tag weight is always given explicitly: btag=EventWeights, or the digests of the BTagWeightService files and
+// the scale factor tolerance. The pile-up and
+// lepton scale factor files are read by EventWeights from the h-tautau corrections data directory of the CMSSW
+// release (see CorrectionsDataDir), which can't be changed, so all files of that directory are digested.
+// The version should be increased each time the corrections code is changed.
+struct McCorrectionsConfig {
+    static constexpr unsigned Version() { return 4; }
+
+    Period period;
+    DiscriminatorWP tauIdWP;
+    bool applyBTagWeight;
+    std::string btag_eff_file, btag_sf_file;
+    double btag_sf_tolerance;
+
+    // Directory of the scale factor files read by mc_corrections::EventWeights.
+    static std::string CorrectionsDataDir()
+    {
+        const char* cmssw_base = std::getenv("CMSSW_BASE");
+        return cmssw_base ? std::string(cmssw_base) + "/src/h-tautau/McCorrections/data" : "";
+    }
+
+    std::string ToString() const
+    {
+        std::ostringstream ss;
+        ss << "weights_v" << Version() << ";period=" << static_cast<int>(period)
+           << ";tauIdWP=" << static_cast<int>(tauIdWP) << ";applybTagWeight=" << applyBTagWeight
+           << ";CSVM=" << cuts::Htautau_2015::btag::CSVM;
+        ss << ";btag=";
+        if(btag_eff_file.size())
+            ss << "eff:" << FileDigest(btag_eff_file) << ",sf:" << FileDigest(btag_sf_file) << ",tolerance:"
+               << btag_sf_tolerance;
+        else
+            ss << "EventWeights";
+        ss << ";corrections=" << CorrectionsDigest(CorrectionsDataDir());
+        return ss.str();
+    }
+
+    // Fields of a string produced by ToString: name=value pairs, or a name with an empty value for a token without
+    // '=', such as the version.
+    static std::map<std::string, std::string> ParseFields(const std::string& config)
+    {
+        std::map<std::string, std::string> fields;
+        std::istringstream ss(config);
+        std::string field;
+        while(std::getline(ss, field, ';')) {
+            if(field.empty()) continue;
+            const size_t pos = field.find('=');
+            if(pos == std::string::npos)
+                fields[field] = "";
+            else
+                fields[field.substr(0, pos)] = field.substr(pos + 1);
+        }
+        return fields;
+    }
+
+private:
+    static std::string CorrectionsDigest(const std::string& dir_name)
+    {
+        FileStat_t stat;
+        if(dir_name.empty() || gSystem->GetPathInfo(dir_name.c_str(), stat) || !R_ISDIR(stat.fMode))
+            throw exception("MC corrections data directory '%1%' not found. CMSSW_BASE should point to the release"
+                            " with h-tautau.") % dir_name;
+        return DirectoryDigest(dir_name);
+    }
+};
+
+} // namespace analysis
@@ -0,0 +1,23 @@
+/*! Dropping the page cache of a file, used by the benchmarks to measure cold reads.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace analysis {
+
+// Dirty pages are not dropped by POSIX_FADV_DONTNEED, so the file data is flushed first: a file which was just
+// written would otherwise stay in the page cache. Returns false if the file can't be opened or the advice fails.
+inline bool DropPageCache(const std::string& file_name)
+{
+    const int fd = open(file_name.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    const bool dropped = fdatasync(fd) == 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return dropped;
+}
+
+} // namespace analysis
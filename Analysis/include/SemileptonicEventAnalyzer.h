@@ -7,10 +7,10 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 namespace analysis {
 
-template<typename FirstLeg>
-class SemileptonicFlatTreeAnalyzer : public BaseEventAnalyzer<FirstLeg> {
+template<typename FirstLeg, typename Selection = DefaultAnalyzerSelection>
+class SemileptonicFlatTreeAnalyzer : public BaseEventAnalyzer<FirstLeg, Selection> {
 public:
-    using Base = BaseEventAnalyzer<FirstLeg>;
+    using Base = BaseEventAnalyzer<FirstLeg, Selection>;
     using PhysicalValueMap = typename Base::PhysicalValueMap;
 
     using Base::BaseEventAnalyzer;
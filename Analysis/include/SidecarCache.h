@@ -0,0 +1,131 @@
+/*! Definition of SidecarCache class, a binary per-source cache of fixed-size event records.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include <TFile.h>
+#include <TTree.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+#include "Digest.h"
+#include "TemporaryFile.h"
+
+namespace analysis {
+
+// File layout: magic, format version, key length, key, record size, number of records, records.
+// The key is a text description of everything the records depend on (source file identity, entry range,
+// producer version and configuration). A cache with a different key, record size or number of records is ignored.
+template<typename _Record>
+class SidecarCache {
+public:
+    using Record = _Record;
+    using RecordVector = std::vector<Record>;
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+
+    static_assert(std::is_trivially_copyable<Record>::value, "Sidecar cache record should be trivially copyable.");
+
+    static constexpr uint32_t Magic() { return 0x43534848; }
+    static constexpr uint32_t FormatVersion() { return 1; }
+    static constexpr size_t AnyNumberOfRecords() { return std::numeric_limits<size_t>::max(); }
+
+    // Identity of the source: UUID of the file, file size and number of entries of the tree. It is not a content
+    // hash: a rewritten file gets a new UUID even if the content is the same, and it is assumed that a file is never
+    // modified in place.
+    static std::string SourceIdentity(TFile& file, TTree& tree)
+    {
+        std::ostringstream ss;
+        ss << file.GetUUID().AsString() << ":" << file.GetSize() << ":" << tree.GetEntries();
+        return ss.str();
+    }
+
+    // The name contains a digest of the source id, so sources with the same base name in different directories
+    // don't share a cache file.
+    static std::string MakeFileName(const std::string& cache_dir, const std::string& source_file_name,
+                                    const std::string& source_id, const std::string& tree_name,
+                                    const EntryRange& entryRange, const std::string& extension)
+    {
+        const size_t pos = source_file_name.find_last_of('/');
+        const std::string base_name = pos == std::string::npos ? source_file_name : source_file_name.substr(pos + 1);
+        std::ostringstream ss;
+        ss << cache_dir << "/" << base_name << "_" << TextDigest(source_id).substr(0, 16) << "_" << tree_name << "_"
+           << entryRange.first << "_" << entryRange.second << "." << extension;
+        return ss.str();
+    }
+
+    SidecarCache(const std::string& _file_name, const std::string& _key) : file_name(_file_name), key(_key) {}
+
+    const std::string& GetFileName() const { return file_name; }
+
+    bool Load(RecordVector& records, size_t expected_n_records = AnyNumberOfRecords()) const
+    {
+        std::ifstream f(file_name, std::ios::binary);
+        if(!f.is_open()) return false;
+
+        uint32_t magic, version, key_size;
+        uint64_t record_size, n_records;
+        if(!Read(f, magic) || magic != Magic() || !Read(f, version) || version != FormatVersion()
+                || !Read(f, key_size) || key_size != key.size())
+            return false;
+        std::string file_key(key_size, '\0');
+        if(!f.read(&file_key[0], key_size) || file_key != key)
+            return false;
+        if(!Read(f, record_size) || record_size != sizeof(Record) || !Read(f, n_records)
+                || (expected_n_records != AnyNumberOfRecords() && n_records != expected_n_records))
+            return false;
+        records.resize(n_records);
+        if(n_records && !f.read(reinterpret_cast<char*>(records.data()), n_records * sizeof(Record))) {
+            records.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Written to a temporary file first, so an interrupted job never leaves a truncated cache behind. The temporary
+    // file is unique for the job and thread (see TemporaryFileName), so concurrent writers of the same cache don't
+    // interfere.
+    void Save(const RecordVector& records) const
+    {
+        const std::string tmp_name = TemporaryFileName(file_name);
+        {
+            std::ofstream f(tmp_name, std::ios::binary | std::ios::trunc);
+            if(!f.is_open())
+                throw exception("Unable to create sidecar cache file '%1%'.") % tmp_name;
+            f.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            Write(f, Magic());
+            Write(f, FormatVersion());
+            Write(f, static_cast<uint32_t>(key.size()));
+            f.write(key.data(), key.size());
+            Write(f, static_cast<uint64_t>(sizeof(Record)));
+            Write(f, static_cast<uint64_t>(records.size()));
+            f.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+        }
+        if(std::rename(tmp_name.c_str(), file_name.c_str()))
+            throw exception("Unable to move sidecar cache file '%1%' to '%2%'.") % tmp_name % file_name;
+    }
+
+private:
+    template<typename T>
+    static bool Read(std::istream& s, T& value)
+    {
+        return static_cast<bool>(s.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    template<typename T>
+    static void Write(std::ostream& s, const T& value)
+    {
+        s.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+private:
+    std::string file_name, key;
+};
+
+} // namespace analysis
@@ -0,0 +1,115 @@
+/*! Definition of SourceScheduler class, a work-stealing scheduler for the analyzer source units.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
+#include <functional>
+#include <exception>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// Units are distributed between workers by the decreasing estimated cost, each unit going to the worker with the
+// smallest total assigned cost. A worker processes its own queue starting from the most expensive unit. When the
+// queue is empty, the worker steals the most expensive pending unit from the worker with the largest remaining cost.
+// Units are expected to be coarse (a file or a large entry range), so a single lock protects all queues.
+class SourceScheduler {
+public:
+    using Processor = std::function<void(size_t unit_id, size_t worker_id)>;
+
+    SourceScheduler(const std::vector<double>& _unit_costs, size_t n_workers)
+        : unit_costs(_unit_costs), queues(n_workers), remaining_costs(n_workers, 0), failed(false)
+    {
+        if(!n_workers)
+            throw exception("Number of workers should be positive.");
+
+        for(size_t unit_id : DispatchOrder(unit_costs)) {
+            const auto min_iter = std::min_element(remaining_costs.begin(), remaining_costs.end());
+            const size_t worker_id = static_cast<size_t>(std::distance(remaining_costs.begin(), min_iter));
+            queues.at(worker_id).push_back(unit_id);
+            remaining_costs.at(worker_id) += unit_costs.at(unit_id);
+        }
+    }
+
+    // Units in the order of the decreasing cost, units with the same cost in the order of their ids. It doesn't
+    // depend on the number of workers; a single worker processes the units in this order.
+    static std::vector<size_t> DispatchOrder(const std::vector<double>& unit_costs)
+    {
+        std::vector<size_t> order(unit_costs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t first, size_t second) {
+            return unit_costs.at(first) > unit_costs.at(second);
+        });
+        return order;
+    }
+
+    size_t GetNumberOfWorkers() const { return queues.size(); }
+
+    void Run(const Processor& processor)
+    {
+        std::vector<std::exception_ptr> errors(queues.size());
+        std::vector<std::thread> workers;
+        for(size_t worker_id = 1; worker_id < queues.size(); ++worker_id)
+            workers.emplace_back(&SourceScheduler::WorkerLoop, this, std::cref(processor), worker_id,
+                                 std::ref(errors.at(worker_id)));
+        WorkerLoop(processor, 0, errors.at(0));
+
+        for(auto& worker : workers)
+            worker.join();
+        for(const auto& error : errors) {
+            if(error)
+                std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void WorkerLoop(const Processor& processor, size_t worker_id, std::exception_ptr& error)
+    {
+        try {
+            size_t unit_id;
+            while(!failed && NextUnit(worker_id, unit_id))
+                processor(unit_id, worker_id);
+        } catch(...) {
+            error = std::current_exception();
+            failed = true;
+        }
+    }
+
+    bool NextUnit(size_t worker_id, size_t& unit_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t source_id = worker_id;
+        if(queues.at(worker_id).empty()) {
+            bool found = false;
+            for(size_t n = 0; n < queues.size(); ++n) {
+                if(queues.at(n).empty()) continue;
+                if(!found || remaining_costs.at(n) > remaining_costs.at(source_id))
+                    source_id = n;
+                found = true;
+            }
+            if(!found)
+                return false;
+        }
+        unit_id = queues.at(source_id).front();
+        queues.at(source_id).pop_front();
+        remaining_costs.at(source_id) -= unit_costs.at(unit_id);
+        return true;
+    }
+
+private:
+    std::vector<double> unit_costs;
+    std::vector<std::deque<size_t>> queues;
+    std::vector<double> remaining_costs;
+    std::mutex mutex;
+    std::atomic<bool> failed;
+};
+
+} // namespace analysis
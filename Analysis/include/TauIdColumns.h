@@ -0,0 +1,191 @@
+/*! Definition of the compact tau ID storage: fixed-position float columns with a name header stored once per file.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <sstream>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TNamed.h>
+
+#include "AnalysisTools/Core/include/Tools.h"
+#include "AnalysisTools/Core/include/exception.h"
+#include "h-tautau/Analysis/include/EventTuple.h"
+
+namespace analysis {
+
+// Tau ID discriminators retained by the tuple skimmer.
+enum class TauIdDiscriminator { againstMuonLoose3 = 0, againstMuonTight3 = 1, againstElectronVLooseMVA6 = 2,
+                                againstElectronTightMVA6 = 3, byTightIsolationMVArun2v1DBoldDMwLT = 4,
+                                byVTightIsolationMVArun2v1DBoldDMwLT = 5 };
+ENUM_NAMES(TauIdDiscriminator) = {
+    { TauIdDiscriminator::againstMuonLoose3, "againstMuonLoose3" },
+    { TauIdDiscriminator::againstMuonTight3, "againstMuonTight3" },
+    { TauIdDiscriminator::againstElectronVLooseMVA6, "againstElectronVLooseMVA6" },
+    { TauIdDiscriminator::againstElectronTightMVA6, "againstElectronTightMVA6" },
+    { TauIdDiscriminator::byTightIsolationMVArun2v1DBoldDMwLT, "byTightIsolationMVArun2v1DBoldDMwLT" },
+    { TauIdDiscriminator::byVTightIsolationMVArun2v1DBoldDMwLT, "byVTightIsolationMVArun2v1DBoldDMwLT" }
+};
+
+// Each leg has a float array branch tauIDColumns_<leg>. The discriminator names of the columns are stored once per
+// file in a TNamed <tree>_tauIDColumns with a comma-separated list as title. A discriminator which is missing in the
+// event is an error, so the skimmer fails instead of writing a column which can't be told apart from a real value.
+struct TauIdColumns {
+    static constexpr size_t MaxColumns = 16;
+    static constexpr unsigned NumberOfLegs = 2;
+    using Values = std::array<float, MaxColumns>;
+
+    static const std::vector<TauIdDiscriminator>& Discriminators()
+    {
+        static const std::vector<TauIdDiscriminator> discriminators = {
+            TauIdDiscriminator::againstMuonLoose3, TauIdDiscriminator::againstMuonTight3,
+            TauIdDiscriminator::againstElectronVLooseMVA6, TauIdDiscriminator::againstElectronTightMVA6,
+            TauIdDiscriminator::byTightIsolationMVArun2v1DBoldDMwLT,
+            TauIdDiscriminator::byVTightIsolationMVArun2v1DBoldDMwLT
+        };
+        return discriminators;
+    }
+
+    static std::string BranchName(unsigned leg)
+    {
+        std::ostringstream ss;
+        ss << "tauIDColumns_" << leg;
+        return ss.str();
+    }
+
+    static std::string HeaderName(const std::string& tree_name) { return tree_name + "_tauIDColumns"; }
+
+    static const std::string& Name(TauIdDiscriminator discriminator)
+    {
+        return __TauIdDiscriminator_names<>::names.EnumToString(discriminator);
+    }
+
+    template<typename TauIdMap>
+    static float FindInMap(const TauIdMap& tauIDs, TauIdDiscriminator discriminator)
+    {
+        const auto iter = tauIDs.find(Name(discriminator));
+        if(iter == tauIDs.end())
+            throw exception("Tau ID discriminator '%1%' not found.") % Name(discriminator);
+        return iter->second;
+    }
+};
+
+// Creates the column branches in the output tree. Fill moves the retained discriminators of the event from the maps
+// into the columns, so the maps are written empty.
+class TauIdColumnWriter {
+public:
+    TauIdColumnWriter(TTree& tree, const std::string& _tree_name) : tree_name(_tree_name)
+    {
+        const size_t n_columns = TauIdColumns::Discriminators().size();
+        for(unsigned leg = 1; leg <= TauIdColumns::NumberOfLegs; ++leg) {
+            std::ostringstream leaf_list;
+            leaf_list << TauIdColumns::BranchName(leg) << "[" << n_columns << "]/F";
+            tree.Branch(TauIdColumns::BranchName(leg).c_str(), values.at(leg - 1).data(), leaf_list.str().c_str());
+        }
+    }
+
+    void Fill(ntuple::Event& event)
+    {
+        FillLeg(event.tauIDs_1, values.at(0));
+        FillLeg(event.tauIDs_2, values.at(1));
+    }
+
+    void WriteHeader(TFile& file) const
+    {
+        std::ostringstream ss;
+        const auto& discriminators = TauIdColumns::Discriminators();
+        for(size_t n = 0; n < discriminators.size(); ++n)
+            ss << (n ? "," : "") << TauIdColumns::Name(discriminators.at(n));
+        TNamed header(TauIdColumns::HeaderName(tree_name).c_str(), ss.str().c_str());
+        file.WriteTObject(&header, header.GetName(), "Overwrite");
+    }
+
+private:
+    template<typename TauIdMap>
+    static void FillLeg(TauIdMap& tauIDs, TauIdColumns::Values& leg_values)
+    {
+        const auto& discriminators = TauIdColumns::Discriminators();
+        for(size_t n = 0; n < discriminators.size(); ++n)
+            leg_values[n] = TauIdColumns::FindInMap(tauIDs, discriminators[n]);
+        tauIDs.clear();
+    }
+
+private:
+    std::string tree_name;
+    std::array<TauIdColumns::Values, TauIdColumns::NumberOfLegs> values;
+};
+
+// Resolves the column of each discriminator once per file from the header and reads the columns of the current
+// entry. If the file has no columns, IsAvailable is false and the maps of the event should be used.
+class TauIdColumnReader {
+public:
+    TauIdColumnReader(TFile& file, TTree& tree, const std::string& tree_name) : available(false)
+    {
+        columns.fill(-1);
+        auto header = dynamic_cast<TNamed*>(file.Get(TauIdColumns::HeaderName(tree_name).c_str()));
+        if(!header) return;
+        for(unsigned leg = 1; leg <= TauIdColumns::NumberOfLegs; ++leg) {
+            if(!tree.GetBranch(TauIdColumns::BranchName(leg).c_str())) return;
+        }
+
+        std::istringstream ss(header->GetTitle());
+        std::string name;
+        for(int column = 0; std::getline(ss, name, ','); ++column) {
+            if(static_cast<size_t>(column) >= TauIdColumns::MaxColumns)
+                throw exception("Too many tau ID columns in '%1%'.") % file.GetName();
+            for(TauIdDiscriminator discriminator : TauIdColumns::Discriminators()) {
+                if(TauIdColumns::Name(discriminator) == name)
+                    columns.at(static_cast<size_t>(discriminator)) = column;
+            }
+        }
+        for(unsigned leg = 1; leg <= TauIdColumns::NumberOfLegs; ++leg) {
+            const std::string branch_name = TauIdColumns::BranchName(leg);
+            tree.SetBranchStatus(branch_name.c_str(), 1);
+            tree.SetBranchAddress(branch_name.c_str(), values.at(leg - 1).data());
+        }
+        available = true;
+    }
+
+    TauIdColumnReader(const TauIdColumnReader&) = delete;
+    TauIdColumnReader& operator=(const TauIdColumnReader&) = delete;
+
+    bool IsAvailable() const { return available; }
+    int GetColumn(TauIdDiscriminator discriminator) const { return columns.at(static_cast<size_t>(discriminator)); }
+    const TauIdColumns::Values& GetValues(unsigned leg) const { return values.at(leg - 1); }
+
+private:
+    bool available;
+    std::array<int, TauIdColumns::MaxColumns> columns;
+    std::array<TauIdColumns::Values, TauIdColumns::NumberOfLegs> values;
+};
+
+// Tau IDs of one event: taken from the columns if the file has them, otherwise from the maps of the event.
+// Get throws if the discriminator is neither in the columns nor in the maps.
+class TauIds {
+public:
+    TauIds(const ntuple::Event& _event, const TauIdColumnReader* _reader, const TauIdColumns::Values* _values_1,
+           const TauIdColumns::Values* _values_2)
+        : event(&_event), reader(_reader), values{ { _values_1, _values_2 } } {}
+
+    float Get(unsigned leg, TauIdDiscriminator discriminator) const
+    {
+        if(leg < 1 || leg > TauIdColumns::NumberOfLegs)
+            throw exception("Invalid leg id = %1%.") % leg;
+        if(reader && reader->IsAvailable()) {
+            const int column = reader->GetColumn(discriminator);
+            if(column >= 0)
+                return values.at(leg - 1)->at(static_cast<size_t>(column));
+        }
+        return TauIdColumns::FindInMap(leg == 1 ? event->tauIDs_1 : event->tauIDs_2, discriminator);
+    }
+
+private:
+    const ntuple::Event* event;
+    const TauIdColumnReader* reader;
+    std::array<const TauIdColumns::Values*, TauIdColumns::NumberOfLegs> values;
+};
+
+} // namespace analysis
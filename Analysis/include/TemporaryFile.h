@@ -0,0 +1,25 @@
+/*! Names of the temporary files, which are moved to their final name when they are complete.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+namespace analysis {
+
+// The name is unique for the host, process and thread, so several jobs and threads which write the same file at
+// once don't share a temporary file: each of them completes its own file and the last rename wins.
+inline std::string TemporaryFileName(const std::string& file_name)
+{
+    char host[256] = {};
+    if(gethostname(host, sizeof(host) - 1))
+        host[0] = '\0';
+    std::ostringstream ss;
+    ss << file_name << ".tmp." << host << "." << getpid() << "." << std::this_thread::get_id();
+    return ss.str();
+}
+
+} // namespace analysis
@@ -0,0 +1,127 @@
+/*! Definition of ThreadPool class, a persistent pool of threads for fine-grained parallel loops.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// Threads are started once and wait for the next loop, so the pool can be used for every event. ForEach blocks
+// until all tasks are done; the calling thread takes part in the loop. Tasks are taken one by one from a shared
+// counter, so expensive and cheap tasks are balanced between the threads. The first exception thrown by a task
+// is rethrown by ForEach after all threads have stopped working on the loop.
+class ThreadPool {
+public:
+    using Task = std::function<void(size_t task_id)>;
+
+    explicit ThreadPool(size_t n_threads)
+        : task(nullptr), n_tasks(0), next_task(0), generation(0), n_active(0), stop(false)
+    {
+        if(!n_threads)
+            throw exception("Number of threads should be positive.");
+        for(size_t n = 1; n < n_threads; ++n)
+            workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        start_condition.notify_all();
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    size_t GetNumberOfThreads() const { return workers.size() + 1; }
+
+    void ForEach(size_t _n_tasks, const Task& _task)
+    {
+        if(!_n_tasks) return;
+        if(workers.empty() || _n_tasks == 1) {
+            for(size_t task_id = 0; task_id < _n_tasks; ++task_id)
+                _task(task_id);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &_task;
+            n_tasks = _n_tasks;
+            next_task = 0;
+            error = nullptr;
+            n_active = workers.size();
+            ++generation;
+        }
+        start_condition.notify_all();
+        RunTasks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [&]() { return n_active == 0; });
+        task = nullptr;
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    void WorkerLoop()
+    {
+        size_t last_generation = 0;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_condition.wait(lock, [&]() { return stop || generation != last_generation; });
+                if(stop) return;
+                last_generation = generation;
+            }
+            RunTasks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --n_active;
+            }
+            done_condition.notify_one();
+        }
+    }
+
+    void RunTasks()
+    {
+        while(true) {
+            const size_t task_id = next_task++;
+            if(task_id >= n_tasks) return;
+            try {
+                (*task)(task_id);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!error)
+                    error = std::current_exception();
+                next_task = n_tasks;
+            }
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_condition, done_condition;
+    const Task* task;
+    size_t n_tasks;
+    std::atomic<size_t> next_task;
+    size_t generation, n_active;
+    bool stop;
+    std::exception_ptr error;
+};
+
+} // namespace analysis
@@ -0,0 +1,105 @@
+/*! Definition of TupleLayout class, the compression and basket settings of the produced tuples.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <sstream>
+
+#include <TFile.h>
+#include <TTree.h>
+
+#include "AnalysisTools/Core/include/exception.h"
+#include "AnalysisTools/Core/include/Tools.h"
+
+namespace analysis {
+
+enum class CompressionAlgorithm { Default = 0, ZLIB = 1, LZMA = 2, LZ4 = 4, ZSTD = 5 };
+ENUM_NAMES(CompressionAlgorithm) = {
+    { CompressionAlgorithm::Default, "default" },
+    { CompressionAlgorithm::ZLIB, "ZLIB" },
+    { CompressionAlgorithm::LZMA, "LZMA" },
+    { CompressionAlgorithm::LZ4, "LZ4" },
+    { CompressionAlgorithm::ZSTD, "ZSTD" }
+};
+
+// Compression algorithm and level are set for the output file, basket size and auto flush for each output tree.
+// Zero (or a negative level) means the ROOT default. A negative auto flush is the cluster size in bytes, a positive
+// one is the cluster size in entries (see TTree::SetAutoFlush). The compression is given as "ALGORITHM:level",
+// e.g. "ZSTD:5"; the level can be omitted.
+struct TupleLayout {
+    CompressionAlgorithm algorithm;
+    int level;
+    Int_t basket_size;
+    Long64_t auto_flush;
+
+    TupleLayout() : algorithm(CompressionAlgorithm::Default), level(-1), basket_size(0), auto_flush(0) {}
+
+    TupleLayout(const std::string& compression, Int_t _basket_size, Long64_t _auto_flush)
+        : algorithm(CompressionAlgorithm::Default), level(-1), basket_size(_basket_size), auto_flush(_auto_flush)
+    {
+        const size_t pos = compression.find(':');
+        const std::string algorithm_name = compression.substr(0, pos);
+        bool found = false;
+        for(CompressionAlgorithm alg : { CompressionAlgorithm::Default, CompressionAlgorithm::ZLIB,
+                                         CompressionAlgorithm::LZMA, CompressionAlgorithm::LZ4,
+                                         CompressionAlgorithm::ZSTD }) {
+            if(__CompressionAlgorithm_names<>::names.EnumToString(alg) != algorithm_name) continue;
+            algorithm = alg;
+            found = true;
+        }
+        if(!found)
+            throw exception("Unknown compression algorithm '%1%'.") % algorithm_name;
+        if(pos != std::string::npos) {
+            std::istringstream ss(compression.substr(pos + 1));
+            if(!(ss >> level) || level < 0 || level > 9)
+                throw exception("Invalid compression level in '%1%'.") % compression;
+        }
+        if(!IsSupported(algorithm))
+            throw exception("Compression algorithm '%1%' is not supported by this ROOT version.") % algorithm_name;
+    }
+
+    static bool IsSupported(CompressionAlgorithm algorithm)
+    {
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,20,0)
+        if(algorithm == CompressionAlgorithm::ZSTD) return false;
+#endif
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,10,0)
+        if(algorithm == CompressionAlgorithm::LZ4) return false;
+#endif
+        return true;
+    }
+
+    // Should be called before the trees are created.
+    void Apply(TFile& file) const
+    {
+        if(algorithm == CompressionAlgorithm::Default && level < 0) return;
+        const int alg = algorithm == CompressionAlgorithm::Default ? file.GetCompressionAlgorithm()
+                                                                    : static_cast<int>(algorithm);
+        const int lvl = level < 0 ? file.GetCompressionLevel() : level;
+        file.SetCompressionSettings(alg * 100 + lvl);
+    }
+
+    // Should be called after all branches of the tree are created.
+    void Apply(TTree& tree) const
+    {
+        if(basket_size > 0)
+            tree.SetBasketSize("*", basket_size);
+        if(auto_flush != 0)
+            tree.SetAutoFlush(auto_flush);
+    }
+
+    std::string ToString() const
+    {
+        std::ostringstream ss;
+        ss << __CompressionAlgorithm_names<>::names.EnumToString(algorithm);
+        if(level >= 0)
+            ss << ":" << level;
+        ss << ", basket size = ";
+        if(basket_size > 0) ss << basket_size; else ss << "default";
+        ss << ", auto flush = ";
+        if(auto_flush != 0) ss << auto_flush; else ss << "default";
+        return ss.str();
+    }
+};
+
+} // namespace analysis
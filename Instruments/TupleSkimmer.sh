@@ -1,32 +1,23 @@
 #!/bin/bash
 
-if [ $# -ne 3 ] ; then
-    echo "Usage: tree_name input_path output_path"
+if [ $# -lt 3 ] ; then
+    echo "Usage: tree_name input_path output_path [n_parallel_jobs] [chunk_size]"
     exit 1
 fi
 
 TREE_NAME="$1"
 INPUT_PATH="$2"
 OUTPUT_PATH="$3"
-INPUT_PATTERN="*.root"
+N_PARALLEL_JOBS="${4:-4}"
+CHUNK_SIZE="${5:-100000}"
 
-mkdir -p "$OUTPUT_PATH"
-
-IFS=$'\n'
-INPUT_FILES=( $(find "$INPUT_PATH" -maxdepth 1 -type f -name "$INPUT_PATTERN" | sort) )
-
-for input_file in "${INPUT_FILES[@]}" ; do
-    input_file_name=${input_file##*/}
-    output_file="$OUTPUT_PATH/$input_file_name"
-    if [ -f "$output_file" ] ; then
-        echo "'$input_file' was already processed."
-        continue
-    fi
-    echo "Skimming '$input_file' -> '$output_file'..."
-    ./run.sh TupleSkimmer "$TREE_NAME" "$input_file" "$output_file"
-    RESULT=$?
-    if [ $RESULT -ne 0 ] ; then
-        echo "Error occurred while processing '$input_file'."
-        exit 1
-    fi
-done
+# All files of the input directory are skimmed by a single process. Completed chunks and files are recorded in
+# "$OUTPUT_PATH/skim_manifest.txt", so rerunning the same command after an interruption resumes the skimming
+# with the first unfinished chunk (with chunk_size = 0, with the first unfinished file).
+./run.sh TupleSkimmer "$TREE_NAME" "$INPUT_PATH" "$OUTPUT_PATH" --n_parallel_jobs "$N_PARALLEL_JOBS" \
+    --chunk_size "$CHUNK_SIZE"
+RESULT=$?
+if [ $RESULT -ne 0 ] ; then
+    echo "Error occurred while skimming '$INPUT_PATH'."
+    exit 1
+fi
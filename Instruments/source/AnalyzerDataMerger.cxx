@@ -0,0 +1,207 @@
+/*! Merge partial fill states produced by a partitioned analyzer run.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <algorithm>
+#include <cstdio>
+
+#include <TH1.h>
+#include <TKey.h>
+#include <TNamed.h>
+
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Run/include/program_main.h"
+#include "hh-bbtautau/Analysis/include/FillResultCache.h"
+#include "hh-bbtautau/Analysis/include/InputFiles.h"
+
+struct Arguments {
+    REQ_ARG(std::string, inputs);
+    REQ_ARG(std::string, outputFileName);
+    OPT_ARG(unsigned, n_threads, 1);
+};
+
+namespace analysis {
+
+// Combines the partial fill states written by the jobs of a partitioned analyzer run (--n_partitions and
+// --partition_index with --stage fill) into a single fill state, which can be used by the analyzer with
+// --stage estimation --fill_state_file outputFileName. inputs is a directory with the partial fill states or a text
+// file with one partial fill state per line. All partitions of the run should be present exactly once, and all
+// partial states should be produced for the same list of source units.
+// The partial states are split into contiguous blocks in the partition order, each block is read and summed by its
+// own thread and the block sums are then added in the block order, so the result doesn't depend on the timing.
+// The histograms are summed as stored, so the merger doesn't depend on the channel.
+class AnalyzerDataMerger {
+public:
+    using clock = std::chrono::steady_clock;
+    using HistogramId = std::pair<std::string, std::string>;
+    using HistogramPtr = std::shared_ptr<TH1>;
+    using HistogramMap = std::map<HistogramId, HistogramPtr>;
+
+    struct PartialState {
+        std::string file_name;
+        size_t partition_index;
+    };
+
+    AnalyzerDataMerger(const Arguments& _args) : args(_args), n_threads(std::max<size_t>(args.n_threads(), 1)) {}
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        if(n_threads > 1)
+            ROOT::EnableThreadSafety();
+#endif
+        TH1::AddDirectory(kFALSE);
+        const auto start = clock::now();
+
+        std::string key;
+        const std::vector<PartialState> partials = CollectPartialStates(FindInputFiles(args.inputs()), key);
+        const size_t n_blocks = std::min(n_threads, partials.size());
+        std::cout << "Merging " << partials.size() << " partial fill states using " << n_blocks << " thread"
+                  << (n_blocks > 1 ? "s" : "") << "..." << std::endl;
+
+        std::vector<HistogramMap> block_results(n_blocks);
+        std::vector<std::exception_ptr> block_errors(n_blocks);
+        std::vector<std::thread> threads;
+        for(size_t block = 0; block < n_blocks; ++block) {
+            const size_t first = block * partials.size() / n_blocks, last = (block + 1) * partials.size() / n_blocks;
+            threads.emplace_back([&, block, first, last]() {
+                try {
+                    for(size_t n = first; n < last; ++n)
+                        ReadPartialState(partials.at(n).file_name, block_results.at(block));
+                } catch(...) {
+                    block_errors.at(block) = std::current_exception();
+                }
+            });
+        }
+        for(auto& thread : threads)
+            thread.join();
+        for(const auto& error : block_errors) {
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+        HistogramMap& result = block_results.front();
+        for(size_t block = 1; block < n_blocks; ++block)
+            AddHistograms(block_results.at(block), result);
+        WriteFillState(key, result);
+
+        const double total_time = std::chrono::duration<double>(clock::now() - start).count();
+        std::cout << result.size() << " histograms merged into '" << args.outputFileName() << "' in " << total_time
+                  << " s." << std::endl;
+    }
+
+private:
+    // Checks that the partial states belong to the same run and cover all its partitions exactly once.
+    // Returns the partial states in the partition order.
+    static std::vector<PartialState> CollectPartialStates(const std::vector<std::string>& inputs, std::string& key)
+    {
+        std::vector<PartialState> partials;
+        std::string units_digest;
+        size_t n_partitions = 0;
+        for(const auto& input : inputs) {
+            auto file = root_ext::OpenRootFile(input);
+            std::unique_ptr<TNamed> file_key(root_ext::TryReadObject<TNamed>(*file, FillResultCache::KeyName()));
+            if(!file_key)
+                throw exception("'%1%' is not a fill state.") % input;
+            std::string input_key, input_units_digest;
+            size_t partition_index, input_n_partitions;
+            if(!FillResultCache::ParsePartitionKey(file_key->GetTitle(), input_key, partition_index,
+                                                   input_n_partitions, input_units_digest))
+                throw exception("'%1%' is not a partial fill state.") % input;
+            if(partials.empty()) {
+                key = input_key;
+                n_partitions = input_n_partitions;
+                units_digest = input_units_digest;
+            } else if(input_key != key || input_n_partitions != n_partitions)
+                throw exception("'%1%' was produced by another analyzer run than '%2%'.") % input
+                        % partials.front().file_name;
+            else if(input_units_digest != units_digest)
+                throw exception("'%1%' was produced for another list of source units than '%2%'.") % input
+                        % partials.front().file_name;
+            partials.push_back(PartialState{ input, partition_index });
+        }
+        std::sort(partials.begin(), partials.end(), [](const PartialState& a, const PartialState& b) {
+            return a.partition_index < b.partition_index;
+        });
+        for(size_t n = 0; n < partials.size(); ++n) {
+            if(n > 0 && partials.at(n).partition_index == partials.at(n - 1).partition_index)
+                throw exception("Partition %1% is given twice: '%2%' and '%3%'.") % partials.at(n).partition_index
+                        % partials.at(n - 1).file_name % partials.at(n).file_name;
+        }
+        if(partials.size() != n_partitions)
+            throw exception("Only %1% of %2% partitions are given.") % partials.size() % n_partitions;
+        return partials;
+    }
+
+    static void ReadPartialState(const std::string& file_name, HistogramMap& histograms)
+    {
+        auto file = root_ext::OpenRootFile(file_name);
+        TDirectory* data = file->GetDirectory(FillResultCache::DataDirectoryName().c_str());
+        if(!data)
+            throw exception("Data directory not found in '%1%'.") % file_name;
+        TIter next_dir(data->GetListOfKeys());
+        while(TKey* dir_key = dynamic_cast<TKey*>(next_dir())) {
+            if(std::string(dir_key->GetClassName()) != "TDirectoryFile") continue;
+            TDirectory* dir = data->GetDirectory(dir_key->GetName());
+            TIter next_hist(dir->GetListOfKeys());
+            while(TKey* hist_key = dynamic_cast<TKey*>(next_hist())) {
+                HistogramPtr hist(dynamic_cast<TH1*>(hist_key->ReadObj()));
+                if(!hist)
+                    throw exception("Object '%1%/%2%' in '%3%' is not a histogram.") % dir_key->GetName()
+                            % hist_key->GetName() % file_name;
+                hist->SetDirectory(nullptr);
+                AddHistogram(HistogramId(dir_key->GetName(), hist_key->GetName()), hist, histograms);
+            }
+        }
+    }
+
+    static void AddHistograms(const HistogramMap& source, HistogramMap& target)
+    {
+        for(const auto& entry : source)
+            AddHistogram(entry.first, entry.second, target);
+    }
+
+    static void AddHistogram(const HistogramId& id, const HistogramPtr& hist, HistogramMap& target)
+    {
+        auto iter = target.find(id);
+        if(iter == target.end())
+            target[id] = hist;
+        else
+            iter->second->Add(hist.get());
+    }
+
+    // Written to a temporary file first, in the same way as FillResultCache::Save.
+    void WriteFillState(const std::string& key, const HistogramMap& histograms) const
+    {
+        const std::string tmp_name = args.outputFileName() + ".tmp";
+        {
+            auto file = root_ext::CreateRootFile(tmp_name);
+            TNamed file_key(FillResultCache::KeyName().c_str(), key.c_str());
+            file->WriteTObject(&file_key, FillResultCache::KeyName().c_str());
+            TDirectory* data = file->mkdir(FillResultCache::DataDirectoryName().c_str());
+            TDirectory* dir = nullptr;
+            std::string dir_name;
+            for(const auto& entry : histograms) {
+                if(!dir || entry.first.first != dir_name) {
+                    dir_name = entry.first.first;
+                    dir = data->mkdir(dir_name.c_str());
+                    if(!dir)
+                        throw exception("Unable to create directory '%1%'.") % dir_name;
+                }
+                root_ext::WriteObject(*entry.second, dir, entry.first.second);
+            }
+        }
+        if(std::rename(tmp_name.c_str(), args.outputFileName().c_str()))
+            throw exception("Unable to move fill state file '%1%' to '%2%'.") % tmp_name % args.outputFileName();
+    }
+
+private:
+    Arguments args;
+    const size_t n_threads;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::AnalyzerDataMerger, Arguments)
@@ -0,0 +1,92 @@
+/*! Export EventTuple into the columnar event cache.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <TSystem.h>
+
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/ProgressReporter.h"
+#include "AnalysisTools/Run/include/program_main.h"
+#include "hh-bbtautau/Analysis/include/AnaTupleProducer.h"
+#include "hh-bbtautau/Analysis/include/ColumnarEventCache.h"
+#include "hh-bbtautau/Analysis/include/EventSelectionCache.h"
+#include "hh-bbtautau/Analysis/include/EventTupleReader.h"
+
+struct Arguments {
+    REQ_ARG(std::string, treeName);
+    REQ_ARG(std::string, inputFileName);
+    REQ_ARG(std::string, outputDir);
+    OPT_ARG(bool, is_data, false);
+    OPT_ARG(std::string, btag_eff_file, "");
+    OPT_ARG(std::string, btag_sf_file, "");
+    OPT_ARG(double, btag_sf_tolerance, 0);
+    OPT_ARG(unsigned, prefetch_events, 1000);
+};
+
+namespace analysis {
+
+// Runs the analysis-ready tuple producer on each central energy scale event of the input tuple and stores the
+// events which belong to at least one event category in the columnar cache of the input (see
+// ColumnarEventCache.h), which can be used by the analyzers with --columnar_cache_dir. The cache key is the
+// identity of the input tuple, so the analyzer can detect an outdated cache. is_data and the b-tag weight files
+// should be set as for the analyzer of the same sample.
+class ColumnarCacheExporter {
+public:
+    ColumnarCacheExporter(const Arguments& _args) : args(_args)
+    {
+        std::shared_ptr<BTagWeightService> bTagWeight;
+        if(!args.is_data() && args.btag_eff_file().size()) {
+            bTagWeight.reset(new BTagWeightService(args.btag_eff_file(), args.btag_sf_file(),
+                                                   btag_calibration::BTagEntry::OP_MEDIUM,
+                                                   cuts::Htautau_2015::btag::CSVM, args.btag_sf_tolerance()));
+        }
+        producer = BaseAnaTupleProducer::Create(args.treeName(), args.is_data(), bTagWeight);
+    }
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        if(args.prefetch_events() > 0)
+            ROOT::EnableThreadSafety();
+#endif
+        Long64_t n_entries;
+        std::string source_id;
+        {
+            auto file = root_ext::OpenRootFile(args.inputFileName());
+            TTree* tree = root_ext::ReadObject<TTree>(*file, args.treeName());
+            n_entries = tree->GetEntries();
+            source_id = EventSelectionCache::SourceIdentity(*file, *tree);
+        }
+
+        gSystem->mkdir(args.outputDir().c_str(), kTRUE);
+        const std::string output = ColumnarCacheFormat::MakeFileName(args.outputDir(), args.inputFileName(),
+                                                                     args.treeName(), source_id);
+        ColumnarCacheWriter writer(source_id);
+        AnaEventColumnWriter columnWriter(writer);
+        ntuple::AnaEvent anaEvent;
+
+        tools::ProgressReporter reporter(10, std::cout, "Exporting events...");
+        reporter.SetTotalNumberOfEvents(n_entries);
+        EventTupleReader reader(args.inputFileName(), args.treeName(), { "lhe_particle_pdg", "lhe_particle_p4" },
+                                EventTupleReader::EntryRange(0, n_entries), args.prefetch_events(), 0);
+        Long64_t n_read = 0;
+        while(const ntuple::Event* event = reader.Next()) {
+            reporter.Report(n_read++);
+            if(static_cast<EventEnergyScale>(event->eventEnergyScale) != EventEnergyScale::Central) continue;
+            if(producer->Produce(*event, reader.GetTauIds(), anaEvent))
+                columnWriter.Fill(anaEvent);
+        }
+        reporter.Report(n_read, true);
+
+        writer.Save(output);
+        std::cout << writer.GetNumberOfRows() << " of " << n_entries << " events are stored in '" << output << "'."
+                  << std::endl;
+    }
+
+private:
+    Arguments args;
+    std::shared_ptr<BaseAnaTupleProducer> producer;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::ColumnarCacheExporter, Arguments)
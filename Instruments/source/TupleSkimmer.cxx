@@ -3,6 +3,22 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include <thread>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <tuple>
+#include <new>
+#include <cstdlib>
+#include <sys/resource.h>
+
+#include <TChain.h>
+#include <TNamed.h>
+#include <TSystem.h>
 
 #include "AnalysisTools/Core/include/RootExt.h"
 #include "AnalysisTools/Run/include/program_main.h"
@@ -10,85 +26,446 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "h-tautau/Analysis/include/AnalysisTypes.h"
 #include "AnalysisTools/Run/include/EntryQueue.h"
 #include "AnalysisTools/Core/include/ProgressReporter.h"
+#include "hh-bbtautau/Analysis/include/TauIdColumns.h"
+#include "hh-bbtautau/Analysis/include/InputFiles.h"
+#include "hh-bbtautau/Analysis/include/SourceScheduler.h"
+#include "hh-bbtautau/Analysis/include/TupleLayout.h"
+#include "hh-bbtautau/Analysis/include/AnaTupleProducer.h"
+#include "hh-bbtautau/Analysis/include/Digest.h"
+#include "hh-bbtautau/Analysis/include/EventSelectionCache.h"
 
 struct Arguments {
     REQ_ARG(std::string, treeName);
     REQ_ARG(std::string, originalFileName);
     REQ_ARG(std::string, outputFileName);
+    OPT_ARG(unsigned, n_process_threads, 1);
+    OPT_ARG(unsigned, event_pool_size, 1000);
+    OPT_ARG(bool, compact_tau_ids, false);
+    OPT_ARG(unsigned, n_parallel_jobs, 1);
+    OPT_ARG(unsigned, chunk_size, 100000);
+    OPT_ARG(std::string, manifest, "");
+    OPT_ARG(std::string, compression, "default");
+    OPT_ARG(int, basket_size, 0);
+    OPT_ARG(Long64_t, auto_flush, 0);
+    OPT_ARG(bool, ana_tuple, false);
+    OPT_ARG(bool, is_data, false);
+    OPT_ARG(std::string, btag_eff_file, "");
+    OPT_ARG(std::string, btag_sf_file, "");
+    OPT_ARG(double, btag_sf_tolerance, 0);
 };
 
+#ifdef COUNT_HEAP_ALLOCATIONS
+namespace {
+std::atomic<size_t> n_heap_allocations(0);
+}
+
+// Heap allocations are counted to measure the effect of the event pool. The global operators are replaced only if
+// COUNT_HEAP_ALLOCATIONS is defined at compile time, since the counter is shared by all threads.
+void* operator new(size_t size)
+{
+    ++n_heap_allocations;
+    if(void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
 namespace analysis {
 
-class TupleSkimmer {
+// Events which come from the process workers in any order are given to the writer in the order of their sequence
+// numbers. Rejected events are pushed as empty entries, so the sequence has no gaps. Events are kept in a ring of
+// max_size slots: only events with seq < next_seq + max_size can be pushed, so a fast worker can't run away from
+// a slow one, while the event with the next sequence number can always be pushed.
+template<typename EventPtr>
+class ReorderBuffer {
+public:
+    ReorderBuffer(size_t max_size, size_t _n_producers)
+        : slots(std::max<size_t>(max_size, 1)), filled(slots.size(), false), n_producers(_n_producers), n_done(0),
+          next_seq(0) {}
+
+    void Push(size_t seq, const EventPtr& event)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        push_cond.wait(lock, [&]() { return seq < next_seq + slots.size(); });
+        const size_t index = seq % slots.size();
+        slots.at(index) = event;
+        filled.at(index) = true;
+        if(seq == next_seq)
+            pop_cond.notify_one();
+    }
+
+    void SetProducerDone()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++n_done;
+        pop_cond.notify_one();
+    }
+
+    bool Pop(EventPtr& event)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const size_t index = next_seq % slots.size();
+        pop_cond.wait(lock, [&]() { return filled.at(index) || n_done == n_producers; });
+        if(!filled.at(index)) return false;
+        event = slots.at(index);
+        slots.at(index) = EventPtr();
+        filled.at(index) = false;
+        ++next_seq;
+        push_cond.notify_all();
+        return true;
+    }
+
+private:
+    std::vector<EventPtr> slots;
+    std::vector<bool> filled;
+    const size_t n_producers;
+    size_t n_done, next_seq;
+    std::mutex mutex;
+    std::condition_variable push_cond, pop_cond;
+};
+
+// Text file with one line per completed step of the skimming:
+//     chunk <first entry> <last entry> <source id> <config> <input file>  - a part file of the input is written;
+//     file <source id> <config> <input file>                              - the output file of the input is complete.
+// Lines are appended and flushed one by one, so after a crash the manifest lists exactly the completed steps.
+// The source id is the identity of the input file given by SidecarCache::SourceIdentity (UUID, size and number of
+// entries), not a digest of its content. The config is the digest of the skim configuration (see TupleSkimmer::SkimConfig).
+// Steps done for another input file identity or with another configuration are ignored.
+class SkimManifest {
+public:
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+
+    SkimManifest(const std::string& _file_name, const std::string& _config) : file_name(_file_name), config(_config)
+    {
+        bool ends_with_new_line = true;
+        {
+            std::ifstream f(file_name);
+            std::string line;
+            while(std::getline(f, line)) {
+                ends_with_new_line = !f.eof();
+                if(ends_with_new_line)
+                    ParseLine(line);
+            }
+        }
+        out.open(file_name, std::ios::app);
+        if(!out.is_open())
+            throw exception("Unable to open skim manifest '%1%'.") % file_name;
+        if(!ends_with_new_line)
+            out << std::endl;
+    }
+
+    const std::string& GetFileName() const { return file_name; }
+
+    bool IsFileDone(const std::string& input, const std::string& source_id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done_files.count(FileKey(input, source_id));
+    }
+
+    bool IsChunkDone(const std::string& input, const std::string& source_id, const EntryRange& range) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done_chunks.count(ChunkKey(input, source_id, range));
+    }
+
+    void AddChunk(const std::string& input, const std::string& source_id, const EntryRange& range)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done_chunks.insert(ChunkKey(input, source_id, range));
+        out << "chunk " << range.first << " " << range.second << " " << source_id << " " << config << " " << input
+            << std::endl;
+    }
+
+    void AddFile(const std::string& input, const std::string& source_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done_files.insert(FileKey(input, source_id));
+        out << "file " << source_id << " " << config << " " << input << std::endl;
+    }
+
+private:
+    using FileKeyType = std::pair<std::string, std::string>;
+    using ChunkKeyType = std::tuple<std::string, std::string, Long64_t, Long64_t>;
+
+    static FileKeyType FileKey(const std::string& input, const std::string& source_id)
+    {
+        return FileKeyType(input, source_id);
+    }
+
+    static ChunkKeyType ChunkKey(const std::string& input, const std::string& source_id, const EntryRange& range)
+    {
+        return ChunkKeyType(input, source_id, range.first, range.second);
+    }
+
+    // Lines which can't be parsed are ignored: the corresponding step will be repeated.
+    void ParseLine(const std::string& line)
+    {
+        std::istringstream ss(line);
+        std::string type, source_id, line_config, input;
+        EntryRange range;
+        ss >> type;
+        if(type == "chunk")
+            ss >> range.first >> range.second;
+        else if(type != "file")
+            return;
+        ss >> source_id >> line_config >> std::ws;
+        std::getline(ss, input);
+        if(ss.fail() || input.empty() || line_config != config) return;
+        if(type == "chunk")
+            done_chunks.insert(ChunkKey(input, source_id, range));
+        else
+            done_files.insert(FileKey(input, source_id));
+    }
+
+private:
+    std::string file_name, config;
+    std::ofstream out;
+    mutable std::mutex mutex;
+    std::set<FileKeyType> done_files;
+    std::set<ChunkKeyType> done_chunks;
+};
+
+// Skims an entry range of one input file into one output file.
+// Read, process and write stages run in separate threads, the process stage in n_process_threads workers.
+// With event_pool_size > 0, events are taken from a bounded pool and returned to it after they are written or
+// rejected, so the event buffers are reused instead of being allocated and copied for each entry. All events are
+// back in the pool when Run returns, so the same pool can be used for the next range.
+// The output entry order is the same as the input order for any number of workers.
+// With compact_tau_ids, the retained tau IDs are written as fixed-position float columns (see TauIdColumns.h)
+// and the string-keyed tau ID maps are written empty. It is off by default, since the output can then be read only
+// through TauIdColumnReader.
+// The output is written with the given compression and basket layout (see TupleLayout.h).
+// With an analysis-ready tuple producer, each process worker runs its own copy of it on the accepted events, and
+// the events which belong to at least one event category are also written into the analysis-ready tuple of the
+// channel (see AnaTuple.h) in the same output file, together with the description of its weights.
+class SkimPipeline {
 public:
     using Event = ntuple::Event;
     using EventPtr = std::shared_ptr<Event>;
     using EventTuple = ntuple::EventTuple;
-    using EventQueue = run::EntryQueue<EventPtr>;
+    using EventPool = run::EntryQueue<EventPtr>;
+    using SequencedEvent = std::pair<size_t, EventPtr>;
+    using EventQueue = run::EntryQueue<SequencedEvent>;
+    using AnaProducerPtr = std::shared_ptr<BaseAnaTupleProducer>;
+    using EntryRange = std::pair<Long64_t, Long64_t>;
+    using clock = std::chrono::steady_clock;
 
-    TupleSkimmer(const Arguments& _args) : args(_args), processQueue(100000), writeQueue(100000) {}
+    struct StageStats {
+        std::atomic<size_t> n_events;
+        std::atomic<long long> busy_ns;
+        StageStats() : n_events(0), busy_ns(0) {}
 
-    void Run()
-    {
-#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
-        ROOT::EnableThreadSafety();
-#endif
+        void Add(size_t n, const clock::time_point& start)
+        {
+            n_events += n;
+            busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        }
+    };
 
-        std::thread process_thread(std::bind(&TupleSkimmer::ProcessThread, this));
-        std::thread writer_thread(std::bind(&TupleSkimmer::WriteThread, this, args.treeName(),
-                                            args.outputFileName()));
+    struct Stats {
+        StageStats read, process, write;
+    };
 
+    SkimPipeline(const Arguments& _args, const TupleLayout& _layout, EventPool& _freeQueue, Stats& _stats,
+                 const BaseAnaTupleProducer* _anaProducer = nullptr, const std::string& _anaWeightsConfig = "")
+        : args(_args), layout(_layout), n_workers(std::max<unsigned>(args.n_process_threads(), 1)),
+          processQueue(100000), writeBuffer(100000, n_workers), freeQueue(_freeQueue), stats(_stats),
+          anaProducer(_anaProducer), anaWeightsConfig(_anaWeightsConfig) {}
 
-        ReadThread(args.treeName(), args.originalFileName());
+    void Run(const std::string& inputFileName, const std::string& outputFileName, const EntryRange& range,
+             bool report_progress)
+    {
+        std::vector<std::thread> process_threads;
+        for(size_t n = 0; n < n_workers; ++n)
+            process_threads.emplace_back(std::bind(&SkimPipeline::ProcessThread, this));
+        std::thread writer_thread(std::bind(&SkimPipeline::WriteThread, this, outputFileName));
 
-        std::cout << "Waiting for process and write threads to finish..." << std::endl;
-        process_thread.join();
+        std::exception_ptr read_error;
+        try {
+            ReadThread(inputFileName, range, report_progress);
+        } catch(...) {
+            read_error = std::current_exception();
+            processQueue.SetAllDone();
+        }
+
+        for(auto& thread : process_threads)
+            thread.join();
         writer_thread.join();
+        if(read_error)
+            std::rethrow_exception(read_error);
+        if(process_error)
+            std::rethrow_exception(process_error);
+        if(write_error)
+            std::rethrow_exception(write_error);
     }
 
 private:
-    void ReadThread(const std::string& treeName, const std::string& originalFileName)
+    // The analysis-ready entry is kept by value, so the reorder buffer doesn't allocate it for each event.
+    struct ProcessedEvent {
+        EventPtr event;
+        bool has_ana_event;
+        ntuple::AnaEvent ana_event;
+        ProcessedEvent() : has_ana_event(false) {}
+    };
+
+    void ReadThread(const std::string& inputFileName, const EntryRange& range, bool report_progress)
     {
-        auto originalFile = root_ext::OpenRootFile(originalFileName);
-        std::shared_ptr<EventTuple> originalTuple(new EventTuple(treeName, originalFile.get(), true,
+        auto originalFile = root_ext::OpenRootFile(inputFileName);
+        std::shared_ptr<EventTuple> originalTuple(new EventTuple(args.treeName(), originalFile.get(), true,
                 { "lhe_n_partons", "lhe_HT" }));
 
-        tools::ProgressReporter reporter(10, std::cout, "Starting skimming...");
-        const Long64_t n_entries = originalTuple->GetEntries();
-        reporter.SetTotalNumberOfEvents(n_entries);
-        for(Long64_t current_entry = 0; current_entry < n_entries; ++current_entry) {
+        std::shared_ptr<tools::ProgressReporter> reporter;
+        if(report_progress) {
+            reporter.reset(new tools::ProgressReporter(10, std::cout, "Starting skimming..."));
+            reporter->SetTotalNumberOfEvents(range.second - range.first);
+        }
+        for(Long64_t current_entry = range.first; current_entry < range.second; ++current_entry) {
+            EventPtr event;
+            if(args.event_pool_size())
+                freeQueue.Pop(event);
+            const auto read_start = clock::now();
             originalTuple->GetEntry(current_entry);
-            reporter.Report(current_entry);
-            EventPtr event(new Event(originalTuple->data()));
-            processQueue.Push(event);
+            if(event)
+                *event = originalTuple->data();
+            else
+                event.reset(new Event(originalTuple->data()));
+            stats.read.Add(1, read_start);
+            if(reporter)
+                reporter->Report(current_entry - range.first);
+            processQueue.Push(SequencedEvent(static_cast<size_t>(current_entry - range.first), event));
         }
         processQueue.SetAllDone();
-        reporter.Report(n_entries, true);
+        if(reporter)
+            reporter->Report(range.second - range.first, true);
     }
 
+    // Tau IDs for the event regions are taken from the tau ID maps, since the columns are filled by the writer.
     void ProcessThread()
     {
-        EventPtr event;
-        while(processQueue.Pop(event)) {
-            if(ProcessEvent(*event))
-                writeQueue.Push(event);
+        AnaProducerPtr producer;
+        try {
+            if(anaProducer)
+                producer = anaProducer->Clone();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if(!process_error)
+                process_error = std::current_exception();
+        }
+
+        SequencedEvent entry;
+        while(processQueue.Pop(entry)) {
+            const auto process_start = clock::now();
+            ProcessedEvent processed;
+            const bool accepted = ProcessEvent(*entry.second);
+            if(accepted) {
+                processed.event = entry.second;
+                if(producer) {
+                    try {
+                        const TauIds tauIds(*entry.second, nullptr, nullptr, nullptr);
+                        processed.has_ana_event = producer->Produce(*entry.second, tauIds, processed.ana_event);
+                    } catch(...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if(!process_error)
+                            process_error = std::current_exception();
+                    }
+                }
+            }
+            stats.process.Add(1, process_start);
+            writeBuffer.Push(entry.first, processed);
+            if(!accepted)
+                Release(entry.second);
         }
-        writeQueue.SetAllDone();
+        writeBuffer.SetProducerDone();
     }
 
-    void WriteThread(const std::string& treeName, const std::string& outputFileName)
+    // In case of an error, the remaining events are still consumed, so the other stages can finish.
+    void WriteThread(const std::string& outputFileName)
     {
-        auto outputFile = root_ext::CreateRootFile(outputFileName);
-        std::shared_ptr<EventTuple> outputTuple(new EventTuple(treeName, outputFile.get(), false,
-                { "lhe_particle_pdg", "lhe_particle_p4" } ));
+        std::shared_ptr<TFile> outputFile;
+        std::shared_ptr<EventTuple> outputTuple;
+        std::shared_ptr<TauIdColumnWriter> tauIdWriter;
+        std::shared_ptr<ntuple::AnaTuple> anaTuple;
+        try {
+            outputFile = root_ext::CreateRootFile(outputFileName);
+            layout.Apply(*outputFile);
+            outputTuple.reset(new EventTuple(args.treeName(), outputFile.get(), false,
+                    { "lhe_particle_pdg", "lhe_particle_p4" } ));
+            TTree& outputTree = *root_ext::ReadObject<TTree>(*outputFile, args.treeName());
+            if(args.compact_tau_ids())
+                tauIdWriter.reset(new TauIdColumnWriter(outputTree, args.treeName()));
+            layout.Apply(outputTree);
+            if(anaProducer) {
+                const std::string ana_name = AnaTupleName(args.treeName());
+                anaTuple.reset(new ntuple::AnaTuple(ana_name, outputFile.get(), false));
+                layout.Apply(*root_ext::ReadObject<TTree>(*outputFile, ana_name));
+            }
+        } catch(...) {
+            write_error = std::current_exception();
+        }
 
-        EventPtr event;
-        while(writeQueue.Pop(event)) {
-            (*outputTuple)() = *event;
-            outputTuple->Fill();
+        ProcessedEvent processed;
+        while(writeBuffer.Pop(processed)) {
+            if(!processed.event) continue;
+            if(!write_error) {
+                const auto write_start = clock::now();
+                if(tauIdWriter)
+                    tauIdWriter->Fill(*processed.event);
+                (*outputTuple)() = *processed.event;
+                outputTuple->Fill();
+                if(anaTuple && processed.has_ana_event) {
+                    (*anaTuple)() = processed.ana_event;
+                    anaTuple->Fill();
+                }
+                stats.write.Add(1, write_start);
+            }
+            Release(processed.event);
         }
+        if(write_error) return;
 
+        const auto write_start = clock::now();
         outputTuple->Write();
+        if(anaTuple) {
+            anaTuple->Write();
+            const std::string config_name = AnaTupleWeightsConfigName(args.treeName());
+            TNamed weightsConfig(config_name.c_str(), anaWeightsConfig.c_str());
+            outputFile->WriteTObject(&weightsConfig, config_name.c_str(), "Overwrite");
+        }
+        if(tauIdWriter)
+            tauIdWriter->WriteHeader(*outputFile);
+        stats.write.Add(0, write_start);
+    }
+
+    void Release(EventPtr& event)
+    {
+        if(args.event_pool_size())
+            freeQueue.Push(event);
+        event.reset();
+    }
+
+    // Removes the discriminators which are not in the list, without building a new map.
+    template<typename TauIdMap>
+    static void FilterTauIDs(TauIdMap& tauIDs, const std::set<std::string>& names)
+    {
+        for(auto iter = tauIDs.begin(); iter != tauIDs.end();) {
+            if(names.count(iter->first))
+                ++iter;
+            else
+                iter = tauIDs.erase(iter);
+        }
+    }
+
+    static std::set<std::string> RetainedTauIdNames()
+    {
+        std::set<std::string> names;
+        for(TauIdDiscriminator discriminator : TauIdColumns::Discriminators())
+            names.insert(TauIdColumns::Name(discriminator));
+        return names;
     }
 
     static bool ProcessEvent(Event& event)
@@ -96,20 +473,9 @@ private:
         const EventEnergyScale es = static_cast<EventEnergyScale>(event.eventEnergyScale);
         if(es != EventEnergyScale::Central) return false;
 
-        static const std::set<std::string> tauID_Names = {
-            "againstMuonTight3", "againstElectronVLooseMVA6", "againstElectronTightMVA6", "againstMuonLoose3",
-            "byTightIsolationMVArun2v1DBoldDMwLT", "byVTightIsolationMVArun2v1DBoldDMwLT"
-        };
-        decltype(event.tauIDs_1) tauIDs_1, tauIDs_2;
-        for(const auto& name : tauID_Names) {
-            if(event.tauIDs_1.count(name))
-                tauIDs_1[name] = event.tauIDs_1.at(name);
-            if(event.tauIDs_2.count(name))
-                tauIDs_2[name] = event.tauIDs_2.at(name);
-
-        }
-        event.tauIDs_1 = tauIDs_1;
-        event.tauIDs_2 = tauIDs_2;
+        static const std::set<std::string> tauID_Names = RetainedTauIdNames();
+        FilterTauIDs(event.tauIDs_1, tauID_Names);
+        FilterTauIDs(event.tauIDs_2, tauID_Names);
 
         static const std::set<int> quarks_and_gluons = { 1, 2, 3, 4, 5, 6, 21 };
         if(event.lhe_particle_p4.size()) {
@@ -129,9 +495,275 @@ private:
         return true;
     }
 
+private:
+    const Arguments& args;
+    const TupleLayout& layout;
+    const size_t n_workers;
+    EventQueue processQueue;
+    ReorderBuffer<ProcessedEvent> writeBuffer;
+    EventPool& freeQueue;
+    Stats& stats;
+    const BaseAnaTupleProducer* anaProducer;
+    const std::string anaWeightsConfig;
+    std::mutex error_mutex;
+    std::exception_ptr process_error, write_error;
+};
+
+// The input is a ROOT file, a directory (all *.root files in it are skimmed) or a text file with a list of
+// ROOT files, one per line. For a single ROOT file, the output is the output file; otherwise it is a directory where
+// the outputs are written with the same names as the inputs.
+// Each input is split in chunks of chunk_size entries (the whole file if chunk_size = 0). Up to n_parallel_jobs
+// chunks of any input are skimmed concurrently, each into its own part file. When all chunks of the input are
+// done, the parts are merged into the output file. For a directory or a list of inputs, completed chunks and files
+// are recorded in the manifest (<output>/skim_manifest.txt by default), so a rerun after a crash skips them and
+// resumes with the first unfinished chunk; with chunk_size = 0 it resumes only per whole file. A single ROOT file
+// is always skimmed from scratch.
+// With ana_tuple, the analysis-ready tuple of the channel is produced as well (see AnaTupleProducer.h). The MC
+// correction weights are computed here, so is_data and the b-tag weight files should be set as for the analyzer of
+// the same sample. Their description is stored with the tuple and the analyzer checks it
+// against its own configuration.
+// The busy time of each stage (excluding the time spent waiting for the other stages) is reported at the end:
+// the stage with the lowest busy throughput is the bottleneck.
+class TupleSkimmer {
+public:
+    using EventPool = SkimPipeline::EventPool;
+    using EventPtr = SkimPipeline::EventPtr;
+    using EntryRange = SkimPipeline::EntryRange;
+    using clock = SkimPipeline::clock;
+
+    TupleSkimmer(const Arguments& _args)
+        : args(_args), n_workers(std::max<unsigned>(args.n_process_threads(), 1)),
+          n_jobs(std::max<unsigned>(args.n_parallel_jobs(), 1)),
+          layout(args.compression(), args.basket_size(), args.auto_flush())
+    {
+        if(args.ana_tuple()) {
+            std::shared_ptr<BTagWeightService> bTagWeight;
+            if(!args.is_data() && args.btag_eff_file().size()) {
+                bTagWeight.reset(new BTagWeightService(args.btag_eff_file(), args.btag_sf_file(),
+                                                       btag_calibration::BTagEntry::OP_MEDIUM,
+                                                       cuts::Htautau_2015::btag::CSVM, args.btag_sf_tolerance()));
+            }
+            anaProducer = BaseAnaTupleProducer::Create(args.treeName(), args.is_data(), bTagWeight);
+            anaWeightsConfig = BaseAnaTupleProducer::WeightsConfig(args.is_data(),
+                    bTagWeight ? args.btag_eff_file() : "", bTagWeight ? args.btag_sf_file() : "",
+                    args.btag_sf_tolerance());
+        }
+    }
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        ROOT::EnableThreadSafety();
+#endif
+
+        const auto start = clock::now();
+        const bool single_file = IsRootFile(args.originalFileName()) && !IsDirectory(args.originalFileName());
+        if(!single_file)
+            gSystem->mkdir(args.outputFileName().c_str(), kTRUE);
+        if(single_file && args.manifest().size())
+            throw exception("A skim manifest is used only for a directory or a list of input files.");
+        if(!single_file) {
+            const std::string manifest_name = args.manifest().size() ? args.manifest()
+                                                                     : args.outputFileName() + "/skim_manifest.txt";
+            manifest.reset(new SkimManifest(manifest_name, SkimConfig()));
+        }
+
+        const std::vector<std::string> inputs = single_file ? std::vector<std::string>{ args.originalFileName() }
+                                                            : FindUniqueInputFiles(args.originalFileName());
+        for(const std::string& input : inputs) {
+            const std::string output = single_file ? args.outputFileName()
+                                                   : args.outputFileName() + "/" + BaseName(input);
+            PrepareInput(input, output);
+        }
+
+        std::vector<double> costs;
+        for(const auto& job : jobs)
+            costs.push_back(job.range.second - job.range.first);
+        std::cout << "Skimming " << jobs.size() << " chunks of " << files.size() << " files in " << n_jobs
+                  << " parallel jobs with " << n_workers << " process workers each. Output layout: "
+                  << layout.ToString() << "." << std::endl;
+
+        std::vector<std::shared_ptr<EventPool>> pools;
+        for(size_t n = 0; n < n_jobs; ++n) {
+            pools.emplace_back(new EventPool(std::max<unsigned>(args.event_pool_size(), 1)));
+            for(unsigned k = 0; k < args.event_pool_size(); ++k)
+                pools.back()->Push(EventPtr(new SkimPipeline::Event()));
+        }
+
+        SourceScheduler scheduler(costs, n_jobs);
+        scheduler.Run([&](size_t job_id, size_t worker_id) { RunJob(jobs.at(job_id), *pools.at(worker_id)); });
+
+        const double wall_time = std::chrono::duration<double>(clock::now() - start).count();
+        std::cout << "Skimming done in " << wall_time << " s.";
+        if(manifest)
+            std::cout << " Manifest: '" << manifest->GetFileName() << "'.";
+        std::cout << "\n";
+        ReportStage("read", stats.read, n_jobs);
+        ReportStage("process", stats.process, n_jobs * n_workers);
+        ReportStage("write", stats.write, n_jobs);
+
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::cout << "Event pool size: " << args.event_pool_size() << ".";
+#ifdef COUNT_HEAP_ALLOCATIONS
+        const size_t n_read = stats.read.n_events;
+        std::cout << " Heap allocations: " << n_heap_allocations << " ("
+                  << (n_read ? static_cast<double>(n_heap_allocations) / n_read : 0.) << " per event).";
+#endif
+        std::cout << " Peak RSS: " << usage.ru_maxrss / 1024. << " MB." << std::endl;
+    }
+
+private:
+    struct InputFile {
+        std::string input, output, source_id;
+        std::vector<std::string> parts;
+        std::atomic<size_t> n_remaining;
+        InputFile() : n_remaining(0) {}
+    };
+
+    struct ChunkJob {
+        std::shared_ptr<InputFile> file;
+        EntryRange range;
+        std::string part;
+    };
+
+    void PrepareInput(const std::string& input, const std::string& output)
+    {
+        std::shared_ptr<InputFile> file(new InputFile());
+        file->input = input;
+        file->output = output;
+        Long64_t n_entries;
+        {
+            auto inputFile = root_ext::OpenRootFile(input);
+            TTree* tree = root_ext::ReadObject<TTree>(*inputFile, args.treeName());
+            n_entries = tree->GetEntries();
+            file->source_id = EventSelectionCache::SourceIdentity(*inputFile, *tree);
+        }
+        if(manifest && manifest->IsFileDone(input, file->source_id) && !gSystem->AccessPathName(output.c_str())) {
+            std::cout << "'" << input << "' was already skimmed." << std::endl;
+            return;
+        }
+
+        const Long64_t chunk_size = args.chunk_size() ? static_cast<Long64_t>(args.chunk_size()) : n_entries;
+        std::vector<ChunkJob> file_jobs;
+        for(Long64_t first = 0; first == 0 || first < n_entries; first += std::max<Long64_t>(chunk_size, 1)) {
+            ChunkJob job;
+            job.file = file;
+            job.range = EntryRange(first, std::min(first + chunk_size, n_entries));
+            std::ostringstream part;
+            part << output << ".part_" << job.range.first << "_" << job.range.second;
+            job.part = part.str();
+            file->parts.push_back(job.part);
+            if(!manifest || !manifest->IsChunkDone(input, file->source_id, job.range)
+                    || gSystem->AccessPathName(job.part.c_str()))
+                file_jobs.push_back(job);
+            if(job.range.second >= n_entries) break;
+        }
+
+        file->n_remaining = file_jobs.size();
+        files.push_back(file);
+        if(file_jobs.empty())
+            Finalize(*file);
+        jobs.insert(jobs.end(), file_jobs.begin(), file_jobs.end());
+    }
+
+    void RunJob(const ChunkJob& job, EventPool& pool)
+    {
+        const std::string tmp_name = job.part + ".tmp";
+        {
+            SkimPipeline pipeline(args, layout, pool, stats, anaProducer.get(), anaWeightsConfig);
+            pipeline.Run(job.file->input, tmp_name, job.range, n_jobs == 1);
+        }
+        Rename(tmp_name, job.part);
+        if(manifest)
+            manifest->AddChunk(job.file->input, job.file->source_id, job.range);
+        if(--job.file->n_remaining == 0)
+            Finalize(*job.file);
+    }
+
+    // The parts are merged without decompressing the baskets, so the output keeps their layout.
+    void Finalize(const InputFile& file)
+    {
+        if(file.parts.size() == 1) {
+            Rename(file.parts.front(), file.output);
+        } else {
+            const std::string tmp_name = file.output + ".tmp";
+            {
+                auto outputFile = root_ext::CreateRootFile(tmp_name);
+                layout.Apply(*outputFile);
+                std::vector<std::string> tree_names = { args.treeName() };
+                if(anaProducer)
+                    tree_names.push_back(AnaTupleName(args.treeName()));
+                for(const auto& tree_name : tree_names) {
+                    TChain chain(tree_name.c_str());
+                    for(const auto& part : file.parts)
+                        chain.Add(part.c_str());
+                    chain.Merge(outputFile.get(), 0, "fast keep");
+                }
+                auto firstPart = root_ext::OpenRootFile(file.parts.front());
+                for(const auto& header_name : { TauIdColumns::HeaderName(args.treeName()),
+                                                AnaTupleWeightsConfigName(args.treeName()) }) {
+                    if(TObject* header = firstPart->Get(header_name.c_str()))
+                        outputFile->WriteTObject(header, header_name.c_str(), "Overwrite");
+                }
+            }
+            Rename(tmp_name, file.output);
+            for(const auto& part : file.parts)
+                gSystem->Unlink(part.c_str());
+        }
+        if(manifest)
+            manifest->AddFile(file.input, file.source_id);
+        std::cout << "'" << file.input << "' -> '" << file.output << "' done." << std::endl;
+    }
+
+    // Digest of everything the skimmed output depends on, except the input file.
+    std::string SkimConfig() const
+    {
+        std::ostringstream ss;
+        ss << "tree=" << args.treeName() << ";compact_tau_ids=" << args.compact_tau_ids() << ";layout="
+           << layout.ToString() << ";ana_tuple=" << args.ana_tuple();
+        if(args.ana_tuple())
+            ss << ";weights=" << anaWeightsConfig;
+        return TextDigest(ss.str());
+    }
+
+    static void Rename(const std::string& from, const std::string& to)
+    {
+        if(gSystem->Rename(from.c_str(), to.c_str()))
+            throw exception("Unable to move '%1%' to '%2%'.") % from % to;
+    }
+
+    // Several inputs with the same name would be skimmed into the same output file.
+    static std::vector<std::string> FindUniqueInputFiles(const std::string& path)
+    {
+        const std::vector<std::string> inputs = FindInputFiles(path);
+        std::set<std::string> names;
+        for(const auto& input : inputs) {
+            if(!names.insert(BaseName(input)).second)
+                throw exception("Several input files have the same name '%1%'.") % BaseName(input);
+        }
+        return inputs;
+    }
+
+    static void ReportStage(const std::string& name, const SkimPipeline::StageStats& stats, size_t n_threads)
+    {
+        const double busy_time = stats.busy_ns / 1e9;
+        std::cout << "    " << name << ": " << stats.n_events << " events, busy time " << busy_time << " s";
+        if(busy_time > 0)
+            std::cout << ", " << stats.n_events * n_threads / busy_time << " events/s";
+        std::cout << " (" << n_threads << " thread" << (n_threads > 1 ? "s" : "") << ")." << std::endl;
+    }
+
 private:
     Arguments args;
-    EventQueue processQueue, writeQueue;
+    const size_t n_workers, n_jobs;
+    const TupleLayout layout;
+    std::shared_ptr<BaseAnaTupleProducer> anaProducer;
+    std::string anaWeightsConfig;
+    std::shared_ptr<SkimManifest> manifest;
+    std::vector<std::shared_ptr<InputFile>> files;
+    std::vector<ChunkJob> jobs;
+    SkimPipeline::Stats stats;
 };
 
 } // namespace analysis
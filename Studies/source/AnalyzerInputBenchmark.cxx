@@ -0,0 +1,120 @@
+/*! Benchmark of the analyzer input stage: synchronous reading vs reading with background prefetch.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <chrono>
+#include <iomanip>
+
+#include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "h-tautau/Analysis/include/Htautau_2015.h"
+#include "hh-bbtautau/Analysis/include/AnalysisCategories.h"
+#include "hh-bbtautau/Analysis/include/EventTupleReader.h"
+#include "hh-bbtautau/Analysis/include/PageCache.h"
+
+struct Arguments {
+    REQ_ARG(std::string, input_file);
+    REQ_ARG(std::string, tree_name);
+    OPT_ARG(unsigned, prefetch_events, 1000);
+    OPT_ARG(unsigned, tree_cache_mb, 50);
+    OPT_ARG(Long64_t, max_entries, 0);
+};
+
+namespace analysis {
+
+// For each page cache state (cold and warm) three passes are timed: read only (T_read), synchronous read and
+// processing (T_sync) and read with prefetch and processing (T_async). The processing is the per-event part of the
+// analyzer selection. The overlap efficiency is the fraction of the shorter stage hidden by the prefetch:
+// (T_sync - T_async) / min(T_read, T_sync - T_read).
+class AnalyzerInputBenchmark {
+public:
+    using clock = std::chrono::steady_clock;
+    using NameSet = EventTupleReader::NameSet;
+    using EntryRange = EventTupleReader::EntryRange;
+
+    struct PassResult {
+        double time;
+        double checksum;
+        Long64_t n_events;
+    };
+
+    AnalyzerInputBenchmark(const Arguments& _args) : args(_args) {}
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        ROOT::EnableThreadSafety();
+#endif
+        Long64_t n_entries;
+        {
+            auto file = root_ext::OpenRootFile(args.input_file());
+            n_entries = root_ext::ReadObject<TTree>(*file, args.tree_name())->GetEntries();
+        }
+        if(args.max_entries() > 0)
+            n_entries = std::min(n_entries, args.max_entries());
+        const EntryRange entryRange(0, n_entries);
+        std::cout << "Benchmarking " << args.input_file() << "/" << args.tree_name() << ": " << n_entries
+                  << " entries, prefetch = " << args.prefetch_events() << " events, tree cache = "
+                  << args.tree_cache_mb() << " MB." << std::endl;
+
+        for(bool cold : { true, false }) {
+            if(!cold)
+                RunPass(entryRange, 0, false);
+            const PassResult read = RunPass(entryRange, 0, false, cold);
+            const PassResult sync = RunPass(entryRange, 0, true, cold);
+            const PassResult async = RunPass(entryRange, args.prefetch_events(), true, cold);
+            if(sync.checksum != async.checksum || sync.n_events != async.n_events)
+                throw exception("Prefetched events differ from the synchronously read events.");
+
+            const double process_time = std::max(sync.time - read.time, 0.);
+            const double hidden_max = std::min(read.time, process_time);
+            const double efficiency = hidden_max > 0 ? (sync.time - async.time) / hidden_max : 0;
+            std::cout << std::fixed << std::setprecision(3) << (cold ? "Cold" : "Warm") << " page cache: T_read = "
+                      << read.time << " s, T_sync = " << sync.time << " s, T_async = " << async.time
+                      << " s, speedup = " << sync.time / async.time << ", overlap efficiency = "
+                      << std::setprecision(1) << efficiency * 100 << "%." << std::defaultfloat << std::endl;
+        }
+    }
+
+private:
+    PassResult RunPass(const EntryRange& entryRange, size_t n_prefetch, bool process, bool drop_page_cache = false)
+    {
+        static const NameSet disabled_branches = { "lhe_particle_pdg", "lhe_particle_p4" };
+
+        if(drop_page_cache && !DropPageCache(args.input_file()))
+            std::cerr << "Warning: unable to drop the page cache for " << args.input_file() << "." << std::endl;
+
+        PassResult result{ 0, 0, 0 };
+        const auto start = clock::now();
+        EventTupleReader reader(args.input_file(), args.tree_name(), disabled_branches, entryRange, n_prefetch,
+                                static_cast<Long64_t>(args.tree_cache_mb()) * 1024 * 1024);
+        while(const ntuple::Event* event = reader.Next()) {
+            ++result.n_events;
+            if(process)
+                result.checksum += ProcessEvent(*event);
+        }
+        result.time = std::chrono::duration<double>(clock::now() - start).count();
+        return result;
+    }
+
+    static double ProcessEvent(const ntuple::Event& eventData)
+    {
+        const auto bjet_pair = EventInfoBase::SelectBjetPair(eventData, cuts::Htautau_2015::btag::pt,
+                                                             cuts::Htautau_2015::btag::eta, JetOrdering::CSV);
+        EventInfoBase event(eventData, bjet_pair);
+        const EventCategoryVector categories = DetermineEventCategories(eventData.jets_csv, bjet_pair, 0,
+                                                                        cuts::Htautau_2015::btag::CSVL,
+                                                                        cuts::Htautau_2015::btag::CSVM, false);
+        double value = static_cast<double>(categories.size()) + event.GetHiggsTTMomentum(true).M();
+        if(event.HasBjetPair())
+            value += event.GetHiggsBB().GetMomentum().M();
+        return value;
+    }
+
+private:
+    Arguments args;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::AnalyzerInputBenchmark, Arguments)
@@ -0,0 +1,83 @@
+/*! Validation of BTagWeightService against the b-tag weight of EventWeights.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <cmath>
+#include <iomanip>
+
+#include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/ProgressReporter.h"
+#include "h-tautau/Analysis/include/EventTuple.h"
+#include "h-tautau/McCorrections/include/EventWeights.h"
+#include "hh-bbtautau/Analysis/include/BTagWeightService.h"
+
+struct Arguments {
+    REQ_ARG(std::string, input_file);
+    REQ_ARG(std::string, tree_name);
+    REQ_ARG(std::string, btag_eff_file);
+    REQ_ARG(std::string, btag_sf_file);
+    OPT_ARG(double, btag_sf_tolerance, 0);
+    OPT_ARG(Long64_t, max_entries, 10000);
+    OPT_ARG(double, max_relative_difference, 1e-4);
+};
+
+namespace analysis {
+
+// Compares the central weight of BTagWeightService, as used by ComputeCorrectionWeight, with the b-tag weight of
+// EventWeights, which is the ratio of the total weights computed with and without the b-tag weight, on the first
+// max_entries MC events. The b-tag files should be the ones used by EventWeights. The program fails if the
+// relative difference of any event exceeds max_relative_difference.
+class BTagWeightValidation {
+public:
+    BTagWeightValidation(const Arguments& _args)
+        : args(_args), eventWeights(Period::Run2015, DiscriminatorWP::Medium),
+          bTagWeight(args.btag_eff_file(), args.btag_sf_file(), btag_calibration::BTagEntry::OP_MEDIUM,
+                     cuts::Htautau_2015::btag::CSVM, args.btag_sf_tolerance()) {}
+
+    void Run()
+    {
+        auto file = root_ext::OpenRootFile(args.input_file());
+        ntuple::EventTuple tuple(args.tree_name(), file.get(), true, { "lhe_particle_pdg", "lhe_particle_p4" });
+        const Long64_t n_entries = args.max_entries() > 0 ? std::min(args.max_entries(), tuple.GetEntries())
+                                                          : tuple.GetEntries();
+        tools::ProgressReporter reporter(10, std::cout, "Comparing b-tag weights...");
+        reporter.SetTotalNumberOfEvents(n_entries);
+        double max_difference = 0;
+        size_t n_compared = 0, n_failed = 0;
+        for(Long64_t entry = 0; entry < n_entries; ++entry) {
+            reporter.Report(entry);
+            tuple.GetEntry(entry);
+            const ntuple::Event& event = tuple.data();
+            const double without_btag = eventWeights.GetTotalWeight(event, false, cuts::Htautau_2015::btag::CSVM);
+            if(without_btag == 0) continue;
+            const double reference = eventWeights.GetTotalWeight(event, true, cuts::Htautau_2015::btag::CSVM)
+                    / without_btag;
+            const double weight = bTagWeight.GetWeight(event);
+            const double difference = std::abs(weight - reference) / std::max(std::abs(reference), 1e-10);
+            max_difference = std::max(max_difference, difference);
+            ++n_compared;
+            if(difference > args.max_relative_difference()) {
+                if(n_failed < 10)
+                    std::cerr << "Event " << event.run << ":" << event.lumi << ":" << event.evt << ": weight = "
+                              << std::setprecision(10) << weight << ", EventWeights = " << reference << "."
+                              << std::endl;
+                ++n_failed;
+            }
+        }
+        reporter.Report(n_entries, true);
+        std::cout << n_compared << " events compared, max relative difference = " << max_difference << "."
+                  << std::endl;
+        if(n_failed)
+            throw exception("The b-tag weight differs from the EventWeights value in %1% of %2% events.") % n_failed
+                % n_compared;
+    }
+
+private:
+    Arguments args;
+    mc_corrections::EventWeights eventWeights;
+    BTagWeightService bTagWeight;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::BTagWeightValidation, Arguments)
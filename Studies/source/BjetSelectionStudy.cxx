@@ -1,9 +1,17 @@
 /*! Study of different posibilities to select signal b-jets.
 This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
-#include "Analysis/include/LightBaseFlatTreeAnalyzer.h"
+#include "AnalysisTools/Run/include/program_main.h"
+#include "hh-bbtautau/Analysis/include/LightBaseEventAnalyzer.h"
 #include "hh-bbtautau/Analysis/include/FlatAnalyzerData.h"
 
+struct Arguments {
+    REQ_ARG(std::string, inputFileName);
+    REQ_ARG(std::string, outputFileName);
+    OPT_ARG(unsigned, n_threads, 1);
+    OPT_ARG(std::string, kinfit_store, "");
+};
+
 class BjetSelectionStudyData : public root_ext::AnalyzerData {
 public:
     BjetSelectionStudyData(std::shared_ptr<TFile> outputFile) : root_ext::AnalyzerData(outputFile) {}
@@ -33,16 +41,32 @@ public:
 
 class BjetSelectionStudy : public analysis::LightBaseFlatTreeAnalyzer {
 public:
-    BjetSelectionStudy(const std::string& _inputFileName, const std::string& _outputFileName)
-         : LightBaseFlatTreeAnalyzer(_inputFileName,_outputFileName), anaData(GetOutputFile())
+    BjetSelectionStudy(const std::string& _inputFileName, const std::string& _outputFileName, size_t n_threads = 1,
+                       const std::string& kinfitStoreFileName = "")
+         : LightBaseFlatTreeAnalyzer(_inputFileName, _outputFileName, n_threads, kinfitStoreFileName),
+           anaData(GetOutputFile())
     {
         recalc_kinfit = true;
         do_retag = false;
     }
 
+    BjetSelectionStudy(const Arguments& args)
+        : BjetSelectionStudy(args.inputFileName(), args.outputFileName(), args.n_threads(), args.kinfit_store()) {}
+
 protected:
+    // Event infos and kinematic fits of all pair combinations are built concurrently before the selection strategies
+    // are applied. The pairs are ranked by the HHKinFit2 results (see GetKinFitResults).
     virtual PairSelectionMap SelectBjetPairs(const ntuple::Sync& event) override
     {
+        using analysis::FlatEventInfo;
+        const size_t n_bjets = event.pt_Bjets.size();
+        std::vector<analysis::SyncEventInfo::BjetPair> all_pairs;
+        if(n_bjets >= 2) {
+            for(size_t n = 0; n < FlatEventInfo::NumberOfCombinationPairs(n_bjets); ++n)
+                all_pairs.push_back(FlatEventInfo::CombinationIndexToPair(n, n_bjets));
+        }
+        PrepareFlatEventInfos(event, all_pairs);
+
         PairSelectionMap pairMap;
         pairMap["CSV"] = SelectBestCsvPair(event);
         pairMap["Pt"] = SelectBestPtPair(event);
@@ -196,7 +220,7 @@ private:
     analysis::SyncEventInfo::BjetPair SelectBestChi2Pair(const ntuple::Sync& event)
     {
         using analysis::FlatEventInfo;
-        using analysis::kinematic_fit::four_body::FitResults;
+        using analysis::kin_fit::FitResults;
 
         const size_t n_bjets = event.pt_Bjets.size();
 
@@ -204,13 +228,11 @@ private:
         {
             const auto first_pair = FlatEventInfo::CombinationIndexToPair(first, n_bjets);
             const auto second_pair = FlatEventInfo::CombinationIndexToPair(second, n_bjets);
-            const FlatEventInfo& first_info = GetFlatEventInfo(event, first_pair);
-            const FlatEventInfo& second_info = GetFlatEventInfo(event, second_pair);
-            const FitResults& first_fit = first_info.fitResults;
-            const FitResults& second_fit = second_info.fitResults;
+            const FitResults& first_fit = GetKinFitResults(event, first_pair);
+            const FitResults& second_fit = GetKinFitResults(event, second_pair);
 
-            if(first_fit.has_valid_mass && !second_fit.has_valid_mass) return true;
-            if(!first_fit.has_valid_mass) return false;
+            if(first_fit.HasValidMass() && !second_fit.HasValidMass()) return true;
+            if(!first_fit.HasValidMass()) return false;
             return first_fit.chi2 < second_fit.chi2;
         };
 
@@ -220,7 +242,7 @@ private:
     analysis::SyncEventInfo::BjetPair SelectBestCsvPairWithMassWindow(const ntuple::Sync& event)
     {
         using analysis::FlatEventInfo;
-        using analysis::kinematic_fit::four_body::FitResults;
+        using analysis::kin_fit::FitResults;
         using namespace cuts::massWindow;
 
         const size_t n_bjets = event.pt_Bjets.size();
@@ -231,11 +253,11 @@ private:
             const auto second_pair = FlatEventInfo::CombinationIndexToPair(second, n_bjets);
             const FlatEventInfo& first_info = GetFlatEventInfo(event, first_pair);
             const FlatEventInfo& second_info = GetFlatEventInfo(event, second_pair);
-            const FitResults& first_fit = first_info.fitResults;
-            const FitResults& second_fit = second_info.fitResults;
+            const FitResults& first_fit = GetKinFitResults(event, first_pair);
+            const FitResults& second_fit = GetKinFitResults(event, second_pair);
 
-            if(first_fit.has_valid_mass && !second_fit.has_valid_mass) return true;
-            if(!first_fit.has_valid_mass) return false;
+            if(first_fit.HasValidMass() && !second_fit.HasValidMass()) return true;
+            if(!first_fit.HasValidMass()) return false;
 
             const bool firstPair_inside_mass_window = first_info.Hbb.M() > m_bb_low && first_info.Hbb.M() < m_bb_high;
             const bool secondPair_inside_mass_window = second_info.Hbb.M() > m_bb_low && second_info.Hbb.M() < m_bb_high;
@@ -254,7 +276,7 @@ private:
     {
 
         using analysis::FlatEventInfo;
-        using analysis::kinematic_fit::four_body::FitResults;
+        using analysis::kin_fit::FitResults;
         using namespace cuts::massWindow;
 
         const size_t n_bjets = event.pt_Bjets.size();
@@ -265,11 +287,11 @@ private:
             const auto second_pair = FlatEventInfo::CombinationIndexToPair(second, n_bjets);
             const FlatEventInfo& first_info = GetFlatEventInfo(event, first_pair);
             const FlatEventInfo& second_info = GetFlatEventInfo(event, second_pair);
-            const FitResults& first_fit = first_info.fitResults;
-            const FitResults& second_fit = second_info.fitResults;
+            const FitResults& first_fit = GetKinFitResults(event, first_pair);
+            const FitResults& second_fit = GetKinFitResults(event, second_pair);
 
-            if(first_fit.has_valid_mass && !second_fit.has_valid_mass) return true;
-            if(!first_fit.has_valid_mass) return false;
+            if(first_fit.HasValidMass() && !second_fit.HasValidMass()) return true;
+            if(!first_fit.HasValidMass()) return false;
 
             const bool firstPair_inside_mass_window = first_info.Hbb.M() > m_bb_low && first_info.Hbb.M() < m_bb_high;
             const bool secondPair_inside_mass_window = second_info.Hbb.M() > m_bb_low && second_info.Hbb.M() < m_bb_high;
@@ -287,7 +309,7 @@ private:
     analysis::SyncEventInfo::BjetPair SelectBestChi2PairWithMassWindow(const ntuple::Sync& event)
     {
         using analysis::FlatEventInfo;
-        using analysis::kinematic_fit::four_body::FitResults;
+        using analysis::kin_fit::FitResults;
         using namespace cuts::massWindow;
 
         const size_t n_bjets = event.pt_Bjets.size();
@@ -298,11 +320,11 @@ private:
             const auto second_pair = FlatEventInfo::CombinationIndexToPair(second, n_bjets);
             const FlatEventInfo& first_info = GetFlatEventInfo(event, first_pair);
             const FlatEventInfo& second_info = GetFlatEventInfo(event, second_pair);
-            const FitResults& first_fit = first_info.fitResults;
-            const FitResults& second_fit = second_info.fitResults;
+            const FitResults& first_fit = GetKinFitResults(event, first_pair);
+            const FitResults& second_fit = GetKinFitResults(event, second_pair);
 
-            if(first_fit.has_valid_mass && !second_fit.has_valid_mass) return true;
-            if(!first_fit.has_valid_mass) return false;
+            if(first_fit.HasValidMass() && !second_fit.HasValidMass()) return true;
+            if(!first_fit.HasValidMass()) return false;
 
             const bool firstPair_inside_mass_window = first_info.Hbb.M() > m_bb_low && first_info.Hbb.M() < m_bb_high;
             const bool secondPair_inside_mass_window = second_info.Hbb.M() > m_bb_low && second_info.Hbb.M() < m_bb_high;
@@ -318,3 +340,5 @@ private:
 private:
     BjetSelectionStudyData anaData;
 };
+
+PROGRAM_MAIN(BjetSelectionStudy, Arguments)
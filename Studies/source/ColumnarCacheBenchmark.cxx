@@ -0,0 +1,163 @@
+/*! Benchmark of the analyzer input formats: EventTuple, analysis-ready tuple and columnar event cache.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <chrono>
+#include <iomanip>
+
+#include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "hh-bbtautau/Analysis/include/AnaTupleProducer.h"
+#include "hh-bbtautau/Analysis/include/ColumnarEventCache.h"
+#include "hh-bbtautau/Analysis/include/EventSelectionCache.h"
+#include "hh-bbtautau/Analysis/include/EventTupleReader.h"
+#include "hh-bbtautau/Analysis/include/PageCache.h"
+
+struct Arguments {
+    REQ_ARG(std::string, input_file);
+    REQ_ARG(std::string, tree_name);
+    REQ_ARG(std::string, cache_dir);
+    OPT_ARG(bool, is_data, false);
+    OPT_ARG(unsigned, prefetch_events, 1000);
+    OPT_ARG(unsigned, tree_cache_mb, 50);
+};
+
+namespace analysis {
+
+// The same events are read from each input format as the analyzer reads them, and the values filled into the
+// histograms are accumulated into a checksum, which should be the same for all formats:
+//     EventTuple - the selection, observables, kinematic fit and weight are computed for each event;
+//     AnaTuple - the analysis-ready tuple stored by TupleSkimmer --ana_tuple, if present in the input file;
+//     columnar - the columnar cache produced by ColumnarCacheExporter in cache_dir.
+// Each format is timed with cold and warm page cache. The rate is given in input events per second, so the formats
+// which store only the selected events are compared with the full tuple on the same footing.
+// The b-tag weight service is not used here, so for the checksums to match the cache and the analysis-ready tuple
+// should be produced without the b-tag weight files.
+class ColumnarCacheBenchmark {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct PassResult {
+        double time, checksum;
+        size_t n_filled;
+    };
+
+    ColumnarCacheBenchmark(const Arguments& _args) : args(_args),
+        producer(BaseAnaTupleProducer::Create(args.tree_name(), args.is_data(), nullptr)) {}
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        ROOT::EnableThreadSafety();
+#endif
+        bool has_ana_tuple;
+        std::string source_id;
+        {
+            auto file = root_ext::OpenRootFile(args.input_file());
+            TTree* tree = root_ext::ReadObject<TTree>(*file, args.tree_name());
+            n_entries = tree->GetEntries();
+            source_id = EventSelectionCache::SourceIdentity(*file, *tree);
+            has_ana_tuple = file->Get(AnaTupleName(args.tree_name()).c_str()) != nullptr;
+        }
+        const std::string cache_file = ColumnarCacheFormat::MakeFileName(args.cache_dir(), args.input_file(),
+                                                                         args.tree_name(), source_id);
+        std::cout << "Benchmarking input formats of " << args.input_file() << "/" << args.tree_name() << ": "
+                  << n_entries << " entries." << std::endl;
+
+        for(bool cold : { true, false }) {
+            const PassResult tuple = RunTuplePass(cold);
+            Report("EventTuple", cold, tuple, tuple);
+            if(has_ana_tuple)
+                Report("AnaTuple", cold, RunAnaTuplePass(cold), tuple);
+            Report("columnar", cold, RunColumnarPass(cache_file, cold), tuple);
+        }
+    }
+
+private:
+    PassResult RunTuplePass(bool cold)
+    {
+        PrepareRead(args.input_file(), cold);
+        PassResult result{ 0, 0, 0 };
+        const auto start = clock::now();
+        EventTupleReader reader(args.input_file(), args.tree_name(), { "lhe_particle_pdg", "lhe_particle_p4" },
+                                EventTupleReader::EntryRange(0, n_entries), args.prefetch_events(),
+                                static_cast<Long64_t>(args.tree_cache_mb()) * 1024 * 1024);
+        ntuple::AnaEvent event;
+        while(const ntuple::Event* eventData = reader.Next()) {
+            if(static_cast<EventEnergyScale>(eventData->eventEnergyScale) != EventEnergyScale::Central) continue;
+            if(producer->Produce(*eventData, reader.GetTauIds(), event))
+                Accumulate(event, result);
+        }
+        result.time = std::chrono::duration<double>(clock::now() - start).count();
+        return result;
+    }
+
+    PassResult RunAnaTuplePass(bool cold) const
+    {
+        PrepareRead(args.input_file(), cold);
+        PassResult result{ 0, 0, 0 };
+        const auto start = clock::now();
+        auto file = root_ext::OpenRootFile(args.input_file());
+        ntuple::AnaTuple tuple(AnaTupleName(args.tree_name()), file.get(), true);
+        for(Long64_t entry = 0; entry < tuple.GetEntries(); ++entry) {
+            tuple.GetEntry(entry);
+            Accumulate(tuple.data(), result);
+        }
+        result.time = std::chrono::duration<double>(clock::now() - start).count();
+        return result;
+    }
+
+    PassResult RunColumnarPass(const std::string& cache_file, bool cold) const
+    {
+        PrepareRead(cache_file, cold);
+        PassResult result{ 0, 0, 0 };
+        const auto start = clock::now();
+        const ColumnarCacheReader reader(cache_file);
+        const AnaEventColumnReader columns(reader);
+        ntuple::AnaEvent event;
+        for(size_t row = 0; row < reader.GetNumberOfRows(); ++row) {
+            columns.Get(row, event);
+            Accumulate(event, result);
+        }
+        result.time = std::chrono::duration<double>(clock::now() - start).count();
+        return result;
+    }
+
+    static void Accumulate(const ntuple::AnaEvent& event, PassResult& result)
+    {
+        const double weight = event.weight;
+        result.checksum += weight * (event.m_sv + event.m_vis + event.pt_1 + event.pt_2 + event.MET_pt);
+        if(event.has_bjet_pair)
+            result.checksum += weight * (event.m_ttbb + event.pt_b1 + event.pt_b2 + event.csv_b1 + event.csv_b2);
+        if(event.kinfit_has_valid_mass)
+            result.checksum += weight * event.kinfit_mass;
+        ++result.n_filled;
+    }
+
+    void Report(const std::string& name, bool cold, const PassResult& result, const PassResult& reference) const
+    {
+        std::cout << std::fixed << std::setprecision(3) << (cold ? "Cold" : "Warm") << " page cache, "
+                  << std::setw(10) << name << ": " << result.time << " s, " << std::setprecision(0)
+                  << (result.time > 0 ? n_entries / result.time : 0) << " events/s";
+        if(&result != &reference && result.time > 0)
+            std::cout << std::setprecision(1) << ", speedup = " << reference.time / result.time;
+        std::cout << std::defaultfloat << "." << std::endl;
+        if(result.n_filled != reference.n_filled || result.checksum != reference.checksum)
+            std::cerr << "Warning: " << name << " events differ from the EventTuple events (" << result.n_filled
+                      << " vs " << reference.n_filled << " events)." << std::endl;
+    }
+
+    static void PrepareRead(const std::string& file_name, bool cold)
+    {
+        if(cold && !DropPageCache(file_name))
+            std::cerr << "Warning: unable to drop the page cache for " << file_name << "." << std::endl;
+    }
+
+private:
+    Arguments args;
+    std::shared_ptr<BaseAnaTupleProducer> producer;
+    Long64_t n_entries;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::ColumnarCacheBenchmark, Arguments)
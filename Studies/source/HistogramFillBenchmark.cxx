@@ -0,0 +1,116 @@
+/*! Benchmark of the buffered histogram filling of the event analyzer data against the per-event filling.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <chrono>
+#include <random>
+#include <iomanip>
+
+#include "AnalysisTools/Run/include/program_main.h"
+#include "hh-bbtautau/Analysis/include/EventAnalyzerData.h"
+
+struct Arguments {
+    OPT_ARG(size_t, n_events, 1000000);
+    OPT_ARG(unsigned, fill_buffer_size, 1024);
+    OPT_ARG(unsigned, seed, 12345);
+};
+
+namespace analysis {
+
+// Each event fills all 1D histograms of EventAnalyzerData<MuonCandidate> with random values which cover
+// the axis range plus underflow and overflow. The same values are filled with TH1::Fill and through the fill
+// buffers, then the throughputs are compared and the results are checked to be bit-identical.
+class HistogramFillBenchmark {
+public:
+    using clock = std::chrono::steady_clock;
+    using AnaData = EventAnalyzerData<MuonCandidate>;
+    using HistogramVector = std::vector<TH1D*>;
+
+    HistogramFillBenchmark(const Arguments& _args) : args(_args) {}
+
+    void Run()
+    {
+        TH1::SetDefaultSumw2();
+        TH1::AddDirectory(kFALSE);
+
+        AnaData direct(true), buffered(true);
+        direct.CreateAll();
+        buffered.CreateAll();
+        buffered.SetFillBufferSize(args.fill_buffer_size());
+        const HistogramVector direct_hists = GetHistograms(direct), buffered_hists = GetHistograms(buffered);
+
+        const size_t n_hists = direct_hists.size();
+        std::vector<double> values(args.n_events() * n_hists), weights(args.n_events());
+        std::mt19937_64 gen(args.seed());
+        std::uniform_real_distribution<double> uniform(-0.1, 1.1), weight_dist(0.5, 1.5);
+        for(size_t event_id = 0; event_id < args.n_events(); ++event_id) {
+            weights.at(event_id) = weight_dist(gen);
+            for(size_t hist_id = 0; hist_id < n_hists; ++hist_id) {
+                const TAxis& axis = *direct_hists.at(hist_id)->GetXaxis();
+                values.at(event_id * n_hists + hist_id) =
+                        axis.GetXmin() + uniform(gen) * (axis.GetXmax() - axis.GetXmin());
+            }
+        }
+
+        const auto direct_start = clock::now();
+        for(size_t event_id = 0; event_id < args.n_events(); ++event_id) {
+            for(size_t hist_id = 0; hist_id < n_hists; ++hist_id)
+                direct_hists[hist_id]->Fill(values[event_id * n_hists + hist_id], weights[event_id]);
+        }
+        const double direct_time = std::chrono::duration<double>(clock::now() - direct_start).count();
+
+        const auto buffered_start = clock::now();
+        for(size_t event_id = 0; event_id < args.n_events(); ++event_id) {
+            for(size_t hist_id = 0; hist_id < n_hists; ++hist_id)
+                buffered.FillHist(*buffered_hists[hist_id], values[event_id * n_hists + hist_id], weights[event_id]);
+        }
+        buffered.FlushFillBuffers();
+        const double buffered_time = std::chrono::duration<double>(clock::now() - buffered_start).count();
+
+        const double n_fills = static_cast<double>(args.n_events() * n_hists);
+        std::cout << args.n_events() << " events x " << n_hists << " histograms, fill buffer size = "
+                  << args.fill_buffer_size() << ".\n" << std::fixed << std::setprecision(3)
+                  << "TH1::Fill: " << direct_time << " s, " << n_fills / direct_time / 1e6 << " M fills/s.\n"
+                  << "Buffered: " << buffered_time << " s, " << n_fills / buffered_time / 1e6 << " M fills/s.\n"
+                  << "Speedup: " << direct_time / buffered_time << std::defaultfloat << std::endl;
+
+        for(size_t hist_id = 0; hist_id < n_hists; ++hist_id)
+            Compare(*direct_hists.at(hist_id), *buffered_hists.at(hist_id));
+        std::cout << "Buffered histograms are identical to the directly filled ones." << std::endl;
+    }
+
+private:
+    static HistogramVector GetHistograms(AnaData& anaData)
+    {
+        HistogramVector hists;
+        for(const auto& name : AnaData::GetOriginalHistogramNames<TH1D>()) {
+            if(auto hist = anaData.GetPtr<TH1D>(name))
+                hists.push_back(hist);
+        }
+        return hists;
+    }
+
+    static void Compare(const TH1D& expected, const TH1D& result)
+    {
+        if(expected.GetEntries() != result.GetEntries())
+            throw exception("Number of entries differs for histogram '%1%'.") % expected.GetName();
+        double expected_stats[TH1::kNstat] = {}, result_stats[TH1::kNstat] = {};
+        expected.GetStats(expected_stats);
+        result.GetStats(result_stats);
+        for(size_t n = 0; n < 4; ++n) {
+            if(expected_stats[n] != result_stats[n])
+                throw exception("Statistics differ for histogram '%1%'.") % expected.GetName();
+        }
+        for(Int_t bin = 0; bin <= expected.GetNbinsX() + 1; ++bin) {
+            if(expected.GetBinContent(bin) != result.GetBinContent(bin)
+                    || expected.GetBinError(bin) != result.GetBinError(bin))
+                throw exception("Bin %1% differs for histogram '%2%'.") % bin % expected.GetName();
+        }
+    }
+
+private:
+    Arguments args;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::HistogramFillBenchmark, Arguments)
@@ -1,46 +1,97 @@
 /*! Study of a kinematic fit performance.
 This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
+#include <fstream>
+
 #include "AnalysisTools/Run/include/program_main.h"
 #include "AnalysisTools/Core/include/RootExt.h"
 #include "h-tautau/Analysis/include/EventInfo.h"
 #include "h-tautau/Analysis/include/Htautau_2015.h"
+#include "hh-bbtautau/Analysis/include/KinFitResultStore.h"
+#include "hh-bbtautau/Analysis/include/EventIndex.h"
 
 struct Arguments {
     REQ_ARG(std::string, input_file);
     REQ_ARG(std::string, tree_name);
-    REQ_ARG(std::string, event_id);
+    OPT_ARG(std::string, event_id, "");
+    OPT_ARG(std::string, event_list, "");
+    OPT_ARG(std::string, index_dir, ".");
+    OPT_ARG(std::string, kinfit_store, "");
 };
 
 namespace analysis {
 
+// Events are given by event_id and/or by event_list, a text file with one event id per line. Their entries are
+// found through the event index of the input file, which is built on the first use and stored in index_dir.
+// If kinfit_store is set, the fit result is taken from the store and the fit is run only if it is not found.
+// It is the same store as the one of the analyzer (--kinfit_store), see KinFitResultStore.
 class KinFitStudy {
 public:
-    KinFitStudy(const Arguments& _args) : args(_args), eventId(args.event_id()), kinfitProducer(100) {}
+    KinFitStudy(const Arguments& _args) : args(_args), kinfitProducer(100)
+    {
+        if(args.event_id().size())
+            eventIds.push_back(EventIdentifier(args.event_id()));
+        if(args.event_list().size()) {
+            std::ifstream list(args.event_list());
+            if(!list.is_open())
+                throw exception("Unable to open event list '%1%'.") % args.event_list();
+            std::string line;
+            while(std::getline(list, line)) {
+                if(line.empty() || line.at(0) == '#') continue;
+                eventIds.push_back(EventIdentifier(line));
+            }
+        }
+        if(eventIds.empty())
+            throw exception("No event ids are specified.");
+        if(args.kinfit_store().size())
+            kinfitStore.reset(new KinFitResultStore(args.kinfit_store(), KinFitConfig::Default().ToString()));
+    }
 
     void Run()
     {
+        const EventIndex eventIndex(args.input_file(), args.tree_name(), args.index_dir());
+        std::cout << "Event index with " << eventIndex.GetNumberOfEntries() << " entries "
+                  << (eventIndex.IsLoaded() ? "loaded" : "created") << "." << std::endl;
+
         auto inputFile = root_ext::OpenRootFile(args.input_file());
         ntuple::EventTuple eventTuple(args.tree_name(), inputFile.get(), true, { "lhe_n_partons", "lhe_HT" });
-        const Long64_t n_entries = eventTuple.GetEntries();
-        for(Long64_t current_entry = 0; current_entry < n_entries; ++current_entry) {
-            eventTuple.GetEntry(current_entry);
+        for(const EventIdentifier& eventId : eventIds) {
+            Long64_t entry;
+            if(!eventIndex.Find(eventId, EventEnergyScale::Central, entry)) {
+                std::cout << "Event " << eventId << " not found." << std::endl;
+                continue;
+            }
+            eventTuple.GetEntry(entry);
             const auto bjet_pair = EventInfoBase::SelectBjetPair(eventTuple.data(), cuts::Htautau_2015::btag::pt,
                                                                  cuts::Htautau_2015::btag::eta, JetOrdering::CSV);
             EventInfoBase event(eventTuple.data(), bjet_pair);
-            if(eventId != event.GetEventId()) continue;
-            if(event.GetEnergyScale() != EventEnergyScale::Central) continue;
-
-            kinfitProducer.Fit(event->p4_1, event->p4_2, event.GetHiggsBB().GetFirstDaughter().GetMomentum(),
-                               event.GetHiggsBB().GetSecondDaughter().GetMomentum(), event.GetMET());
-            return;
+            const auto& b1 = event.GetHiggsBB().GetFirstDaughter().GetMomentum();
+            const auto& b2 = event.GetHiggsBB().GetSecondDaughter().GetMomentum();
+            const auto fit = [&]() {
+                return kinfitProducer.Fit(event->p4_1, event->p4_2, b1, b2, event.GetMET());
+            };
+            if(!kinfitStore) {
+                fit();
+                continue;
+            }
+            const size_t n_hits = kinfitStore->GetNumberOfHits();
+            const uint64_t inputs_digest = KinFitResultStore::InputsDigest(event->p4_1, event->p4_2, b1, b2,
+                                                                           event.GetMET().GetMomentum());
+            const auto result = kinfitStore->Get(event.GetEventId(), bjet_pair, event.GetEnergyScale(),
+                                                 inputs_digest, fit);
+            std::cout << "Event " << eventId << ": kinfit " << (kinfitStore->GetNumberOfHits() > n_hits
+                      ? "result loaded" : "done") << ", mass = " << result.mass << ", chi2 = " << result.chi2
+                      << ", convergence = " << result.convergence << std::endl;
         }
+        if(kinfitStore)
+            kinfitStore->Save();
     }
 
 private:
     Arguments args;
-    EventIdentifier eventId;
+    std::vector<EventIdentifier> eventIds;
     kin_fit::FitProducer kinfitProducer;
+    std::shared_ptr<KinFitResultStore> kinfitStore;
 };
 
 } // namespace analysis
@@ -0,0 +1,181 @@
+/*! Benchmark of the skimmed tuple layouts: file size and analyzer read throughput for each compression setting.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <chrono>
+#include <iomanip>
+
+#include <TSystem.h>
+
+#include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "hh-bbtautau/Analysis/include/BaseEventAnalyzer.h"
+#include "hh-bbtautau/Analysis/include/TupleLayout.h"
+#include "hh-bbtautau/Analysis/include/PageCache.h"
+
+struct Arguments {
+    REQ_ARG(std::string, input_file);
+    REQ_ARG(std::string, tree_name);
+    REQ_ARG(std::string, output_dir);
+    OPT_ARG(std::string, compressions, "ZLIB:1,LZ4:4,ZSTD:5,LZMA:9");
+    OPT_ARG(std::string, basket_sizes, "0");
+    OPT_ARG(std::string, auto_flushes, "0");
+    OPT_ARG(unsigned, prefetch_events, 1000);
+    OPT_ARG(unsigned, tree_cache_mb, 50);
+    OPT_ARG(Long64_t, max_entries, 0);
+    OPT_ARG(bool, keep_files, false);
+};
+
+namespace analysis {
+
+// The input tree is rewritten with each combination of compression, basket size and auto flush, the same way as
+// TupleSkimmer writes it. For each layout, the file size and the write time are measured, and the file is read as
+// BaseEventAnalyzer reads it (same active branches, tree cache and prefetch) with cold and warm page cache.
+// The analysis reads the skimmed tuples much more often than they are written, so the layouts are ranked by the
+// cold read throughput.
+class SkimLayoutBenchmark {
+public:
+    using clock = std::chrono::steady_clock;
+    using NameSet = EventTupleReader::NameSet;
+    using EntryRange = EventTupleReader::EntryRange;
+
+    struct LayoutResult {
+        TupleLayout layout;
+        double size_mb, write_time, cold_rate, warm_rate;
+    };
+
+    SkimLayoutBenchmark(const Arguments& _args) : args(_args) {}
+
+    void Run()
+    {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        ROOT::EnableThreadSafety();
+#endif
+        gSystem->mkdir(args.output_dir().c_str(), kTRUE);
+        Long64_t n_entries;
+        {
+            auto file = root_ext::OpenRootFile(args.input_file());
+            n_entries = root_ext::ReadObject<TTree>(*file, args.tree_name())->GetEntries();
+        }
+        if(args.max_entries() > 0)
+            n_entries = std::min(n_entries, args.max_entries());
+        const EntryRange entryRange(0, n_entries);
+        std::cout << "Benchmarking layouts of " << args.input_file() << "/" << args.tree_name() << ": " << n_entries
+                  << " entries." << std::endl;
+
+        std::vector<LayoutResult> results;
+        for(const auto& compression : Split(args.compressions())) {
+            for(const auto& basket_size : Split(args.basket_sizes())) {
+                for(const auto& auto_flush : Split(args.auto_flushes())) {
+                    LayoutResult result;
+                    try {
+                        result.layout = TupleLayout(compression, Parse<Int_t>(basket_size),
+                                                    Parse<Long64_t>(auto_flush));
+                    } catch(exception& e) {
+                        std::cerr << "Skipping layout '" << compression << "', " << basket_size << ", " << auto_flush
+                                  << ": " << e.what() << std::endl;
+                        continue;
+                    }
+                    const std::string file_name = args.output_dir() + "/layout_" + std::to_string(results.size())
+                            + ".root";
+                    Measure(file_name, entryRange, result);
+                    if(!args.keep_files())
+                        gSystem->Unlink(file_name.c_str());
+                    results.push_back(result);
+                }
+            }
+        }
+
+        std::sort(results.begin(), results.end(), [](const LayoutResult& a, const LayoutResult& b) {
+            return a.cold_rate > b.cold_rate;
+        });
+        std::cout << "\nLayouts ordered by the cold read throughput:\n" << std::fixed;
+        for(const auto& result : results) {
+            std::cout << std::setprecision(1) << std::setw(10) << result.size_mb << " MB, write "
+                      << std::setprecision(2) << result.write_time << " s, read " << std::setprecision(0)
+                      << result.cold_rate << " (cold) / " << result.warm_rate << " (warm) events/s: "
+                      << result.layout.ToString() << "\n";
+        }
+        std::cout << std::defaultfloat << std::flush;
+    }
+
+private:
+    void Measure(const std::string& file_name, const EntryRange& entryRange, LayoutResult& result) const
+    {
+        std::cout << "Layout " << result.layout.ToString() << "..." << std::endl;
+        result.write_time = Write(file_name, entryRange, result.layout);
+        NameSet disabled_branches;
+        {
+            auto file = root_ext::OpenRootFile(file_name);
+            result.size_mb = file->GetSize() / 1024. / 1024.;
+            BranchSelection branchSelection(BaseEventAnalyzer<MuonCandidate>::DefaultRequiredBranches(),
+                                            { "lhe_particle_pdg", "lhe_particle_p4" });
+            disabled_branches = branchSelection.GetDisabledBranches(*root_ext::ReadObject<TTree>(*file,
+                                                                                                 args.tree_name()));
+        }
+        const double n_events = static_cast<double>(entryRange.second - entryRange.first);
+        const double cold_time = Read(file_name, entryRange, disabled_branches, true);
+        const double warm_time = Read(file_name, entryRange, disabled_branches, false);
+        result.cold_rate = cold_time > 0 ? n_events / cold_time : 0;
+        result.warm_rate = warm_time > 0 ? n_events / warm_time : 0;
+    }
+
+    double Write(const std::string& file_name, const EntryRange& entryRange, const TupleLayout& layout) const
+    {
+        const auto start = clock::now();
+        auto inputFile = root_ext::OpenRootFile(args.input_file());
+        ntuple::EventTuple inputTuple(args.tree_name(), inputFile.get(), true,
+                                      { "lhe_particle_pdg", "lhe_particle_p4" });
+        auto outputFile = root_ext::CreateRootFile(file_name);
+        layout.Apply(*outputFile);
+        ntuple::EventTuple outputTuple(args.tree_name(), outputFile.get(), false,
+                                       { "lhe_particle_pdg", "lhe_particle_p4" });
+        layout.Apply(*root_ext::ReadObject<TTree>(*outputFile, args.tree_name()));
+        for(Long64_t entry = entryRange.first; entry < entryRange.second; ++entry) {
+            inputTuple.GetEntry(entry);
+            outputTuple() = inputTuple.data();
+            outputTuple.Fill();
+        }
+        outputTuple.Write();
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    double Read(const std::string& file_name, const EntryRange& entryRange, const NameSet& disabled_branches,
+                bool cold) const
+    {
+        if(cold && !DropPageCache(file_name))
+            std::cerr << "Warning: unable to drop the page cache for " << file_name << "." << std::endl;
+        const auto start = clock::now();
+        EventTupleReader reader(file_name, args.tree_name(), disabled_branches, entryRange, args.prefetch_events(),
+                                static_cast<Long64_t>(args.tree_cache_mb()) * 1024 * 1024);
+        while(reader.Next()) {}
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    static std::vector<std::string> Split(const std::string& list)
+    {
+        std::vector<std::string> items;
+        std::istringstream ss(list);
+        std::string item;
+        while(std::getline(ss, item, ','))
+            if(!item.empty())
+                items.push_back(item);
+        return items;
+    }
+
+    template<typename T>
+    static T Parse(const std::string& str)
+    {
+        std::istringstream ss(str);
+        T value;
+        if(!(ss >> value))
+            throw exception("Invalid number '%1%'.") % str;
+        return value;
+    }
+
+private:
+    Arguments args;
+};
+
+} // namespace analysis
+
+PROGRAM_MAIN(analysis::SkimLayoutBenchmark, Arguments)